@@ -26,12 +26,12 @@ void automorphisms_clear(AutomorphismGroup *autogrp) {
 
 void automorphisms_append(AutomorphismGroup *autogrp, partition *aut) {
     if (autogrp->sz == autogrp->allocated_sz) {
-        /* need to reallocate here */
-        /* will come back to this probably.. */
-        // for (int i = 0; i < autogrp->sz; ++i) {
-        //     visualize_partition(DEBUGFILE, autogrp->automorphisms[i]); ENDL();
-        // }
-        runtime_error("Need to implement resizing automorphism group!");
+        /* full, double it */
+        size_t new_sz = autogrp->allocated_sz ? autogrp->allocated_sz * 2 : 8;
+        partition **grown = (partition**)realloc(autogrp->automorphisms, sizeof(partition*)*new_sz);
+        if (grown == NULL) alloc_error("automorphisms_append");
+        autogrp->automorphisms = grown;
+        autogrp->allocated_sz = new_sz;
     }
 
     autogrp->automorphisms[autogrp->sz++] = aut;
@@ -80,6 +80,7 @@ void automorphisms_merge_perm_into_oribit(partition *permutation, partition* orb
             
             /* set cell 2 value (c2)    Increment p for next use */
             c2 = _get_cell_start_by_value(orbit, permutation->lab[++p]);
+            if (c2 == c1) continue;     /* already in the same orbit, nothing to merge */
             
             /* calc cell 2 len */
             for (j = c2; j < orbit->sz; ++j) {
@@ -23,7 +23,7 @@
 typedef struct {
     partition **automorphisms;
     size_t sz;
-    size_t allocated_sz;    /* originally allocated size DON'T UPDATE!!! */
+    size_t allocated_sz;    /* room in automorphisms, automorphisms_append doubles it when full */
     partition *theta;
     setword *mcr;
     size_t mcr_sz;
@@ -38,7 +38,7 @@ void automorphisms_calculate_mcr(partition *orbit, int *mcr, int *mcr_sz);
 
 
 #define DYNALLOCAUTOGROUP(name,startsz,n,msg) \
-    if ((name = (AutomorphismGroup*)malloc(sizeof(AutomorphismGroup))) == NULL) {alloc_error(msg);}; \
+    if ((name = (AutomorphismGroup*)calloc(1, sizeof(AutomorphismGroup))) == NULL) {alloc_error(msg);};  /* zeroed, for FREEAUTOGROUP */ \
     if ((name->automorphisms = (partition**)malloc(sizeof(partition*)*startsz)) == NULL) {alloc_error(msg);}; \
     name->sz = 0; \
     name->allocated_sz = startsz; \
@@ -22,7 +22,12 @@ void stack_push(BadStack *stack, PathNode *node) {
         ++stack->sp;
         stack->_private[stack->sp] = node;
     } else {
-        runtime_error("Can't push to stack, as it's full"); /* we can pretend to do hanlding */
+        /* full, double it.  The initial frontier can put a whole level of the tree on here */
+        PathNode **grown = (PathNode**)realloc(stack->_private, sizeof(PathNode*)*stack->allocated_sz*2);
+        if (grown == NULL) alloc_error("stack_push");
+        stack->_private = grown;
+        stack->allocated_sz *= 2;
+        stack->_private[++stack->sp] = node;
     }
 }
 
@@ -45,11 +50,21 @@ int stack_size(BadStack *stack){
 }
 
 void stack_initialize(BadStack *stack, int size){
-    /* get the size right, don't be thinking we're going to adjust it later! */
+    /* this is only the starting size, stack_push doubles it when it fills */
     stack->_private = malloc(sizeof(PathNode)*size);
     if (stack->_private == NULL) alloc_error("stack_new");
     stack->allocated_sz = size;
     stack->sp = -1;
+    stack->lock = NULL;
+}
+
+/* the owner wraps changes to the stack in these, they do nothing unless stack->lock is set */
+void stack_lock(BadStack *stack) {
+    if (stack->lock) pthread_mutex_lock(stack->lock);
+}
+
+void stack_unlock(BadStack *stack) {
+    if (stack->lock) pthread_mutex_unlock(stack->lock);
 }
 
 
@@ -78,4 +93,22 @@ void delete_from_bottom_of_stack(BadStack * stack, int count) {
 
     stack->sp -= count; /* set stack pointer to new top record on stack */
 
-}
\ No newline at end of file
+}
+
+/**
+ * Frees every node keep() returns FALSE for, and closes up the gaps, the order of the kept
+ * nodes doesn't change.  Returns how many were removed.
+ */
+int stack_filter(BadStack *stack, boolean (*keep)(PathNode *node, void *arg), void *arg) {
+    int kept = 0;
+    for (int i = 0; i <= stack->sp; ++i) {
+        if (keep(stack->_private[i], arg)) {
+            stack->_private[kept++] = stack->_private[i];
+        } else {
+            FREEPATHNODE(stack->_private[i]);
+        }
+    }
+    int removed = stack_size(stack) - kept;
+    stack->sp = kept - 1;
+    return removed;
+}
@@ -23,6 +23,7 @@
 #define _STACK_H_
 
 #include "pathnode.h"
+#include <pthread.h>
 
 
 typedef struct
@@ -30,6 +31,7 @@ typedef struct
     PathNode **_private;
     int sp;  /* top of stack */
     int allocated_sz; /* how big did we allocate the stack */  /* Yea, I really did say it was bad! */
+    pthread_mutex_t *lock; /* set while another thread can donate from this stack, NULL otherwise */
 } BadStack;
 
 
@@ -41,6 +43,9 @@ void stack_initialize(BadStack *stack, int size);
 void visualize_stack(FILE *f, BadStack *stack);
 PathNode* stack_peek_at(BadStack *stack, int idx);
 void delete_from_bottom_of_stack(BadStack * stack, int count);
+int stack_filter(BadStack *stack, boolean (*keep)(PathNode *node, void *arg), void *arg);
+void stack_lock(BadStack *stack);
+void stack_unlock(BadStack *stack);
 
 #endif /* _STACK_H_ */
  
\ No newline at end of file
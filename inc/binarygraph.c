@@ -0,0 +1,171 @@
+/**
+ * Copyright 2025 Jim Haslett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "binarygraph.h"
+#include "graphmap.h"
+#include "p_util.h"
+#include <sys/mman.h>
+
+
+static uint64_t _align(uint64_t off) {
+    return (off + BINARYGRAPH_ALIGN - 1) & ~(uint64_t)(BINARYGRAPH_ALIGN - 1);
+}
+
+/* fills in the section offsets and file size for h's n, m, flags and num_arcs */
+static void _layout(BinaryGraphHeader *h) {
+    uint64_t off = _align(sizeof(BinaryGraphHeader));
+    h->matrix_offset = off;
+    off = _align(off + sizeof(setword) * (uint64_t)h->m * h->n);
+    h->degrees_offset = 0;
+    if (h->flags & BINARYGRAPH_DEGREES) {
+        h->degrees_offset = off;
+        off = _align(off + sizeof(int) * (uint64_t)h->n);
+    }
+    h->csr_offset = 0;
+    if (h->flags & BINARYGRAPH_CSR) {
+        h->csr_offset = off;
+        off = _align(off + sizeof(uint64_t) * ((uint64_t)h->n + 1));
+        off += sizeof(int) * h->num_arcs;
+    }
+    h->file_sz = off;
+}
+
+/* the first targets after the offsets */
+static uint64_t _csr_targets_offset(BinaryGraphHeader *h) {
+    return _align(h->csr_offset + sizeof(uint64_t) * ((uint64_t)h->n + 1));
+}
+
+static void _bad_file(char *filename, char *why) {
+    printf("%s isn't a binary graph file this build can read, %s\n", filename, why);
+    exit(1);
+}
+
+/* writes sz bytes at p, then zeros up to the next section at *pos + sz aligned */
+static void _write_section(FILE *f, void *p, uint64_t sz, uint64_t *pos, char *filename) {
+    static char zeros[BINARYGRAPH_ALIGN];
+    uint64_t pad = _align(*pos + sz) - (*pos + sz);
+    if (fwrite(p, 1, sz, f) != sz || fwrite(zeros, 1, pad, f) != pad) {
+        printf("Can't write %s\n", filename);
+        exit(1);
+    }
+    *pos += sz + pad;
+}
+
+
+/**
+ * Maps filename and checks it is a binary graph for this machine.  The graph, degrees and CSR
+ * point into the mapping, nothing is read until the search touches it.  Exits on a bad file.
+ */
+BinaryGraph *binarygraph_open(char *filename) {
+    BinaryGraph *bg = (BinaryGraph*)calloc(1, sizeof(BinaryGraph));
+    if (bg == NULL) alloc_error("binarygraph_open");
+    bg->map = graphmap_map_file(filename, &bg->map_sz);
+
+    BinaryGraphHeader *h = (BinaryGraphHeader*)bg->map;
+    if (bg->map_sz < sizeof(BinaryGraphHeader) || memcmp(h->magic, BINARYGRAPH_MAGIC, 8) != 0) _bad_file(filename, "no header");
+    if (h->byte_order != BINARYGRAPH_BYTE_ORDER || h->wordsize != WORDSIZE) _bad_file(filename, "it was written with another byte order or word size");
+    if (h->n == 0 || h->n > INT32_MAX || h->m != SETWORDSNEEDED(h->n)) _bad_file(filename, "bad vertex count");
+
+    BinaryGraphHeader expect = *h;
+    _layout(&expect);
+    if (memcmp(&expect, h, sizeof(BinaryGraphHeader)) != 0 || h->file_sz != bg->map_sz) _bad_file(filename, "the sections don't add up, truncated?");
+
+    bg->header = h;
+    bg->n = (int)h->n;
+    bg->m = (int)h->m;
+    bg->digraph = h->digraph ? TRUE : FALSE;
+    bg->g = (graph*)(bg->map + h->matrix_offset);
+    if (h->flags & BINARYGRAPH_DEGREES) bg->degrees = (int*)(bg->map + h->degrees_offset);
+    if (h->flags & BINARYGRAPH_CSR) {
+        bg->csr_offsets = (uint64_t*)(bg->map + h->csr_offset);
+        bg->csr_targets = (int*)(bg->map + _csr_targets_offset(h));
+    }
+    madvise(bg->g, sizeof(setword) * (size_t)bg->m * bg->n, MADV_WILLNEED);   /* start reading ahead of the search */
+    return bg;
+}
+
+void binarygraph_close(BinaryGraph *bg) {
+    munmap(bg->map, bg->map_sz);
+    free(bg);
+}
+
+/**
+ * Writes g to filename as a binary graph, with out degrees and CSR if flags asks for them.
+ * Exits if it can't.
+ */
+void binarygraph_write(char *filename, graph *g, int m, int n, boolean digraph, int flags) {
+    BinaryGraphHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, BINARYGRAPH_MAGIC, 8);
+    h.byte_order = BINARYGRAPH_BYTE_ORDER;
+    h.wordsize = WORDSIZE;
+    h.n = n;
+    h.m = m;
+    h.digraph = digraph ? 1 : 0;
+    h.flags = flags;
+
+    int *degrees = (int*)malloc(sizeof(int) * (size_t)n);
+    if (degrees == NULL) alloc_error("binarygraph_write");
+    for (int v = 0; v < n; ++v) {
+        set *row = GRAPHROW(g,v,m);
+        degrees[v] = 0;
+        for (int w = 0; w < m; ++w) degrees[v] += __builtin_popcountl(row[w]);
+        h.num_arcs += degrees[v];
+    }
+    _layout(&h);
+
+    FILE *f = fopen(filename, "w");
+    if (f == NULL) {
+        printf("Can't open %s for writing\n", filename);
+        exit(1);
+    }
+    uint64_t written = 0;
+    _write_section(f, &h, sizeof(h), &written, filename);
+    _write_section(f, g, sizeof(setword) * (uint64_t)m * n, &written, filename);
+    if (flags & BINARYGRAPH_DEGREES) _write_section(f, degrees, sizeof(int) * (uint64_t)n, &written, filename);
+
+    if (flags & BINARYGRAPH_CSR) {
+        uint64_t *offsets = (uint64_t*)malloc(sizeof(uint64_t) * ((size_t)n + 1));
+        int *targets = (int*)malloc(sizeof(int) * (h.num_arcs + 1));
+        if (offsets == NULL || targets == NULL) alloc_error("binarygraph_write");
+        uint64_t k = 0;
+        for (int v = 0; v < n; ++v) {
+            set *row = GRAPHROW(g,v,m);
+            offsets[v] = k;
+            for (int w = 0; w < m; ++w) {
+                setword x = row[w];
+                while (x) {
+                    int pos = __builtin_clzl(x);
+                    targets[k++] = w * WORDSIZE + pos;
+                    x &= ~BITT[pos];
+                }
+            }
+        }
+        offsets[n] = k;
+        _write_section(f, offsets, sizeof(uint64_t) * ((uint64_t)n + 1), &written, filename);
+        if (fwrite(targets, sizeof(int), k, f) != k) {
+            printf("Can't write %s\n", filename);
+            exit(1);
+        }
+        free(offsets);
+        free(targets);
+    }
+    if (fclose(f) != 0) {
+        printf("Can't write %s\n", filename);
+        exit(1);
+    }
+    free(degrees);
+}
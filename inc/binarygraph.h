@@ -0,0 +1,77 @@
+/**
+ * Copyright 2025 Jim Haslett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Binary graph files (.pcg), a single graph stored the way the search holds it, so loading one
+ * is a single mmap and nothing is decoded or copied.  The file is a BinaryGraphHeader, then the
+ * sections it points at, each starting on a BINARYGRAPH_ALIGN byte boundary:
+ *
+ *      setword matrix[m*n]         the adjacency matrix, GRAPHROW(g,v,m) works on it as it is
+ *      int degrees[n]              out degrees, if BINARYGRAPH_DEGREES
+ *      uint64_t csr_offsets[n+1]   v's neighbours are csr_targets[csr_offsets[v] .. csr_offsets[v+1]),
+ *      int csr_targets[num_arcs]   in increasing order, if BINARYGRAPH_CSR
+ *
+ * Everything is in the writer's byte order and word size, a file from a machine that differs in
+ * either is refused rather than converted.  --to-binary=FILE writes one from any input format.
+ */
+
+#ifndef _BINARYGRAPH_H_
+#define _BINARYGRAPH_H_
+
+#include "proto.h"
+#include <stdint.h>
+
+#define BINARYGRAPH_MAGIC "PCANONG1"        /* first 8 bytes of the file */
+#define BINARYGRAPH_BYTE_ORDER 0x01020304u  /* reads back the same only in the writer's byte order */
+#define BINARYGRAPH_ALIGN 64                /* sections start on a cache line */
+
+#define BINARYGRAPH_DEGREES 1               /* BinaryGraphHeader flags */
+#define BINARYGRAPH_CSR 2
+
+
+typedef struct {
+    char magic[8];                  /* BINARYGRAPH_MAGIC */
+    uint32_t byte_order;            /* BINARYGRAPH_BYTE_ORDER */
+    uint32_t wordsize;              /* WORDSIZE */
+    uint32_t n;
+    uint32_t m;
+    uint32_t digraph;
+    uint32_t flags;                 /* BINARYGRAPH_DEGREES, BINARYGRAPH_CSR */
+    uint64_t num_arcs;              /* set bits in the matrix, 2 per edge of a graph */
+    uint64_t matrix_offset;         /* from the start of the file */
+    uint64_t degrees_offset;        /* 0 without BINARYGRAPH_DEGREES */
+    uint64_t csr_offset;            /* csr_offsets, csr_targets follow aligned, 0 without BINARYGRAPH_CSR */
+    uint64_t file_sz;
+} BinaryGraphHeader;
+
+typedef struct {
+    char *map;                      /* the whole file, mapped read only */
+    size_t map_sz;
+    BinaryGraphHeader *header;
+    graph *g;                       /* in the mapping */
+    int m, n;
+    boolean digraph;
+    int *degrees;                   /* NULL without BINARYGRAPH_DEGREES */
+    uint64_t *csr_offsets;          /* NULL without BINARYGRAPH_CSR */
+    int *csr_targets;
+} BinaryGraph;
+
+
+BinaryGraph *binarygraph_open(char *filename);
+void binarygraph_close(BinaryGraph *bg);
+void binarygraph_write(char *filename, graph *g, int m, int n, boolean digraph, int flags);
+
+#endif /* _BINARYGRAPH_H_ */
@@ -0,0 +1,247 @@
+/**
+ * Copyright 2025 Jim Haslett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "canoncache.h"
+#include "graphwriter.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define CANONCACHE_MAGIC_SZ 8
+
+
+/* bytes in a record for an n vertex graph whose partitions take label_ints ints */
+static size_t _record_size(size_t n, size_t label_ints) {
+    size_t m = (n + WORDSIZE - 1) / WORDSIZE;
+    size_t sz = sizeof(CacheRecordHeader) + 2 * sizeof(setword) * m * n + sizeof(int) * label_ints;
+    return ((sz + 7) & ~(size_t)7) + sizeof(unsigned long);
+}
+
+static unsigned long *_trailer(CacheRecordHeader *rec) {
+    return (unsigned long*)((char*)rec + rec->size - sizeof(unsigned long));
+}
+
+static graph *_input(CacheRecordHeader *rec) {
+    return (graph*)(rec + 1);
+}
+
+/* the canonical label, sz, lab and ptn, the automorphisms follow */
+static int *_labels(CacheRecordHeader *rec) {
+    size_t m = (rec->n + WORDSIZE - 1) / WORDSIZE;
+    return (int*)(_input(rec) + 2 * m * rec->n);
+}
+
+/* size of the complete record at off, 0 if there isn't one (yet) */
+static size_t _valid_record(CanonCache *c, size_t off, size_t file_sz) {
+    if (off + sizeof(CacheRecordHeader) > file_sz) return 0;
+    CacheRecordHeader *rec = (CacheRecordHeader*)(c->map + off);
+    if (rec->magic != CANONCACHE_RECORD || rec->n == 0 || rec->size != _record_size(rec->n, rec->label_ints) || off + rec->size > file_sz) return 0;
+    if (*_trailer(rec) != (rec->hash[0] ^ CANONCACHE_TRAILER)) return 0;
+    return rec->size;
+}
+
+static void _index_add(CanonCache *c, size_t off) {
+    if ((size_t)(c->num_records + 1) * 2 > c->mask + 1) {
+        /* double the table, at most half full */
+        size_t *old = c->slots, old_slots = c->mask + 1;
+        c->mask = 2 * old_slots - 1;
+        if ((c->slots = (size_t*)calloc(c->mask + 1, sizeof(size_t))) == NULL) alloc_error("canoncache _index_add");
+        c->num_records = 0;
+        for (size_t i = 0; i < old_slots; ++i) if (old[i]) _index_add(c, old[i]);
+        free(old);
+    }
+    CacheRecordHeader *rec = (CacheRecordHeader*)(c->map + off);
+    size_t i = rec->hash[0] & c->mask;
+    while (c->slots[i]) i = (i + 1) & c->mask;
+    c->slots[i] = off;
+    ++c->num_records;
+}
+
+/**
+ * Indexes the records other processes (or we) appended since the last time.  The mapping is
+ * made with room to spare so the file can grow a while before it has to be remapped.  Returns
+ * the size of the file.
+ */
+static size_t _refresh(CanonCache *c) {
+    struct stat st;
+    if (fstat(c->fd, &st) < 0) runtime_error("canoncache: can't stat the cache file");
+    size_t file_sz = (size_t)st.st_size;
+    if (file_sz < CANONCACHE_MAGIC_SZ) return file_sz;
+
+    if (file_sz > c->map_sz) {
+        if (c->map) munmap(c->map, c->map_sz);
+        c->map_sz = file_sz * 2 > (1 << 20) ? file_sz * 2 : (1 << 20);
+        c->map = (char*)mmap(NULL, c->map_sz, PROT_READ, MAP_SHARED, c->fd, 0);
+        if (c->map == MAP_FAILED) {
+            printf("Can't map the cache %s\n", c->filename);
+            exit(1);
+        }
+        if (c->indexed_sz == 0) {
+            if (memcmp(c->map, CANONCACHE_MAGIC, CANONCACHE_MAGIC_SZ) != 0) {
+                printf("%s isn't a canonical form cache, or is from an older version\n", c->filename);
+                exit(1);
+            }
+            c->indexed_sz = CANONCACHE_MAGIC_SZ;
+        }
+    }
+
+    size_t sz;
+    while ((sz = _valid_record(c, c->indexed_sz, file_sz)) != 0) {
+        _index_add(c, c->indexed_sz);
+        c->indexed_sz += sz;
+    }
+    return file_sz;
+}
+
+static void _write_all(int fd, char *p, size_t sz) {
+    while (sz > 0) {
+        ssize_t k = write(fd, p, sz);
+        if (k <= 0) runtime_error("canoncache: can't write to the cache file");
+        p += k;
+        sz -= (size_t)k;
+    }
+}
+
+
+/* opens filename as a cache, making it if it isn't there, exits if it can't */
+CanonCache *canoncache_open(char *filename) {
+    CanonCache *c = (CanonCache*)calloc(1, sizeof(CanonCache));
+    if (c == NULL) alloc_error("canoncache_open");
+    c->filename = filename;
+    if ((c->fd = open(filename, O_RDWR | O_CREAT | O_APPEND, 0666)) < 0) {
+        printf("Can't open the cache %s\n", filename);
+        exit(1);
+    }
+    c->mask = CANONCACHE_MIN_SLOTS - 1;
+    if ((c->slots = (size_t*)calloc(CANONCACHE_MIN_SLOTS, sizeof(size_t))) == NULL) alloc_error("canoncache_open");
+    _refresh(c);
+    return c;
+}
+
+void canoncache_close(CanonCache *c) {
+    if (c->map) munmap(c->map, c->map_sz);
+    close(c->fd);
+    free(c->slots);
+    free(c);
+}
+
+/**
+ * The record for g, or NULL if nobody has stored it.  Looks again at what was appended since
+ * the last look before it gives up.  The record stays good until the next lookup or store.
+ */
+CacheRecordHeader *canoncache_lookup(CanonCache *c, graph *g, int m, int n, boolean digraph) {
+    unsigned long h[2];
+    hash_words128(g, (size_t)m * n, ((unsigned long)n << 1) | (digraph ? 1 : 0), h);
+
+    for (int pass = 0; pass < 2; ++pass) {
+        if (pass == 1) {
+            size_t before = c->indexed_sz;
+            _refresh(c);
+            if (c->indexed_sz == before) return NULL;
+        }
+        for (size_t i = h[0] & c->mask; c->slots[i]; i = (i + 1) & c->mask) {
+            CacheRecordHeader *rec = (CacheRecordHeader*)(c->map + c->slots[i]);
+            if (rec->hash[0] == h[0] && rec->hash[1] == h[1] && rec->n == (uint32_t)n && rec->digraph == (uint32_t)(digraph ? 1 : 0)
+                && memcmp(_input(rec), g, sizeof(setword)*m*(size_t)n) == 0) return rec;
+        }
+    }
+    return NULL;
+}
+
+/* the canonical graph in rec */
+graph *canoncache_cert(CacheRecordHeader *rec) {
+    size_t m = (rec->n + WORDSIZE - 1) / WORDSIZE;
+    return _input(rec) + m * rec->n;
+}
+
+/* prints a cached result the way run() prints a search, and writes --output */
+void canoncache_report(CacheRecordHeader *rec, Options *opts) {
+    int n = rec->n, m = (n + WORDSIZE - 1) / WORDSIZE;
+    int *p = _labels(rec);
+    partition pi;
+
+    printf("\nCached in %s\n\n", opts->cachefilename);
+    for (uint32_t i = 0; i <= rec->num_autos; ++i) {
+        pi.sz = pi.allocated_sz = p[0];
+        pi.lab = p + 1;
+        pi.ptn = pi.lab + pi.sz;
+        p = pi.ptn + pi.sz;
+        printf(i == 0 ? "Canonical Label: " : "Automorphism: "); visualize_partition(DEBUGFILE, &pi); ENDL();
+    }
+
+    if (opts->outfilename == NULL) return;
+    FILE *outfile = fopen(opts->outfilename, "w");
+    if (outfile == NULL) {
+        printf("Can't open %s for writing\n", opts->outfilename);
+        return;
+    }
+    GraphWriter writer;
+    graphwriter_init(&writer, opts->output_format);
+    graphwriter_encode(&writer, canoncache_cert(rec), m, n, rec->digraph);
+    graphwriter_write(&writer, outfile);
+    graphwriter_free(&writer);
+    fclose(outfile);
+}
+
+/**
+ * Appends what the search in status found for status->g, unless another process got there
+ * first.  One write() under an exclusive flock(), so records never interleave.
+ */
+void canoncache_store(CanonCache *c, Status *status) {
+    int n = status->n, m = status->m;
+    int num_autos = (int)status->autogrp->sz;
+    size_t label_ints = 1 + 2 * status->cl->sz;
+    for (int i = 0; i < num_autos; ++i) label_ints += 1 + 2 * status->autogrp->automorphisms[i]->sz;
+    size_t sz = _record_size(n, label_ints);
+    char *buf = (char*)calloc(sz, 1);
+    if (buf == NULL) alloc_error("canoncache_store");
+
+    CacheRecordHeader *rec = (CacheRecordHeader*)buf;
+    rec->magic = CANONCACHE_RECORD;
+    rec->n = n;
+    rec->digraph = status->digraph ? 1 : 0;
+    rec->num_autos = num_autos;
+    rec->label_ints = label_ints;
+    hash_words128(status->g, (size_t)m * n, ((unsigned long)n << 1) | rec->digraph, rec->hash);
+    rec->size = sz;
+    memcpy(_input(rec), status->g, sizeof(setword)*m*(size_t)n);
+    memcpy(canoncache_cert(rec), status->best_invar, sizeof(setword)*m*(size_t)n);
+    int *p = _labels(rec);
+    for (int i = -1; i < num_autos; ++i) {
+        partition *pi = i < 0 ? status->cl : status->autogrp->automorphisms[i];
+        *p++ = (int)pi->sz;
+        memcpy(p, pi->lab, sizeof(int)*pi->sz);
+        memcpy(p + pi->sz, pi->ptn, sizeof(int)*pi->sz);
+        p += 2 * pi->sz;
+    }
+    *_trailer(rec) = rec->hash[0] ^ CANONCACHE_TRAILER;
+
+    flock(c->fd, LOCK_EX);
+    size_t file_sz = _refresh(c);
+    if (file_sz < CANONCACHE_MAGIC_SZ) {
+        /* new file, or a writer died before the magic was out */
+        if (ftruncate(c->fd, 0) != 0) runtime_error("canoncache: can't truncate the cache file");
+        _write_all(c->fd, CANONCACHE_MAGIC, CANONCACHE_MAGIC_SZ);
+    } else if (file_sz > c->indexed_sz) {
+        /* we hold the lock, so nobody is still writing that, it's torn */
+        if (ftruncate(c->fd, c->indexed_sz) != 0) runtime_error("canoncache: can't truncate the cache file");
+    }
+    if (canoncache_lookup(c, status->g, m, n, status->digraph) == NULL) _write_all(c->fd, buf, sz);
+    flock(c->fd, LOCK_UN);
+    free(buf);
+}
@@ -0,0 +1,82 @@
+/**
+ * Copyright 2025 Jim Haslett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Persistent canonical form cache, --cache=FILE.  The file maps an input graph, by a 128 bit
+ * hash of its adjacency matrix, to what the search found for it: the canonical label, the
+ * canonical graph and the automorphisms.  It is looked at before a graph is searched, and the
+ * result is added after, so the same graph isn't searched again by a later job.
+ *
+ * The file is CANONCACHE_MAGIC then records, only ever appended to.  Each record is a
+ * CacheRecordHeader then
+ *
+ *      setword graph[m*n]          the input graph, compared on a hit so a hash collision can't lie
+ *      setword cert[m*n]           the canonical graph, best_invar
+ *      int sz, lab[sz], ptn[sz]    the canonical label
+ *      int sz, lab[sz], ptn[sz]    for each automorphism
+ *      padding to 8 bytes, then the trailer, hash[0] ^ CANONCACHE_TRAILER
+ *
+ * Writers append a whole record with one write() while holding flock() on the file.  Readers
+ * never lock: they map the file read only, and each process indexes the records it has seen
+ * in its own hash table.  A record whose trailer isn't there yet is still being written, the
+ * index stops in front of it and picks it up on a later miss.  A record torn by a writer that
+ * died is cut off by the next writer, which holds the lock so it knows nobody is writing it.
+ */
+
+#ifndef _CANONCACHE_H_
+#define _CANONCACHE_H_
+
+#include "pcanon.h"
+#include <stdint.h>
+
+#define CANONCACHE_MAGIC "PCANONC2"             /* first 8 bytes of the file, 1 had non canonical forms */
+#define CANONCACHE_RECORD 0x52434350u           /* "PCCR", starts every record */
+#define CANONCACHE_TRAILER 0x5452414C4C494146UL /* xored into hash[0] to end a record */
+#define CANONCACHE_MIN_SLOTS 1024
+
+
+typedef struct {
+    uint32_t magic;                 /* CANONCACHE_RECORD */
+    uint32_t n;
+    uint32_t digraph;
+    uint32_t num_autos;
+    uint32_t label_ints;            /* ints taken by the canonical label and the automorphisms */
+    uint32_t unused;
+    unsigned long hash[2];          /* hash_words128 of the input graph */
+    uint64_t size;                  /* bytes in the whole record, trailer included */
+} CacheRecordHeader;
+
+typedef struct {
+    char *filename;
+    int fd;
+    char *map;                      /* the file mapped read only */
+    size_t map_sz;
+    size_t indexed_sz;              /* the records before here are in slots */
+
+    size_t *slots;                  /* offsets of records, 0 is an empty slot (the magic is at 0) */
+    size_t mask;                    /* number of slots - 1 */
+    long num_records;
+} CanonCache;
+
+
+CanonCache *canoncache_open(char *filename);
+void canoncache_close(CanonCache *c);
+CacheRecordHeader *canoncache_lookup(CanonCache *c, graph *g, int m, int n, boolean digraph);
+graph *canoncache_cert(CacheRecordHeader *rec);
+void canoncache_report(CacheRecordHeader *rec, Options *opts);
+void canoncache_store(CanonCache *c, Status *status);
+
+#endif /* _CANONCACHE_H_ */
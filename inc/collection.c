@@ -0,0 +1,243 @@
+/**
+ * Copyright 2025 Jim Haslett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "collection.h"
+#include "p_gtools.h"
+#include "graphwriter.h"
+#include "canoncache.h"
+
+
+/* adds a finished chunk to log, growing it as needed */
+static void _log_chunk(CollectionLog *log, long chunk, long bytes) {
+    if (log->sz == log->allocated_sz) {
+        log->allocated_sz = log->allocated_sz ? log->allocated_sz * 2 : 64;
+        log->chunk = (long*)realloc(log->chunk, sizeof(long)*log->allocated_sz);
+        log->bytes = (long*)realloc(log->bytes, sizeof(long)*log->allocated_sz);
+        if (log->chunk == NULL || log->bytes == NULL) alloc_error("_log_chunk");
+    }
+    log->chunk[log->sz] = chunk;
+    log->bytes[log->sz] = bytes;
+    ++log->sz;
+}
+
+/* takes the next chunk number from the counter on rank 0 */
+static long _claim_chunk(MPI_Win win) {
+    long one = 1, chunk;
+    MPI_Fetch_and_op(&one, &chunk, MPI_LONG, 0, 0, MPI_SUM, win);
+    MPI_Win_flush(0, win);
+    return chunk;
+}
+
+/**
+ * Moves f to the first line starting at or after begin.  A line that runs over begin belongs
+ * to the chunk before, so unless begin is right after a newline we skip to the next one.
+ */
+static void _seek_chunk(FILE *f, off_t begin, off_t data_start) {
+    int c;
+    if (begin == data_start) {
+        fseeko(f, begin, SEEK_SET);
+        return;
+    }
+    fseeko(f, begin - 1, SEEK_SET);
+    while ((c = getc(f)) != EOF && c != '\n') {}
+}
+
+/**
+ * --merge, rank 0 puts the shards together into outfilename in chunk order, then deletes them.
+ * Each process did its chunks in increasing order, so every shard is read straight through.
+ */
+static void _merge_shards(CollectionLog *log, long num_chunks, char *outfilename, int my_rank, int num_processes) {
+    int *counts = NULL, *displs = NULL;
+    long *chunks = NULL, *bytes = NULL;
+
+    if (my_rank == 0) {
+        counts = (int*)malloc(sizeof(int)*num_processes);
+        displs = (int*)malloc(sizeof(int)*num_processes);
+        if (counts == NULL || displs == NULL) alloc_error("_merge_shards");
+    }
+    MPI_Gather(&log->sz, 1, MPI_INT, counts, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    if (my_rank == 0) {
+        long total = 0;
+        for (int i = 0; i < num_processes; ++i) {
+            displs[i] = (int)total;
+            total += counts[i];
+        }
+        chunks = (long*)malloc(sizeof(long)*(total + 1));
+        bytes = (long*)malloc(sizeof(long)*(total + 1));
+        if (chunks == NULL || bytes == NULL) alloc_error("_merge_shards");
+    }
+    MPI_Gatherv(log->chunk, log->sz, MPI_LONG, chunks, counts, displs, MPI_LONG, 0, MPI_COMM_WORLD);
+    MPI_Gatherv(log->bytes, log->sz, MPI_LONG, bytes, counts, displs, MPI_LONG, 0, MPI_COMM_WORLD);
+    if (my_rank != 0) return;
+
+    /* who has each chunk, and how long it is */
+    int *owner = (int*)malloc(sizeof(int)*num_chunks);
+    long *len = (long*)malloc(sizeof(long)*num_chunks);
+    FILE **shards = (FILE**)calloc(num_processes, sizeof(FILE*));
+    char *buf = (char*)malloc(BUFSIZ);
+    size_t name_sz = strlen(outfilename) + 16;
+    char *name = (char*)malloc(name_sz);
+    if (owner == NULL || len == NULL || shards == NULL || buf == NULL || name == NULL) alloc_error("_merge_shards");
+    for (int r = 0; r < num_processes; ++r) {
+        for (int i = displs[r]; i < displs[r] + counts[r]; ++i) {
+            owner[chunks[i]] = r;
+            len[chunks[i]] = bytes[i];
+        }
+    }
+
+    FILE *outfile = fopen(outfilename, "w");
+    if (outfile == NULL) {
+        printf("Can't open %s for writing\n", outfilename);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    for (long k = 0; k < num_chunks; ++k) {
+        int r = owner[k];
+        if (shards[r] == NULL) {
+            snprintf(name, name_sz, "%s.%d", outfilename, r);
+            if ((shards[r] = fopen(name, "r")) == NULL) {
+                printf("Can't open shard %s\n", name);
+                MPI_Abort(MPI_COMM_WORLD, 1);
+            }
+        }
+        for (long left = len[k]; left > 0; ) {
+            size_t got = fread(buf, 1, left < BUFSIZ ? (size_t)left : BUFSIZ, shards[r]);
+            if (got == 0) runtime_error("_merge_shards: shard is shorter than its log");
+            fwrite(buf, 1, got, outfile);
+            left -= got;
+        }
+    }
+    fclose(outfile);
+
+    for (int r = 0; r < num_processes; ++r) {
+        if (shards[r]) fclose(shards[r]);
+        snprintf(name, name_sz, "%s.%d", outfilename, r);
+        remove(name);
+    }
+    free(owner);
+    free(len);
+    free(shards);
+    free(buf);
+    free(name);
+    free(counts);
+    free(displs);
+    free(chunks);
+    free(bytes);
+}
+
+
+/**
+ * --batch in the mpi build, every process calls this with its own handle on the graph file,
+ * positioned after any header by opengraphfile.  With --cache, every process looks in and
+ * adds to the same cache file.
+ */
+void run_collection(FILE *infile, char *infilename, Options *opts) {
+    double start_time = MPI_Wtime();
+    int my_rank, num_processes;
+    MPI_Comm_rank(MPI_COMM_WORLD, &my_rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &num_processes);
+
+    off_t data_start = ftello(infile);
+    fseeko(infile, 0, SEEK_END);
+    off_t file_sz = ftello(infile);
+    long chunk_bytes = opts->chunk_bytes;
+    long num_chunks = (file_sz - data_start + chunk_bytes - 1) / chunk_bytes;
+
+    /* this process's shard */
+    size_t name_sz = strlen(opts->outfilename) + 16;
+    char *shardname = (char*)malloc(name_sz);
+    if (shardname == NULL) alloc_error("run_collection");
+    snprintf(shardname, name_sz, "%s.%d", opts->outfilename, my_rank);
+    FILE *shard = fopen(shardname, "w");
+    if (shard == NULL) {
+        printf("Can't open %s for writing\n", shardname);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+
+    /* the chunk counter, one long on rank 0 */
+    MPI_Win win;
+    long *counter;
+    MPI_Win_allocate(my_rank == 0 ? sizeof(long) : 0, sizeof(long), MPI_INFO_NULL, MPI_COMM_WORLD, &counter, &win);
+    if (my_rank == 0) *counter = 0;
+    MPI_Win_lock_all(MPI_MODE_NOCHECK, win);
+    MPI_Win_sync(win);
+    MPI_Barrier(MPI_COMM_WORLD);    /* nobody takes a chunk before the counter is zeroed */
+
+    int m, n, total_refines = 0, total_autos = 0;
+    long graphs = 0, chunk;
+    boolean digraph;
+    graph *g = NULL;
+    size_t g_sz = 0;
+    BadStack *stack = malloc(sizeof(BadStack));
+    if (stack == NULL) alloc_error("run_collection");
+    stack_initialize(stack, 200);
+    Status *status = status_new();
+    CollectionLog log = {NULL, NULL, 0, 0};
+    GraphWriter writer;
+    graphwriter_init(&writer, opts->output_format);
+    CanonCache *cache = opts->cachefilename ? canoncache_open(opts->cachefilename) : NULL;
+    long hits = 0;
+
+    while ((chunk = _claim_chunk(win)) < num_chunks) {
+        off_t begin = data_start + chunk * chunk_bytes;
+        off_t end = begin + chunk_bytes;
+        _seek_chunk(infile, begin, data_start);
+        while (ftello(infile) < end && readg_reuse(infile, &g, &g_sz, &m, &n, &digraph) != NULL) {
+            CacheRecordHeader *rec = cache ? canoncache_lookup(cache, g, m, n, digraph) : NULL;
+            ++graphs;
+            if (rec) {
+                graphwriter_encode(&writer, canoncache_cert(rec), m, n, digraph);
+                ++hits;
+                continue;
+            }
+            canonicalize(status, stack, g, m, n, digraph);
+            graphwriter_encode(&writer, status->best_invar, m, n, digraph);
+            if (cache) canoncache_store(cache, status);
+            total_refines += status->refinement_count;
+            total_autos += status->autogrp->sz;
+        }
+        _log_chunk(&log, chunk, (long)writer.sz);
+        graphwriter_write(&writer, shard);     /* the whole chunk at once */
+    }
+    MPI_Win_unlock_all(win);
+    MPI_Win_free(&win);
+    fclose(shard);
+
+    long all_graphs, all_hits;
+    int all_refines, all_autos;
+    MPI_Reduce(&graphs, &all_graphs, 1, MPI_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+    MPI_Reduce(&hits, &all_hits, 1, MPI_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+    MPI_Reduce(&total_refines, &all_refines, 1, MPI_INT, MPI_SUM, 0, MPI_COMM_WORLD);
+    MPI_Reduce(&total_autos, &all_autos, 1, MPI_INT, MPI_SUM, 0, MPI_COMM_WORLD);
+
+    if (opts->merge) _merge_shards(&log, num_chunks, opts->outfilename, my_rank, num_processes);
+
+    if (my_rank == 0) {
+        double runtime = MPI_Wtime() - start_time;
+        fprintf(stderr, "Collection: %ld graphs, %d refinements, %f seconds, %d processes, %ld chunks\n", all_graphs, all_refines, runtime, num_processes, num_chunks);
+        if (cache) fprintf(stderr, "Cache: %ld hits, %ld searched\n", all_hits, all_graphs - all_hits);
+        log_output_to_file(infilename, all_refines, all_autos, runtime, num_processes);
+    }
+
+    if (cache) canoncache_close(cache);
+    free(stack->_private);
+    free(stack);
+    status_free(status);
+    graphwriter_free(&writer);
+    FREES(g);
+    free(log.chunk);
+    free(log.bytes);
+    free(shardname);
+}
@@ -0,0 +1,47 @@
+/**
+ * Copyright 2025 Jim Haslett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Collection mode, --batch in the mpi build.  The graphs in the file are split between the
+ * processes instead of the search tree of one graph.  The file is cut into chunks of
+ * --chunk-bytes bytes, a process takes the next chunk from a counter on rank 0 when it finishes
+ * the last one, so slow chunks don't hold the others up.  A line belongs to the chunk its first
+ * byte is in.  Every process writes its canonical graphs to its own shard, OUTPUT.<rank>, and
+ * --merge has rank 0 put the shards back together in input order.
+ */
+
+#ifndef _COLLECTION_H_
+#define _COLLECTION_H_
+
+#include "pcanon.h"
+#include "mpi.h"
+
+
+/**
+ * The chunks one process did, in the order it did them, which is increasing since the counter
+ * only goes up.  The merge needs them to find each chunk in the shards.
+ */
+typedef struct {
+    long *chunk;                /* chunk numbers */
+    long *bytes;                /* bytes written to the shard for each */
+    int sz;
+    int allocated_sz;
+} CollectionLog;
+
+
+void run_collection(FILE *infile, char *infilename, Options *opts);
+
+#endif /* _COLLECTION_H_ */
@@ -0,0 +1,127 @@
+/**
+ * Copyright 2025 Jim Haslett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "dedup.h"
+#include "util.h"
+#include <sched.h>
+
+
+/* TRUE if e holds this certificate, the hashes already match */
+static boolean _same_cert(DedupEntry *e, graph *cert, int m, int n, boolean digraph) {
+    return e->n == n && e->digraph == digraph && memcmp(e->cert, cert, sizeof(setword)*m*(size_t)n) == 0;
+}
+
+/* lowers e->first to index if index is earlier */
+static void _atomic_min(long *first, long index) {
+    long cur = __atomic_load_n(first, __ATOMIC_RELAXED);
+    while (index < cur && !__atomic_compare_exchange_n(first, &cur, index, FALSE, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+}
+
+
+/* a table for up to expected classes, at most half full */
+DedupTable *dedup_new(long expected) {
+    DedupTable *t = (DedupTable*)calloc(1, sizeof(DedupTable));
+    if (t == NULL) alloc_error("dedup_new");
+    size_t slots = DEDUP_MIN_SLOTS;
+    while (slots < 2 * (size_t)expected) slots *= 2;
+    if ((t->slots = (DedupEntry*)calloc(slots, sizeof(DedupEntry))) == NULL) alloc_error("dedup_new");
+    t->mask = slots - 1;
+    return t;
+}
+
+void dedup_free(DedupTable *t) {
+    for (size_t i = 0; i <= t->mask; ++i) FREES(t->slots[i].cert);
+    free(t->slots);
+    FREES(t->classes);
+    free(t);
+}
+
+/**
+ * Adds the graph at input position index, whose canonical graph is cert, to its class, making a
+ * new class if it is the first of its kind.  Safe to call from several threads at once.
+ * Returns the class.
+ */
+DedupEntry *dedup_insert(DedupTable *t, graph *cert, int m, int n, boolean digraph, long index) {
+    unsigned long h[2];
+    hash_words128(cert, (size_t)m * n, ((unsigned long)n << 1) | (digraph ? 1 : 0), h);
+
+    for (size_t i = h[0] & t->mask; ; i = (i + 1) & t->mask) {
+        DedupEntry *e = &t->slots[i];
+        int state = __atomic_load_n(&e->state, __ATOMIC_ACQUIRE);
+
+        if (state == DEDUP_EMPTY) {
+            int expected = DEDUP_EMPTY;
+            if (__atomic_compare_exchange_n(&e->state, &expected, DEDUP_BUSY, FALSE, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                e->n = n;
+                e->digraph = digraph;
+                e->hash[0] = h[0];
+                e->hash[1] = h[1];
+                if ((e->cert = (setword*)malloc(sizeof(setword)*m*(size_t)n + 1)) == NULL) alloc_error("dedup_insert");
+                memcpy(e->cert, cert, sizeof(setword)*m*(size_t)n);
+                e->first = index;
+                e->count = 1;
+                __atomic_store_n(&e->state, DEDUP_READY, __ATOMIC_RELEASE);
+                return e;
+            }
+            state = expected;   /* somebody else got it first */
+        }
+        while (state == DEDUP_BUSY) {
+            sched_yield();
+            state = __atomic_load_n(&e->state, __ATOMIC_ACQUIRE);
+        }
+
+        if (e->hash[0] == h[0] && e->hash[1] == h[1] && _same_cert(e, cert, m, n, digraph)) {
+            __atomic_fetch_add(&e->count, 1, __ATOMIC_RELAXED);
+            _atomic_min(&e->first, index);
+            return e;
+        }
+    }
+}
+
+/**
+ * TRUE if the graph at index is its class's representative.  Final once every graph before
+ * index has been inserted, later graphs can't take it away.
+ */
+boolean dedup_is_first(DedupEntry *e, long index) {
+    return __atomic_load_n(&e->first, __ATOMIC_RELAXED) == index;
+}
+
+/* remembers a representative that was written, the --counts file lists them in this order */
+void dedup_add_class(DedupTable *t, DedupEntry *e) {
+    if (t->num_classes == t->allocated_sz) {
+        t->allocated_sz = t->allocated_sz ? t->allocated_sz * 2 : 1024;
+        if ((t->classes = (DedupEntry**)realloc(t->classes, sizeof(DedupEntry*)*t->allocated_sz)) == NULL) alloc_error("dedup_add_class");
+    }
+    t->classes[t->num_classes++] = e;
+}
+
+/**
+ * End of a --dedup batch that read graphs graphs.  The summary goes to stderr, and with countsfilename
+ * (--counts=FILE) a line per class in output order, the input position of its representative
+ * (from 1, like the graph numbers nauty's tools print) and how many graphs are in it.
+ */
+void dedup_report(DedupTable *t, long graphs, char *countsfilename) {
+    fprintf(stderr, "Dedup: %ld graphs, %ld classes\n", graphs, t->num_classes);
+    if (countsfilename == NULL) return;
+
+    FILE *f = fopen(countsfilename, "w");
+    if (f == NULL) {
+        printf("Can't open %s for writing\n", countsfilename);
+        return;
+    }
+    for (long i = 0; i < t->num_classes; ++i) fprintf(f, "%ld %ld\n", t->classes[i]->first + 1, t->classes[i]->count);
+    fclose(f);
+}
@@ -0,0 +1,69 @@
+/**
+ * Copyright 2025 Jim Haslett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Isomorphism class table for --batch --dedup, like shortg.  The certificate of a graph is its
+ * canonical graph, best_invar, the graph relabeled by the canonical label.  Two graphs are
+ * isomorphic exactly when their certificates are equal, so the table is keyed by a 128 bit hash
+ * of the certificate, and certificates are only compared word for word when the hashes match.
+ *
+ * The table is open addressing with linear probing, sized up front from the number of graphs
+ * so it never grows, and threads insert into it without locks.  A slot is claimed with a
+ * compare and swap, filled, then marked ready, and each class keeps the smallest input position
+ * that landed in it, so the representative is the first graph of the class in the file however
+ * the threads were scheduled.
+ */
+
+#ifndef _DEDUP_H_
+#define _DEDUP_H_
+
+#include "proto.h"
+
+#define DEDUP_EMPTY 0
+#define DEDUP_BUSY 1                /* claimed, being filled in */
+#define DEDUP_READY 2
+
+#define DEDUP_MIN_SLOTS 1024
+
+
+typedef struct {
+    int state;                      /* DEDUP_EMPTY, DEDUP_BUSY or DEDUP_READY */
+    int n;
+    boolean digraph;
+    unsigned long hash[2];          /* hash_words128 of the certificate */
+    setword *cert;                  /* the canonical graph, m*n words */
+    long first;                     /* smallest input position in the class */
+    long count;                     /* graphs in the class */
+} DedupEntry;
+
+typedef struct {
+    DedupEntry *slots;
+    size_t mask;                    /* slots - 1, a power of two */
+
+    DedupEntry **classes;           /* the representatives in the order they were written, for --counts */
+    long num_classes;
+    long allocated_sz;
+} DedupTable;
+
+
+DedupTable *dedup_new(long expected);
+void dedup_free(DedupTable *t);
+DedupEntry *dedup_insert(DedupTable *t, graph *cert, int m, int n, boolean digraph, long index);
+boolean dedup_is_first(DedupEntry *e, long index);
+void dedup_add_class(DedupTable *t, DedupEntry *e);
+void dedup_report(DedupTable *t, long graphs, char *countsfilename);
+
+#endif /* _DEDUP_H_ */
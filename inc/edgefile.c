@@ -0,0 +1,141 @@
+/**
+ * Copyright 2025 Jim Haslett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "edgefile.h"
+#include "graphmap.h"
+#include "p_util.h"
+#include <limits.h>
+#include <sys/mman.h>
+
+
+/* TRUE if filename ends in ext */
+static boolean _has_extension(char *filename, const char *ext) {
+    size_t len = strlen(filename), ext_len = strlen(ext);
+    return len > ext_len && strcmp(filename + len - ext_len, ext) == 0;
+}
+
+/* reads an unsigned number at *p, skipping blanks first, FALSE if the line has no more */
+static boolean _number(char **p, char *eol, long *value) {
+    char *q = *p;
+    long v = 0;
+
+    while (q < eol && (*q == ' ' || *q == '\t')) ++q;
+    if (q == eol || *q < '0' || *q > '9') return FALSE;
+    while (q < eol && *q >= '0' && *q <= '9') {
+        v = v * 10 + (*q++ - '0');
+        if (v > INT_MAX) return FALSE;
+    }
+    *p = q;
+    *value = v;
+    return TRUE;
+}
+
+static void _bad_line(char *filename, long line) {
+    fprintf(stderr, ">E read_edge_file: can't read line %ld of %s\n", line, filename);
+    exit(1);
+}
+
+/**
+ * One pass over the mapped file.  With g NULL it fills in scan, otherwise it sets the bits of
+ * every edge in g, which has scan->n vertices.
+ */
+static void _edge_pass(char *filename, char *data, size_t sz, int format, EdgeFileScan *scan, graph *g, int m) {
+    char *p = data, *end = data + sz;
+    long line = 0;
+
+    while (p < end) {
+        char *eol = memchr(p, '\n', end - p);
+        if (eol == NULL) eol = end;
+        char *q = p;
+        p = eol < end ? eol + 1 : end;
+        ++line;
+
+        while (q < eol && (*q == ' ' || *q == '\t' || *q == '\r')) ++q;
+        if (q == eol) continue;     /* blank line */
+
+        long u, v;
+        boolean arc = FALSE;
+        if (format == INPUT_EDGES) {
+            if (*q == '#' || *q == '%') continue;
+            if (!_number(&q, eol, &u) || !_number(&q, eol, &v)) _bad_line(filename, line);
+        } else {
+            char kind = *q++;
+            if (kind == 'c' || kind == 'n') continue;   /* comments, node descriptors */
+            if (kind == 'p') {
+                while (q < eol && (*q == ' ' || *q == '\t')) ++q;
+                while (q < eol && *q != ' ' && *q != '\t') ++q;     /* edge, col, sp... */
+                if (!_number(&q, eol, &scan->n)) _bad_line(filename, line);
+                continue;
+            }
+            if ((kind != 'e' && kind != 'a') || !_number(&q, eol, &u) || !_number(&q, eol, &v) || u < 1 || v < 1 || u > scan->n || v > scan->n)
+                _bad_line(filename, line);  /* also an edge before the p line */
+            --u;
+            --v;
+            arc = (kind == 'a');
+        }
+
+        if (g == NULL) {
+            ++scan->edges;
+            if (arc) scan->digraph = TRUE;
+            if (u >= scan->n) scan->n = u + 1;
+            if (v >= scan->n) scan->n = v + 1;
+        } else if (scan->digraph) {
+            ADDELEMENT(GRAPHROW(g,u,m), v);
+            if (!arc) ADDELEMENT(GRAPHROW(g,v,m), u);  /* an edge among arcs goes both ways */
+        } else if (u != v) {
+            ADDELEMENT(GRAPHROW(g,u,m), v);
+            ADDELEMENT(GRAPHROW(g,v,m), u);
+        }
+    }
+}
+
+
+/**
+ * The format of filename, input_format (--input-format) unless that is INPUT_AUTO, then from
+ * the name, .col .gr and .dimacs are DIMACS, .el .edges and .edgelist are edge lists, .pcg is a
+ * binary graph, and anything else is graph6, sparse6 or digraph6.
+ */
+int edgefile_format(char *filename, int input_format) {
+    if (input_format != INPUT_AUTO) return input_format;
+    if (_has_extension(filename, ".col") || _has_extension(filename, ".gr") || _has_extension(filename, ".dimacs")) return INPUT_DIMACS;
+    if (_has_extension(filename, ".el") || _has_extension(filename, ".edges") || _has_extension(filename, ".edgelist")) return INPUT_EDGES;
+    if (_has_extension(filename, ".pcg")) return INPUT_BINARY;
+    return INPUT_NAUTY;
+}
+
+/**
+ * Reads the graph in filename, format is INPUT_EDGES or INPUT_DIMACS.  Returns it malloced, like
+ * readg, with its m and n, and whether it has directed arcs.  Bad lines print where they are and
+ * exit.
+ */
+graph *read_edge_file(char *filename, int format, int *m, int *n, boolean *digraph) {
+    size_t sz;
+    char *data = graphmap_map_file(filename, &sz);
+    if (data) madvise(data, sz, MADV_SEQUENTIAL);
+
+    EdgeFileScan scan = {0, 0, FALSE};
+    _edge_pass(filename, data, sz, format, &scan, NULL, 0);
+
+    *n = (int)scan.n;
+    *m = (*n + WORDSIZE - 1) / WORDSIZE;
+    *digraph = scan.digraph;
+    graph *g = (graph*)calloc((size_t)*m * (size_t)*n + 1, sizeof(graph));
+    if (g == NULL) alloc_error("read_edge_file");
+    _edge_pass(filename, data, sz, format, &scan, g, *m);
+
+    if (data) munmap(data, sz);
+    return g;
+}
@@ -0,0 +1,48 @@
+/**
+ * Copyright 2025 Jim Haslett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Loads a single graph from a plain edge list or a DIMACS file, straight into the adjacency
+ * matrix the search uses.  The file is mapped and read through twice, the first time for the
+ * number of vertices and whether there are directed arcs, the second to set the bits, so
+ * nothing is built in between.
+ *
+ * Edge lists have one "u v" pair per line, vertices numbered from 0, anything after the pair
+ * (a weight) is ignored, and lines starting with # or % are comments.  DIMACS files have a
+ * "p <kind> n m" line, "e u v" edges (.col) or "a u v w" arcs (.gr, read as a digraph), vertices
+ * numbered from 1, and "c" comment lines.  Self loops are dropped from undirected graphs, graph6
+ * can't write them.
+ */
+
+#ifndef _EDGEFILE_H_
+#define _EDGEFILE_H_
+
+#include "proto.h"
+#include "options.h"
+
+
+/* what the first pass found */
+typedef struct {
+    long n;                     /* vertices, largest id + 1 for an edge list, from the p line for DIMACS */
+    long edges;                 /* edge and arc lines */
+    boolean digraph;            /* there were DIMACS arcs */
+} EdgeFileScan;
+
+
+int edgefile_format(char *filename, int input_format);
+graph *read_edge_file(char *filename, int format, int *m, int *n, boolean *digraph);
+
+#endif /* _EDGEFILE_H_ */
@@ -0,0 +1,329 @@
+/**
+ * Copyright 2025 Jim Haslett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "extdedup.h"
+#include "p_gtools.h"
+#include "graphwriter.h"
+#include <unistd.h>
+
+
+/* an unlinked temporary file in dir, open for reading and writing, gone when it is closed */
+static int _temp_file(char *dir) {
+    size_t name_sz = strlen(dir) + 32;
+    char *name = (char*)malloc(name_sz);
+    if (name == NULL) alloc_error("extdedup _temp_file");
+    snprintf(name, name_sz, "%s/pcanon-XXXXXX", dir);
+    int fd = mkstemp(name);
+    if (fd < 0) {
+        printf("Can't make a temporary file in %s\n", dir);
+        exit(1);
+    }
+    unlink(name);
+    free(name);
+    return fd;
+}
+
+static void _write_all(int fd, char *p, size_t sz) {
+    while (sz > 0) {
+        ssize_t k = write(fd, p, sz);
+        if (k <= 0) runtime_error("extdedup: can't write a run, out of temporary space?");
+        p += k;
+        sz -= (size_t)k;
+    }
+}
+
+static int _compare_records(const void *a, const void *b) {
+    const DedupRecord *x = (const DedupRecord*)a, *y = (const DedupRecord*)b;
+    if (x->hash[0] != y->hash[0]) return x->hash[0] < y->hash[0] ? -1 : 1;
+    if (x->hash[1] != y->hash[1]) return x->hash[1] < y->hash[1] ? -1 : 1;
+    return (x->index > y->index) - (x->index < y->index);
+}
+
+static char *_put_varint(char *p, unsigned long v) {
+    while (v >= 0x80) {
+        *p++ = (char)((v & 0x7F) | 0x80);
+        v >>= 7;
+    }
+    *p++ = (char)v;
+    return p;
+}
+
+static unsigned long _get_varint(FILE *f) {
+    unsigned long v = 0;
+    int c, shift = 0;
+    do {
+        if ((c = getc_unlocked(f)) == EOF) runtime_error("extdedup: short run file");
+        v |= (unsigned long)(c & 0x7F) << shift;
+        shift += 7;
+    } while (c & 0x80);
+    return v;
+}
+
+/* appends r to run, through x->io_buf, --compress-runs codes it on the way */
+static void _put_record(ExternalDedup *x, DedupRun *run, DedupRecord *r) {
+    char *p = x->io_buf + x->io_sz;
+    if (x->compress) {
+        p = _put_varint(p, r->hash[0] - run->prev_hash);
+        memcpy(p, &r->hash[1], sizeof(unsigned long));
+        p += sizeof(unsigned long);
+        p = _put_varint(p, (unsigned long)r->index);
+        p = _put_varint(p, (unsigned long)r->offset);
+        p = _put_varint(p, (unsigned long)r->len);
+        run->prev_hash = r->hash[0];
+    } else {
+        memcpy(p, r, sizeof(DedupRecord));
+        p += sizeof(DedupRecord);
+    }
+    ++run->num_records;
+    x->io_sz = p - x->io_buf;
+    if (x->io_sz > EXTDEDUP_IO_BUFFER - 64) {   /* no room for one more record */
+        _write_all(run->fd, x->io_buf, x->io_sz);
+        x->io_sz = 0;
+    }
+}
+
+/* a new empty run on the end of x->runs */
+static DedupRun *_new_run(ExternalDedup *x, int level) {
+    if (x->num_runs == x->allocated_runs) {
+        x->allocated_runs = x->allocated_runs ? x->allocated_runs * 2 : 16;
+        if ((x->runs = (DedupRun*)realloc(x->runs, sizeof(DedupRun)*x->allocated_runs)) == NULL) alloc_error("extdedup _new_run");
+    }
+    DedupRun *run = &x->runs[x->num_runs++];
+    memset(run, 0, sizeof(DedupRun));
+    run->fd = _temp_file(x->tmpdir);
+    run->level = level;
+    return run;
+}
+
+/* writes out what is left in x->io_buf and rewinds run, so it can be merged */
+static void _finish_run(ExternalDedup *x, DedupRun *run) {
+    _write_all(run->fd, x->io_buf, x->io_sz);
+    x->io_sz = 0;
+    run->prev_hash = 0;
+    lseek(run->fd, 0, SEEK_SET);
+}
+
+/* the next record of run into run->rec, FALSE once it is used up */
+static boolean _next_record(ExternalDedup *x, DedupRun *run) {
+    if (run->left == 0) return FALSE;
+    --run->left;
+    if (x->compress) {
+        run->rec.hash[0] = run->prev_hash + _get_varint(run->f);
+        if (fread(&run->rec.hash[1], sizeof(unsigned long), 1, run->f) != 1) runtime_error("extdedup: short run file");
+        run->rec.index = (long)_get_varint(run->f);
+        run->rec.offset = (long)_get_varint(run->f);
+        run->rec.len = (long)_get_varint(run->f);
+        run->prev_hash = run->rec.hash[0];
+    } else if (fread(&run->rec, sizeof(DedupRecord), 1, run->f) != 1) {
+        runtime_error("extdedup: short run file");
+    }
+    return TRUE;
+}
+
+/* heap[i] sinks to where it belongs, the heap holds run numbers ordered by their records */
+static void _sift_down(ExternalDedup *x, int *heap, int heap_sz, int i) {
+    while (1) {
+        int least = i, l = 2 * i + 1, r = 2 * i + 2;
+        if (l < heap_sz && _compare_records(&x->runs[heap[l]].rec, &x->runs[heap[least]].rec) < 0) least = l;
+        if (r < heap_sz && _compare_records(&x->runs[heap[r]].rec, &x->runs[heap[least]].rec) < 0) least = r;
+        if (least == i) return;
+        int t = heap[i];
+        heap[i] = heap[least];
+        heap[least] = t;
+        i = least;
+    }
+}
+
+/* copies the canonical graph of r from the spool to outfile */
+static void _copy_from_spool(ExternalDedup *x, DedupRecord *r, char **buf, size_t *buf_sz, FILE *outfile) {
+    if ((size_t)r->len > *buf_sz) {
+        *buf_sz = (size_t)r->len * 2;
+        if ((*buf = (char*)realloc(*buf, *buf_sz)) == NULL) alloc_error("extdedup _copy_from_spool");
+    }
+    if (pread(fileno(x->spool), *buf, r->len, r->offset) != r->len) runtime_error("extdedup: can't read the spool");
+    fwrite(*buf, 1, r->len, outfile);
+}
+
+/* opens runs[first..num_runs) for reading, returns how many of them went into the heap */
+static int _start_merge(ExternalDedup *x, int first, int *heap) {
+    int heap_sz = 0;
+    for (int i = first; i < x->num_runs; ++i) {
+        DedupRun *run = &x->runs[i];
+        if ((run->f = fdopen(run->fd, "r")) == NULL || (run->buf = (char*)malloc(EXTDEDUP_IO_BUFFER)) == NULL) alloc_error("extdedup _start_merge");
+        setvbuf(run->f, run->buf, _IOFBF, EXTDEDUP_IO_BUFFER);
+        run->left = run->num_records;
+        if (_next_record(x, run)) heap[heap_sz++] = i;
+    }
+    for (int i = heap_sz / 2 - 1; i >= 0; --i) _sift_down(x, heap, heap_sz, i);
+    return heap_sz;
+}
+
+/* closes runs[first..num_runs), which deletes them */
+static void _end_merge(ExternalDedup *x, int first) {
+    for (int i = first; i < x->num_runs; ++i) {
+        fclose(x->runs[i].f);
+        FREES(x->runs[i].buf);
+    }
+    x->num_runs = first;
+}
+
+/* merges the last k runs into one run, of the level after the first of them */
+static void _merge_last_runs(ExternalDedup *x, int k) {
+    int first = x->num_runs - k;
+    int heap[EXTDEDUP_FAN_IN];
+    int heap_sz = _start_merge(x, first, heap);
+
+    DedupRun merged;
+    memset(&merged, 0, sizeof(DedupRun));
+    merged.fd = _temp_file(x->tmpdir);
+    merged.level = x->runs[first].level + 1;
+    while (heap_sz > 0) {
+        DedupRun *run = &x->runs[heap[0]];
+        _put_record(x, &merged, &run->rec);
+        if (!_next_record(x, run)) heap[0] = heap[--heap_sz];
+        _sift_down(x, heap, heap_sz, 0);
+    }
+    _finish_run(x, &merged);
+
+    _end_merge(x, first);
+    x->runs[x->num_runs++] = merged;
+}
+
+/* sorts the buffered records and writes them out as a new run, then carries full levels up */
+static void _write_run(ExternalDedup *x) {
+    if (x->num_records == 0) return;
+    qsort(x->records, x->num_records, sizeof(DedupRecord), _compare_records);
+
+    DedupRun *run = _new_run(x, 0);
+    for (long i = 0; i < x->num_records; ++i) _put_record(x, run, &x->records[i]);
+    _finish_run(x, run);
+    x->num_records = 0;
+    ++x->written_runs;
+
+    /* levels only go down along x->runs, so a full level is the last EXTDEDUP_FAN_IN runs */
+    while (x->num_runs >= EXTDEDUP_FAN_IN && x->runs[x->num_runs - EXTDEDUP_FAN_IN].level == x->runs[x->num_runs - 1].level) {
+        _merge_last_runs(x, EXTDEDUP_FAN_IN);
+    }
+}
+
+/**
+ * The k way merge of the runs, at most EXTDEDUP_FAN_IN of them.  Records come out in (hash,
+ * input position) order, the first of each hash is written, the rest only counted.  Returns the
+ * number of classes.
+ */
+static long _merge_runs(ExternalDedup *x, FILE *outfile, FILE *countsfile) {
+    int heap[EXTDEDUP_FAN_IN];
+    int heap_sz = _start_merge(x, 0, heap);
+
+    if (fflush(x->spool) != 0) runtime_error("extdedup: can't write the spool, out of temporary space?");
+    char *buf = NULL;
+    size_t buf_sz = 0;
+    long classes = 0, count = 0;
+    DedupRecord first;
+
+    while (heap_sz > 0) {
+        DedupRun *run = &x->runs[heap[0]];
+        if (count > 0 && run->rec.hash[0] == first.hash[0] && run->rec.hash[1] == first.hash[1]) {
+            ++count;
+        } else {
+            if (count > 0 && countsfile) fprintf(countsfile, "%ld %ld\n", first.index + 1, count);
+            first = run->rec;
+            count = 1;
+            ++classes;
+            _copy_from_spool(x, &first, &buf, &buf_sz, outfile);
+        }
+        if (!_next_record(x, run)) heap[0] = heap[--heap_sz];
+        _sift_down(x, heap, heap_sz, 0);
+    }
+    if (count > 0 && countsfile) fprintf(countsfile, "%ld %ld\n", first.index + 1, count);
+
+    FREES(buf);
+    _end_merge(x, 0);
+    return classes;
+}
+
+
+/**
+ * --batch --dedup --dedup-memory=MB, reads infile, positioned after any header by
+ * opengraphfile, and writes the first graph of each class to outfile.
+ */
+void run_external_dedup(FILE *infile, char *infilename, FILE *outfile, Options *opts) {
+    double start_time = wtime();  /* mark start time */
+    int m, n, total_refines = 0, total_autos = 0;
+    long graphs;
+    boolean digraph;
+    graph *g = NULL;
+    size_t g_sz = 0;
+
+    ExternalDedup x;
+    memset(&x, 0, sizeof(x));
+    x.tmpdir = opts->tmpdir ? opts->tmpdir : (getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp");
+    x.compress = opts->compress_runs;
+    x.max_records = ((long)opts->dedup_memory_mb << 20) / (long)sizeof(DedupRecord);
+    if (x.max_records < 1) x.max_records = 1;
+    if ((x.records = (DedupRecord*)malloc(sizeof(DedupRecord)*x.max_records)) == NULL) alloc_error("run_external_dedup");
+    if ((x.io_buf = (char*)malloc(EXTDEDUP_IO_BUFFER)) == NULL || (x.spool_buf = (char*)malloc(EXTDEDUP_IO_BUFFER)) == NULL) alloc_error("run_external_dedup");
+    if ((x.spool = fdopen(_temp_file(x.tmpdir), "w+")) == NULL) alloc_error("run_external_dedup");
+    setvbuf(x.spool, x.spool_buf, _IOFBF, EXTDEDUP_IO_BUFFER);
+
+    BadStack *stack = malloc(sizeof(BadStack));
+    if (stack == NULL) alloc_error("run_external_dedup");
+    stack_initialize(stack, 200);
+    Status *status = status_new();
+    GraphWriter writer;
+    graphwriter_init(&writer, opts->output_format);
+
+    for (graphs = 0; readg_reuse(infile, &g, &g_sz, &m, &n, &digraph) != NULL; ++graphs) {
+        canonicalize(status, stack, g, m, n, digraph);
+
+        if (x.num_records == x.max_records) _write_run(&x);
+        DedupRecord *r = &x.records[x.num_records++];
+        hash_words128(status->best_invar, (size_t)m * n, ((unsigned long)n << 1) | (digraph ? 1 : 0), r->hash);
+        r->index = graphs;
+        r->offset = x.spool_sz;
+        r->len = (long)graphwriter_encode(&writer, status->best_invar, m, n, digraph);
+        x.spool_sz += r->len;
+        graphwriter_write(&writer, x.spool);
+
+        total_refines += status->refinement_count;
+        total_autos += status->autogrp->sz;
+    }
+    _write_run(&x);
+    FREES(x.records);   /* the merge only needs the run buffers */
+    while (x.num_runs > EXTDEDUP_FAN_IN) {
+        int k = x.num_runs - EXTDEDUP_FAN_IN + 1;   /* the smallest runs, just enough of them */
+        _merge_last_runs(&x, k < EXTDEDUP_FAN_IN ? k : EXTDEDUP_FAN_IN);
+    }
+    FREES(x.io_buf);
+
+    FILE *countsfile = NULL;
+    if (opts->countsfilename && (countsfile = fopen(opts->countsfilename, "w")) == NULL) printf("Can't open %s for writing\n", opts->countsfilename);
+    long classes = _merge_runs(&x, outfile, countsfile);
+    if (countsfile) fclose(countsfile);
+
+    double runtime = wtime() - start_time;
+    fprintf(stderr, "Batch: %ld graphs, %d refinements, %f seconds\n", graphs, total_refines, runtime);
+    fprintf(stderr, "Dedup: %ld graphs, %ld classes, %d runs\n", graphs, classes, x.written_runs);
+    log_output_to_file(infilename, total_refines, total_autos, runtime, -1);
+
+    FREES(x.runs);
+    fclose(x.spool);
+    free(x.spool_buf);
+    free(stack);
+    status_free(status);
+    graphwriter_free(&writer);
+    FREES(g);
+}
@@ -0,0 +1,87 @@
+/**
+ * Copyright 2025 Jim Haslett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Out of core --dedup, for collections with more classes than fit in memory,
+ * --dedup-memory=MB.  The file is streamed through readg_reuse, and each canonical graph is
+ * appended to a spool file, while a (certificate hash, spool offset) record goes into a buffer
+ * of at most MB megabytes.  A full buffer is sorted and written out as a run, and at the end the
+ * runs are merged with a heap, k ways at once.  The first record of each hash is its class's
+ * representative, its canonical graph is copied from the spool to the output.
+ *
+ * Every run holds a file open until it is merged, so runs are merged EXTDEDUP_FAN_IN at a time
+ * into a run of the next level as soon as that many of one level pile up, like the digits of a
+ * counter carrying, and the last ones down to EXTDEDUP_FAN_IN before the final merge.  There are
+ * never more than EXTDEDUP_FAN_IN - 1 runs a level, and each record is rewritten once a level.
+ *
+ * Classes come out in hash order rather than input order (shortg sorts its output too), and a
+ * class is its 128 bit hash, the certificates aren't compared.  --compress-runs writes the runs
+ * delta and varint coded, sorted hashes are close together, so a record takes about 20 bytes
+ * instead of 40.  The spool and the runs are unlinked temporary files in --tmp-dir.
+ */
+
+#ifndef _EXTDEDUP_H_
+#define _EXTDEDUP_H_
+
+#include "pcanon.h"
+
+#define EXTDEDUP_IO_BUFFER (1 << 20)    /* bytes per write to a run, and the read buffer for the spool and each run in the merge */
+#define EXTDEDUP_FAN_IN 32              /* most runs merged at once, and open in the merge */
+
+
+typedef struct {
+    unsigned long hash[2];          /* hash_words128 of the canonical graph */
+    long index;                     /* input position */
+    long offset;                    /* where the canonical graph is in the spool */
+    long len;                       /* and its length */
+} DedupRecord;
+
+/* a sorted run on disk, and the merge's place in it */
+typedef struct {
+    int fd;
+    FILE *f;                        /* fd, opened for the merge */
+    char *buf;                      /* f's stdio buffer */
+    long num_records;
+    long left;                      /* records not read yet */
+    DedupRecord rec;                /* the current one */
+    unsigned long prev_hash;        /* hash[0] of the record before, --compress-runs codes the difference */
+    int level;                      /* 0 for a buffer written out, one more than its runs for a merge */
+} DedupRun;
+
+typedef struct {
+    char *tmpdir;
+    boolean compress;               /* --compress-runs */
+
+    DedupRecord *records;           /* records waiting for the next run */
+    long num_records;
+    long max_records;               /* --dedup-memory worth */
+
+    DedupRun *runs;
+    int num_runs;
+    int allocated_runs;
+    int written_runs;               /* runs written from the buffer, before any merging */
+    char *io_buf;                   /* records on their way to a run, EXTDEDUP_IO_BUFFER bytes */
+    size_t io_sz;                   /* bytes in it */
+
+    FILE *spool;                    /* canonical graphs in input order */
+    char *spool_buf;
+    long spool_sz;
+} ExternalDedup;
+
+
+void run_external_dedup(FILE *infile, char *infilename, FILE *outfile, Options *opts);
+
+#endif /* _EXTDEDUP_H_ */
@@ -0,0 +1,312 @@
+/**
+ * Copyright 2025 Jim Haslett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "graphmap.h"
+#include "p_gtools.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define GRAPHMAP_MIN_RANGE (1 << 20)    /* don't start an index thread for less than this many bytes */
+
+#define B(i) (1 << ((i)-1))
+#define M(i) ((1 << (i))-1)
+
+
+/**
+ * Index thread, finds the newlines in its range.  memchr is vectorized in glibc, it goes
+ * through 16 or 32 bytes at a time.
+ */
+static void *_index_range(void *arg) {
+    GraphMapRange *r = (GraphMapRange*)arg;
+    char *p = r->data + r->lo;
+    char *end = r->data + r->hi;
+
+    while ((p = memchr(p, '\n', end - p)) != NULL) {
+        size_t start = (size_t)(p - r->data) + 1;
+        if (start < r->sz) {
+            if (r->num_starts == r->allocated_sz) {
+                r->allocated_sz = r->allocated_sz ? r->allocated_sz * 2 : 1024;
+                if ((r->starts = (size_t*)realloc(r->starts, sizeof(size_t)*r->allocated_sz)) == NULL) alloc_error("_index_range");
+            }
+            r->starts[r->num_starts++] = start;
+        }
+        ++p;
+    }
+    return NULL;
+}
+
+/**
+ * graph6 body p to g, six bits at a time.  The bits run down the columns of the upper triangle,
+ * (0,1), (0,2), (1,2), (0,3)..., a zero byte, most of them in a sparse graph, skips six at once.
+ */
+static void _decode_g6(char *p, graph *g, int m, int n) {
+    char *end = p + G6BODYLEN(n);
+    int i = 0, j = 1;
+
+    memset(g, 0, sizeof(setword)*m*(size_t)n);
+    for (; p < end; ++p) {
+        int x = *p - BIAS6;
+        if (x == 0) {
+            i += 6;
+            while (j < n && i >= j) {
+                i -= j;
+                ++j;
+            }
+            continue;
+        }
+        for (int b = TOPBIT6; b != 0 && j < n; b >>= 1) {
+            if (x & b) {
+                ADDELEMENT(GRAPHROW(g,i,m), j);
+                ADDELEMENT(GRAPHROW(g,j,m), i);
+            }
+            if (++i == j) {
+                i = 0;
+                ++j;
+            }
+        }
+    }
+}
+
+/* digraph6 body p to g, the whole matrix row by row, six bits at a time like _decode_g6 */
+static void _decode_d6(char *p, graph *g, int m, int n) {
+    char *end = p + D6BODYLEN(n);
+    int i = 0, j = 0;
+
+    memset(g, 0, sizeof(setword)*m*(size_t)n);
+    for (; p < end; ++p) {
+        int x = *p - BIAS6;
+        if (x == 0) {
+            j += 6;
+            while (i < n && j >= n) {
+                j -= n;
+                ++i;
+            }
+            continue;
+        }
+        for (int b = TOPBIT6; b != 0 && i < n; b >>= 1) {
+            if (x & b) ADDELEMENT(GRAPHROW(g,i,m), j);
+            if (++j == n) {
+                j = 0;
+                ++i;
+            }
+        }
+    }
+}
+
+/**
+ * sparse6 body [p, end) to g, the same edge list walk as stringtograph, but it stops at end
+ * rather than at a newline, which the last line of the mapping may not have.
+ */
+static void _decode_s6(char *p, char *end, graph *g, int m, int n) {
+    int nb, k = 0, v = 0, x = 0;
+
+    memset(g, 0, sizeof(setword)*m*(size_t)n);
+    for (nb = 0; (n - 1) >> nb > 0; ++nb) {}
+
+    while (1) {
+        if (k == 0) {
+            if (p == end) return;
+            x = *p++ - BIAS6;
+            k = 6;
+        }
+        if (x & B(k)) ++v;
+        --k;
+
+        int need = nb, j = 0;
+        while (need > 0) {
+            if (k == 0) {
+                if (p == end) return;
+                x = *p++ - BIAS6;
+                k = 6;
+            }
+            if (need >= k) {
+                j = (j << k) | (x & M(k));
+                need -= k;
+                k = 0;
+            } else {
+                k -= need;
+                j = (j << need) | ((x >> k) & M(need));
+                need = 0;
+            }
+        }
+
+        if (j > v) v = j;
+        else if (v < n) {
+            ADDELEMENT(GRAPHROW(g,v,m), j);
+            ADDELEMENT(GRAPHROW(g,j,m), v);
+        }
+    }
+}
+
+
+/**
+ * Maps the whole of filename read only, *sz gets its size.  An empty file gives NULL.  Exits if
+ * the file can't be opened, like opening it for readg.
+ */
+char *graphmap_map_file(char *filename, size_t *sz) {
+    char *data = NULL;
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, ">E graphmap_map_file: can't open %s\n", filename);
+        exit(1);
+    }
+    *sz = (size_t)st.st_size;
+    if (*sz > 0) {
+        data = (char*)mmap(NULL, *sz, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            fprintf(stderr, ">E graphmap_map_file: can't map %s\n", filename);
+            exit(1);
+        }
+    }
+    close(fd);
+    return data;
+}
+
+/**
+ * Maps filename and indexes its lines with up to num_threads threads.  graph6, sparse6 and
+ * digraph6 lines are read, with or without a header, and may be mixed.  Exits if the file can't
+ * be read, like opening it for readg.
+ */
+GraphMap *graphmap_open(char *filename, int num_threads) {
+    GraphMap *map = (GraphMap*)calloc(1, sizeof(GraphMap));
+    if (map == NULL) alloc_error("graphmap_open");
+
+    map->data = graphmap_map_file(filename, &map->sz);
+    if (map->data) madvise(map->data, map->sz, MADV_WILLNEED);
+
+    size_t body = 0;
+    char *headers[] = {GRAPH6_HEADER, SPARSE6_HEADER, DIGRAPH6_HEADER};
+    for (int i = 0; i < 3; ++i) {
+        size_t header_len = strlen(headers[i]);
+        if (map->sz >= header_len && strncmp(map->data, headers[i], header_len) == 0) body = header_len;
+    }
+    if (map->sz > body && map->data[body] == '>') {
+        printf("Unsupported graph type in %s, only graph6, sparse6 and digraph6 are read.\n", filename);
+        exit(-1);
+    }
+
+    /* split the body between the index threads */
+    int nt = num_threads < 1 ? 1 : num_threads;
+    if ((map->sz - body) / GRAPHMAP_MIN_RANGE + 1 < (size_t)nt) nt = (int)((map->sz - body) / GRAPHMAP_MIN_RANGE + 1);
+    GraphMapRange *ranges = (GraphMapRange*)calloc(nt, sizeof(GraphMapRange));
+    pthread_t *tids = (pthread_t*)malloc(sizeof(pthread_t)*nt);
+    if (ranges == NULL || tids == NULL) alloc_error("graphmap_open");
+    for (int t = 0; t < nt; ++t) {
+        ranges[t].data = map->data;
+        ranges[t].lo = body + (map->sz - body) * t / nt;
+        ranges[t].hi = body + (map->sz - body) * (t + 1) / nt;
+        ranges[t].sz = map->sz;
+    }
+    for (int t = 1; t < nt; ++t) {
+        if (pthread_create(&tids[t], NULL, _index_range, &ranges[t]) != 0) runtime_error("graphmap_open: pthread_create failed");
+    }
+    _index_range(&ranges[0]);
+    for (int t = 1; t < nt; ++t) pthread_join(tids[t], NULL);
+
+    /* the first line starts at the body, the rest after each newline, in range order */
+    long total = map->sz > body ? 1 : 0;
+    for (int t = 0; t < nt; ++t) total += ranges[t].num_starts;
+    if ((map->offsets = (size_t*)malloc(sizeof(size_t)*(total + 1))) == NULL) alloc_error("graphmap_open");
+    long k = 0;
+    if (total > 0) map->offsets[k++] = body;
+    for (int t = 0; t < nt; ++t) {
+        memcpy(map->offsets + k, ranges[t].starts, sizeof(size_t)*ranges[t].num_starts);
+        k += ranges[t].num_starts;
+        free(ranges[t].starts);
+    }
+    map->offsets[total] = map->sz;
+    map->num_graphs = total;
+
+    free(ranges);
+    free(tids);
+    return map;
+}
+
+void graphmap_close(GraphMap *map) {
+    if (map->data) munmap(map->data, map->sz);
+    free(map->offsets);
+    free(map);
+}
+
+/**
+ * Decodes graph k of the file into *g, *g_sz words, grown as needed (NULL, 0 to start), like
+ * readg_reuse.  *digraph is set for digraph6 lines.  Returns *g, or NULL if there is no graph k.
+ */
+graph *graphmap_graph(GraphMap *map, long k, graph **g, size_t *g_sz, int *pm, int *pn, boolean *digraph) {
+    if (k < 0 || k >= map->num_graphs) return NULL;
+
+    char *why, msg[100];
+    if (graphmap_decode_line(map->data + map->offsets[k], map->offsets[k + 1] - map->offsets[k], INT_MAX, g, g_sz, pm, pn, digraph, &why) == NULL) {
+        snprintf(msg, sizeof(msg), ">E graphmap_graph: %s\n", why);
+        gt_abort(msg);
+    }
+    return *g;
+}
+
+/**
+ * Decodes the graph6, sparse6 or digraph6 line s, len bytes with or without its newline, into
+ * *g like graphmap_graph.  A >>graph6<<, >>sparse6<< or >>digraph6<< header in front of it, as
+ * the first line of a file written by a nauty tool with -h has, is skipped.  Returns *g, or NULL
+ * with *why saying what is wrong with the line, nothing is allocated for a line of the wrong
+ * length or with more than max_n vertices.
+ */
+graph *graphmap_decode_line(char *s, size_t len, int max_n, graph **g, size_t *g_sz, int *pm, int *pn, boolean *digraph, char **why) {
+    while (len > 0 && (s[len - 1] == '\n' || s[len - 1] == '\r')) --len;
+    char *headers[] = {GRAPH6_HEADER, SPARSE6_HEADER, DIGRAPH6_HEADER};
+    for (int i = 0; i < 3; ++i) {
+        size_t header_len = strlen(headers[i]);
+        if (len >= header_len && strncmp(s, headers[i], header_len) == 0) {
+            s += header_len;
+            len -= header_len;
+            break;
+        }
+    }
+    size_t code = (len > 0 && (s[0] == ':' || s[0] == '&'));   /* sparse6 and digraph6 start with a code character */
+    /* graphsize reads 1, 4 or 8 bytes, don't let it off the end of the line */
+    char *size = s + code;
+    if (len <= code || (size[0] == MAXBYTE && (len < code + 4 || (size[1] == MAXBYTE && len < code + 8)))) {
+        *why = "truncated graph line";
+        return NULL;
+    }
+    int n = graphsize(s);
+    if (n < 0 || n > max_n) {
+        *why = "too many vertices";
+        return NULL;
+    }
+    int m = (n + WORDSIZE - 1) / WORDSIZE;
+    char *body = size + SIZELEN(n);
+    if (s[0] == '&' && len != D6LEN(n)) {
+        *why = len < D6LEN(n) ? "truncated digraph6 line" : "digraph6 line too long for its size";
+        return NULL;
+    }
+    if (s[0] != ':' && s[0] != '&' && len != G6LEN(n)) {
+        *why = len < G6LEN(n) ? "truncated graph6 line" : "graph6 line too long for its size";
+        return NULL;
+    }
+
+    DYNALLOC2(graph, *g, *g_sz, n, m, "graphmap_decode_line");
+    *digraph = (s[0] == '&');
+    if (s[0] == ':') _decode_s6(body, s + len, *g, m, n);
+    else if (s[0] == '&') _decode_d6(body, *g, m, n);
+    else _decode_g6(body, *g, m, n);
+    *pm = m;
+    *pn = n;
+    return *g;
+}
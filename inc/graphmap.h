@@ -0,0 +1,57 @@
+/**
+ * Copyright 2025 Jim Haslett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * A graph6, sparse6 or digraph6 file mapped into memory, with the offset of every line, for
+ * the batch modes.  readg goes through the file a character at a time and mallocs every line,
+ * on big files that took longer than canonicalizing the small graphs in them.  Here the line
+ * index is built by several threads at once with memchr, and graph k is decoded straight out of
+ * the mapping into the caller's buffer, in any order.  sparse6 goes straight from its edge list
+ * to the bit matrix the search uses, never through a graph6 string.
+ */
+
+#ifndef _GRAPHMAP_H_
+#define _GRAPHMAP_H_
+
+#include "proto.h"
+#include <pthread.h>
+
+
+typedef struct {
+    char *data;                 /* the whole file, NULL if it is empty */
+    size_t sz;                  /* bytes in data */
+    size_t *offsets;            /* where each line starts, offsets[num_graphs] is the end of the file */
+    long num_graphs;
+} GraphMap;
+
+/* one index thread's share of the file, the line starts it found go in starts */
+typedef struct {
+    char *data;
+    size_t lo, hi;              /* newlines in [lo, hi) */
+    size_t sz;                  /* of the whole file, a newline at the very end doesn't start a line */
+    size_t *starts;
+    long num_starts;
+    long allocated_sz;
+} GraphMapRange;
+
+
+char *graphmap_map_file(char *filename, size_t *sz);
+GraphMap *graphmap_open(char *filename, int num_threads);
+void graphmap_close(GraphMap *map);
+graph *graphmap_graph(GraphMap *map, long k, graph **g, size_t *g_sz, int *pm, int *pn, boolean *digraph);
+graph *graphmap_decode_line(char *s, size_t len, int max_n, graph **g, size_t *g_sz, int *pm, int *pn, boolean *digraph, char **why);
+
+#endif /* _GRAPHMAP_H_ */
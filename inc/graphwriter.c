@@ -0,0 +1,201 @@
+/**
+ * Copyright 2025 Jim Haslett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "graphwriter.h"
+#include "p_gtools.h"
+
+
+/* count (at most 32) bits from the low end of v, out as characters once there are six */
+static inline void _push(SixBits *b, unsigned long v, int count) {
+    b->acc = (b->acc << count) | (v & ((1UL << count) - 1));
+    b->nacc += count;
+    while (b->nacc >= 6) {
+        b->nacc -= 6;
+        *b->p++ = (char)(BIAS6 + ((b->acc >> b->nacc) & C6MASK));
+    }
+}
+
+/* the first nbits of row, 32 at a time */
+static inline void _push_row(SixBits *b, set *row, int nbits) {
+    for (int w = 0; nbits > 0; ++w) {
+        setword x = row[w];
+        for (int half = 0; half < 2 && nbits > 0; ++half) {
+            int t = nbits < 32 ? nbits : 32;
+            _push(b, (unsigned long)(x >> (WORDSIZE - t)), t);
+            x <<= 32;
+            nbits -= t;
+        }
+    }
+}
+
+/* the last character, padded with zeros */
+static inline void _flush(SixBits *b) {
+    if (b->nacc > 0) *b->p++ = (char)(BIAS6 + ((b->acc << (6 - b->nacc)) & C6MASK));
+    b->nacc = 0;
+}
+
+/* n in graph6's 1, 4 or 8 characters */
+static char *_put_size(char *p, int n) {
+    if (n <= SMALLN) {
+        *p++ = (char)(BIAS6 + n);
+    } else if (n <= SMALLISHN) {
+        *p++ = MAXBYTE;
+        *p++ = (char)(BIAS6 + (n >> 12));
+        *p++ = (char)(BIAS6 + ((n >> 6) & C6MASK));
+        *p++ = (char)(BIAS6 + (n & C6MASK));
+    } else {
+        *p++ = MAXBYTE;
+        *p++ = MAXBYTE;
+        for (int k = 30; k >= 0; k -= 6) *p++ = (char)(BIAS6 + ((n >> k) & C6MASK));
+    }
+    return p;
+}
+
+/* room for extra more bytes in w->buf */
+static void _reserve(GraphWriter *w, size_t extra) {
+    if (w->sz + extra <= w->allocated_sz) return;
+    w->allocated_sz = w->sz + extra > 2 * w->allocated_sz ? w->sz + extra : 2 * w->allocated_sz;
+    if ((w->buf = (char*)realloc(w->buf, w->allocated_sz)) == NULL) alloc_error("graphwriter _reserve");
+}
+
+static char *_encode_g6(char *p, graph *g, int m, int n) {
+    SixBits b = {_put_size(p, n), 0, 0};
+    for (int j = 1; j < n; ++j) _push_row(&b, GRAPHROW(g,j,m), j);
+    _flush(&b);
+    *b.p++ = '\n';
+    return b.p;
+}
+
+static char *_encode_d6(char *p, graph *g, int m, int n) {
+    *p++ = '&';
+    SixBits b = {_put_size(p, n), 0, 0};
+    for (int i = 0; i < n; ++i) _push_row(&b, GRAPHROW(g,i,m), n);
+    _flush(&b);
+    *b.p++ = '\n';
+    return b.p;
+}
+
+/**
+ * The sparse6 edge list, edges (i,j) i <= j in order of j, from the set bits of row j.  Each is
+ * a bit saying whether j is the current vertex v or the one after it, then i, with a jump to j
+ * first if it is further on.  The padding follows nauty so the lines are the same as its.
+ */
+static char *_encode_s6(char *p, graph *g, int m, int n, int nb) {
+    *p++ = ':';
+    SixBits b = {_put_size(p, n), 0, 0};
+    int v = 0;
+
+    for (int j = 0; j < n; ++j) {
+        set *row = GRAPHROW(g,j,m);
+        for (int w = 0; w <= SETWD(j); ++w) {
+            setword x = row[w];
+            if (w == SETWD(j) && SETBT(j) < WORDSIZE - 1) x &= ~(~(setword)0 >> (SETBT(j) + 1));   /* i <= j */
+            while (x) {
+                int pos = __builtin_clzl(x);
+                int i = w * WORDSIZE + pos;
+                x &= ~BITT[pos];
+                if (j == v) {
+                    _push(&b, 0, 1);
+                } else if (j == v + 1) {
+                    _push(&b, 1, 1);
+                    v = j;
+                } else {
+                    _push(&b, 1, 1);
+                    _push(&b, (unsigned long)j, nb);
+                    _push(&b, 0, 1);
+                    v = j;
+                }
+                _push(&b, (unsigned long)i, nb);
+            }
+        }
+    }
+
+    if (b.nacc > 0) {
+        int pad = 6 - b.nacc;
+        if (pad > nb && v == n - 2 && n == (1 << nb)) {
+            _push(&b, 0, 1);
+            _push(&b, (1UL << (pad - 1)) - 1, pad - 1);
+        } else {
+            _push(&b, (1UL << pad) - 1, pad);
+        }
+    }
+    *b.p++ = '\n';
+    return b.p;
+}
+
+
+void graphwriter_init(GraphWriter *w, int format) {
+    w->format = format;
+    w->buf = NULL;
+    w->sz = 0;
+    w->allocated_sz = 0;
+}
+
+void graphwriter_free(GraphWriter *w) {
+    free(w->buf);
+    w->buf = NULL;
+    w->sz = w->allocated_sz = 0;
+}
+
+/**
+ * Appends g to the graphs waiting in w, as a line or a binary record.  Returns the number of
+ * bytes it took.
+ */
+size_t graphwriter_encode(GraphWriter *w, graph *g, int m, int n, boolean digraph) {
+    size_t start = w->sz;
+    char *p;
+
+    if (w->format == OUTPUT_BINARY) {
+        size_t words = (size_t)m * (size_t)n;
+        GraphRecordHeader h = {(uint32_t)n, digraph ? GRAPH_RECORD_DIGRAPH : 0};
+        _reserve(w, sizeof(h) + sizeof(setword) * words);
+        memcpy(w->buf + w->sz, &h, sizeof(h));
+        memcpy(w->buf + w->sz + sizeof(h), g, sizeof(setword) * words);
+        w->sz += sizeof(h) + sizeof(setword) * words;
+        return w->sz - start;
+    }
+
+    if (w->format == OUTPUT_SPARSE6 && !digraph) {
+        int nb;
+        size_t bits = 0;
+        for (nb = 0; (n - 1) >> nb > 0; ++nb) {}
+        for (size_t k = 0; k < (size_t)m * (size_t)n; ++k) bits += __builtin_popcountl(g[k]);
+        /* at most 2 + 2*nb bits an edge, and there are no more edges than set bits */
+        _reserve(w, 1 + SIZELEN(n) + (bits * 2 * (nb + 1) + 12) / 6 + 2);
+        p = _encode_s6(w->buf + w->sz, g, m, n, nb);
+    } else if (digraph) {
+        _reserve(w, D6LEN(n) + 2);
+        p = _encode_d6(w->buf + w->sz, g, m, n);
+    } else {
+        _reserve(w, G6LEN(n) + 2);
+        p = _encode_g6(w->buf + w->sz, g, m, n);
+    }
+    w->sz = (size_t)(p - w->buf);
+    return w->sz - start;
+}
+
+/* appends len bytes of s as they are, a line that isn't a graph */
+void graphwriter_append(GraphWriter *w, const char *s, size_t len) {
+    _reserve(w, len);
+    memcpy(w->buf + w->sz, s, len);
+    w->sz += len;
+}
+
+/* writes everything waiting in w to f, one fwrite, and empties it */
+void graphwriter_write(GraphWriter *w, FILE *f) {
+    if (w->sz > 0) fwrite(w->buf, 1, w->sz, f);
+    w->sz = 0;
+}
@@ -0,0 +1,65 @@
+/**
+ * Copyright 2025 Jim Haslett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Writes canonical graphs, --output-format=graph6|sparse6|binary.  Graphs are encoded into a
+ * buffer that is kept from graph to graph and goes out with one fwrite.  The encoders take the
+ * rows of the adjacency matrix a word at a time, graph6's column j is the first j bits of row j
+ * since the matrix is symmetric, and sparse6 walks only the set bits.  Digraphs are always
+ * written as digraph6 unless the format is binary.
+ *
+ * A binary record is a GraphRecordHeader then the m*n setwords of the matrix, in this machine's
+ * byte order, exactly as GRAPHROW lays them out.  Two records are equal byte for byte exactly
+ * when the canonical graphs are, so it serves as the certificate.
+ */
+
+#ifndef _GRAPHWRITER_H_
+#define _GRAPHWRITER_H_
+
+#include "proto.h"
+#include "options.h"
+#include <stdint.h>
+
+#define GRAPH_RECORD_DIGRAPH 1      /* GraphRecordHeader flags */
+
+
+typedef struct {
+    uint32_t n;
+    uint32_t flags;                 /* GRAPH_RECORD_DIGRAPH */
+} GraphRecordHeader;
+
+typedef struct {
+    int format;                     /* OUTPUT_GRAPH6, OUTPUT_SPARSE6 or OUTPUT_BINARY */
+    char *buf;                      /* encoded graphs waiting to be written */
+    size_t sz;                      /* bytes used in buf */
+    size_t allocated_sz;
+} GraphWriter;
+
+/* bits on their way into six bit characters, the newest in the low end of acc */
+typedef struct {
+    char *p;                        /* next character */
+    unsigned long acc;
+    int nacc;                       /* bits in acc not written yet, less than 6 between pushes */
+} SixBits;
+
+
+void graphwriter_init(GraphWriter *w, int format);
+void graphwriter_free(GraphWriter *w);
+size_t graphwriter_encode(GraphWriter *w, graph *g, int m, int n, boolean digraph);
+void graphwriter_append(GraphWriter *w, const char *s, size_t len);
+void graphwriter_write(GraphWriter *w, FILE *f);
+
+#endif /* _GRAPHWRITER_H_ */
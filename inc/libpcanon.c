@@ -0,0 +1,167 @@
+/**
+ * Copyright 2025 Jim Haslett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "libpcanon.h"
+#include "pcanon.h"
+#include "p_util.h"
+
+
+struct pcanon_ctx {
+    Status *status;                 /* NULL after a failed search, made again by the next one */
+    BadStack stack;
+    int *labeling;                  /* the results handed back, allocated_n of each */
+    int *images;                    /* where the canonical label takes each vertex, inverted into labeling */
+    int *perms;
+    size_t perms_sz;                /* ints allocated for perms */
+    int allocated_n;
+};
+
+
+/**
+ * Permutations are partitions of their cycles, (a,b,c) is a ptn run of 1 1 0, and takes a to
+ * b, b to c and c to a.  img gets each vertex's image, vertices in no cycle are fixed.
+ */
+static void _cycles_to_images(partition *perm, int *img, int n) {
+    for (int v = 0; v < n; ++v) img[v] = v;
+    for (size_t i = 0, start = 0; i < perm->sz; ++i) {
+        if (perm->ptn[i] == 1) {
+            img[perm->lab[i]] = perm->lab[i + 1];
+        } else {
+            img[perm->lab[i]] = perm->lab[start];
+            start = i + 1;
+        }
+    }
+}
+
+/* makes sure the context's buffers hold n vertices, calls alloc_error if they can't */
+static void _reserve(pcanon_ctx *ctx, int n) {
+    if (ctx->status == NULL) ctx->status = status_new();
+    if (n <= ctx->allocated_n) return;
+    int *labeling = (int*)realloc(ctx->labeling, sizeof(int)*(size_t)n);
+    if (labeling == NULL) alloc_error("pcanon _reserve");
+    ctx->labeling = labeling;
+    int *images = (int*)realloc(ctx->images, sizeof(int)*(size_t)n);
+    if (images == NULL) alloc_error("pcanon _reserve");
+    ctx->images = images;
+    ctx->allocated_n = n;
+}
+
+/**
+ * After a search failed part way the stack is emptied and the Status freed, _reserve makes a
+ * new one.  status_reset and the DYNALLOC macros leave NULL in whatever they didn't get to, so
+ * status_free can take one that was half set up.  Only the failed call's own temporaries leak.
+ */
+static void _abandon_search(pcanon_ctx *ctx) {
+    PathNode *node;
+    while ((node = stack_pop(&ctx->stack)) != NULL) FREEPATHNODE(node);
+    if (ctx->status) status_free(ctx->status);
+    ctx->status = NULL;
+}
+
+
+/**
+ * A context for graphs of about n vertices, bigger ones grow it.  NULL if there isn't the
+ * memory.
+ */
+pcanon_ctx *pcanon_new(int n) {
+    pcanon_ctx *ctx = (pcanon_ctx*)calloc(1, sizeof(pcanon_ctx));
+    if (ctx == NULL) return NULL;
+
+    jmp_buf trap, *outer = error_trap;
+    if (setjmp(trap) != 0) {
+        error_trap = outer;
+        _abandon_search(ctx);
+        pcanon_free(ctx);
+        return NULL;
+    }
+    error_trap = &trap;
+    stack_initialize(&ctx->stack, 200);
+    if (n < 1) n = 1;
+    _reserve(ctx, n);
+    status_reset(ctx->status, NULL, SETWORDSNEEDED(n), n, FALSE);   /* sizes its n sized arrays */
+    error_trap = outer;
+    return ctx;
+}
+
+void pcanon_free(pcanon_ctx *ctx) {
+    if (ctx == NULL) return;
+    PathNode *node;
+    if (ctx->stack._private) {
+        while ((node = stack_pop(&ctx->stack)) != NULL) FREEPATHNODE(node);
+        free(ctx->stack._private);
+    }
+    if (ctx->status) status_free(ctx->status);
+    FREES(ctx->labeling);
+    FREES(ctx->images);
+    FREES(ctx->perms);
+    free(ctx);
+}
+
+/**
+ * Searches g and hands back its canonical labeling, the canonical graph's vertex i is g's
+ * vertex labeling[i], and generators of its automorphism group.  Either can be NULL if it isn't
+ * wanted, opts can be NULL for an undirected graph.  Returns PCANON_OK or a PCANON_E* code.
+ */
+int pcanon_canonicalize(pcanon_ctx *ctx, graph *g, int m, int n, const pcanon_options *opts, const int **labeling, pcanon_generators *generators) {
+    if (n < 1 || m != SETWORDSNEEDED(n)) return PCANON_EINVAL;
+    boolean digraph = opts ? opts->digraph : FALSE;
+
+    jmp_buf trap, *outer = error_trap;
+    int err = setjmp(trap);
+    if (err != 0) {
+        error_trap = outer;
+        _abandon_search(ctx);
+        return err == ERROR_TRAP_ALLOC ? PCANON_ENOMEM : PCANON_EINTERNAL;
+    }
+    error_trap = &trap;
+
+    _reserve(ctx, n);
+    canonicalize(ctx->status, &ctx->stack, g, m, n, digraph);
+    Status *status = ctx->status;
+
+    if (labeling) {
+        /* cl takes g's vertex v to v's place in the canonical graph, labeling is its inverse */
+        _cycles_to_images(status->cl, ctx->images, n);
+        for (int v = 0; v < n; ++v) ctx->labeling[ctx->images[v]] = v;
+        *labeling = ctx->labeling;
+    }
+
+    if (generators) {
+        size_t need = (size_t)status->autogrp->sz * n;
+        if (need > ctx->perms_sz) {
+            int *perms = (int*)realloc(ctx->perms, sizeof(int)*need);
+            if (perms == NULL) alloc_error("pcanon_canonicalize");
+            ctx->perms = perms;
+            ctx->perms_sz = need;
+        }
+        for (size_t k = 0; k < status->autogrp->sz; ++k) _cycles_to_images(status->autogrp->automorphisms[k], ctx->perms + k * n, n);
+        generators->count = (int)status->autogrp->sz;
+        generators->perms = ctx->perms;
+    }
+
+    error_trap = outer;
+    return PCANON_OK;
+}
+
+/* the last search's canonical graph, m*n setwords, g relabeled by the labeling */
+graph *pcanon_canonical_graph(pcanon_ctx *ctx) {
+    return ctx->status ? ctx->status->best_invar : NULL;
+}
+
+/* refinements the last search made */
+int pcanon_refinements(pcanon_ctx *ctx) {
+    return ctx->status ? ctx->status->refinement_count : 0;
+}
@@ -0,0 +1,63 @@
+/**
+ * Copyright 2025 Jim Haslett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * libpcanon, the serial search as a library (make libpcanon builds lib/libpcanon.a).  A context
+ * holds everything a search needs, its Status and stack, plus the buffers the results are
+ * handed back in, and keeps them from graph to graph, so a service canonicalizing many graphs
+ * only allocates when they get bigger.  Nothing is printed, nothing is logged, the process
+ * never exits, and there is no MPI.  Contexts don't share anything, one per thread.
+ *
+ *      pcanon_ctx *ctx = pcanon_new(n);
+ *      const int *labeling;
+ *      pcanon_generators gens;
+ *      if (pcanon_canonicalize(ctx, g, m, n, NULL, &labeling, &gens) == PCANON_OK) ...
+ *      pcanon_free(ctx);
+ *
+ * g is the usual m*n setword adjacency matrix, m = SETWORDSNEEDED(n), and isn't changed.
+ * Results belong to the context and are good until its next pcanon_canonicalize.
+ */
+
+#ifndef _LIBPCANON_H_
+#define _LIBPCANON_H_
+
+#include "proto.h"
+
+#define PCANON_OK 0
+#define PCANON_EINVAL 1             /* n < 1 or m isn't SETWORDSNEEDED(n) */
+#define PCANON_ENOMEM 2             /* out of memory, the context can be used again */
+#define PCANON_EINTERNAL 3          /* the search hit an error it can't go on from */
+
+
+typedef struct pcanon_ctx pcanon_ctx;
+
+typedef struct {
+    boolean digraph;                /* g's rows are out neighbours, not symmetric */
+} pcanon_options;
+
+typedef struct {
+    int count;
+    int *perms;                     /* count permutations of n, perms[k*n + v] is v's image under the k-th */
+} pcanon_generators;
+
+
+pcanon_ctx *pcanon_new(int n);
+void pcanon_free(pcanon_ctx *ctx);
+int pcanon_canonicalize(pcanon_ctx *ctx, graph *g, int m, int n, const pcanon_options *opts, const int **labeling, pcanon_generators *generators);
+graph *pcanon_canonical_graph(pcanon_ctx *ctx);
+int pcanon_refinements(pcanon_ctx *ctx);
+
+#endif /* _LIBPCANON_H_ */
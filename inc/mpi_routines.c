@@ -15,8 +15,751 @@
  */
 
 #include "mpi_routines.h"
+#include <time.h>
+#include <pthread.h>
 
 
+/**
+ * Copies the work sharing options into the MPI state, and resets the steal statistics
+ */
+void mpi_state_initialize(MPIState *mpi_state, Options *opts) {
+    mpi_state->partner_rank = -1;
+    mpi_state->workstop_detection_state = MPI_TOKEN_STATE_CLEAN;
+
+    mpi_state->send_work_cutoff_depth = opts->send_work_cutoff_depth;
+    mpi_state->max_work_size_to_send = opts->max_work_size_to_send;
+    mpi_state->nodes_between_comm_polls = opts->nodes_between_comm_polls;
+    mpi_state->adaptive_donation = opts->adaptive_donation;
+    mpi_state->steal_failure_rate = 0.5;    /* we don't know anything yet, start in the middle */
+
+    /* each process gets its own random stream, seeded from the one seed so runs can be repeated */
+    unsigned long seed = opts->seed ? opts->seed : (unsigned long)time(NULL);
+    mpi_state->rng_state = rng_seed(seed, mpi_state->my_rank);
+
+    /** Build the victim list, processes on the same host go first, so most steals stay in shared memory */
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, mpi_state->my_rank, MPI_INFO_NULL, &mpi_state->node_comm);
+
+    int node_sz;
+    MPI_Comm_size(mpi_state->node_comm, &node_sz);
+    int *node_ranks = (int*)malloc(sizeof(int)*node_sz);
+    int *world_ranks = (int*)malloc(sizeof(int)*node_sz);
+    if (node_ranks == NULL || world_ranks == NULL) alloc_error("mpi_state_initialize");
+
+    /* translate the host communicator's ranks back to MPI_COMM_WORLD ranks */
+    MPI_Group node_group, world_group;
+    MPI_Comm_group(mpi_state->node_comm, &node_group);
+    MPI_Comm_group(MPI_COMM_WORLD, &world_group);
+    for (int i = 0; i < node_sz; ++i) node_ranks[i] = i;
+    MPI_Group_translate_ranks(node_group, node_sz, node_ranks, world_group, world_ranks);
+    MPI_Group_free(&node_group);
+    MPI_Group_free(&world_group);
+
+    mpi_state->num_victims = 0;
+    mpi_state->victims = (int*)malloc(sizeof(int)*mpi_state->num_processes);
+    if (mpi_state->victims == NULL) alloc_error("mpi_state_initialize");
+
+    boolean *is_local = (boolean*)calloc(mpi_state->num_processes, sizeof(boolean));
+    if (is_local == NULL) alloc_error("mpi_state_initialize");
+    for (int i = 0; i < node_sz; ++i) {
+        is_local[world_ranks[i]] = TRUE;
+        if (world_ranks[i] != mpi_state->my_rank) mpi_state->victims[mpi_state->num_victims++] = world_ranks[i];
+    }
+    mpi_state->num_local_victims = mpi_state->num_victims;
+    for (int i = 0; i < mpi_state->num_processes; ++i) {
+        if (!is_local[i]) mpi_state->victims[mpi_state->num_victims++] = i;
+    }
+
+    free(is_local);
+    free(node_ranks);
+    free(world_ranks);
+    /** */
+
+    mpi_state->load_table = (int*)malloc(sizeof(int)*mpi_state->num_processes);
+    if (mpi_state->load_table == NULL) alloc_error("mpi_state_initialize");
+    for (int i = 0; i < mpi_state->num_processes; ++i) mpi_state->load_table[i] = MPI_LOAD_UNKNOWN;
+
+    mpi_state->termination = opts->termination;
+    MPI_Comm_dup(MPI_COMM_WORLD, &mpi_state->term_comm);
+    mpi_state->work_sent = 0;
+    mpi_state->work_received = 0;
+    mpi_state->wave_active = FALSE;
+    mpi_state->last_wave_result[0] = mpi_state->last_wave_result[1] = -1;
+
+    mpi_state->num_bcast_slots = opts->bcast_slots;
+    mpi_state->bcast_slots = (BcastSlot*)calloc(mpi_state->num_bcast_slots, sizeof(BcastSlot));
+    if (mpi_state->bcast_slots == NULL) alloc_error("mpi_state_initialize");
+    mpi_state->bcast_next = 0;
+    mpi_state->bcast_sent = 0;
+    mpi_state->bcast_received = 0;
+
+    mpi_state->auto_batch_max = opts->auto_batch;
+    mpi_state->auto_batch_delay = opts->auto_batch_delay_ms / 1000.0;
+    mpi_state->auto_batch_sz = 0;
+    mpi_state->auto_batch = (partition**)malloc(sizeof(partition*)*mpi_state->auto_batch_max);
+    if (mpi_state->auto_batch == NULL) alloc_error("mpi_state_initialize");
+
+    /* steal traffic gets its own communicator when the progress thread answers it, so the two threads never receive each other's messages */
+    mpi_state->progress_thread = opts->progress_thread;
+    mpi_state->progress_running = FALSE;
+    mpi_state->idle_backoff_us = opts->idle_backoff_us;
+    if (mpi_state->progress_thread) {
+        MPI_Comm_dup(MPI_COMM_WORLD, &mpi_state->steal_comm);
+        pthread_mutex_init(&mpi_state->lock, NULL);
+    } else {
+        mpi_state->steal_comm = MPI_COMM_WORLD;
+    }
+
+    mpi_state->rma_state = opts->rma_state;     /* the window itself needs n, see mpi_rma_initialize */
+}
+
+void mpi_state_free(MPIState *mpi_state) {
+    for (int i = 0; i < mpi_state->num_bcast_slots; ++i) {
+        BcastSlot *slot = &mpi_state->bcast_slots[i];
+        MPI_Waitall(slot->num_requests, slot->requests, MPI_STATUSES_IGNORE);
+        if (slot->buf) free(slot->buf);
+    }
+    FREES(mpi_state->bcast_slots);
+    FREES(mpi_state->auto_batch);
+    FREES(mpi_state->victims);
+    FREES(mpi_state->load_table);
+    MPI_Comm_free(&mpi_state->node_comm);
+    MPI_Comm_free(&mpi_state->term_comm);
+    if (mpi_state->progress_thread) {
+        MPI_Comm_free(&mpi_state->steal_comm);
+        pthread_mutex_destroy(&mpi_state->lock);
+    }
+    if (mpi_state->rma_state) {
+        MPI_Win_unlock_all(mpi_state->rma_win);
+        MPI_Win_free(&mpi_state->rma_win);
+        FREES(mpi_state->rma_parents);
+        FREES(mpi_state->rma_scratch);
+    }
+}
+
+/**
+ * With the progress thread, it shares the donation side of work stealing with the main thread.
+ * This lock covers the stack, and the MPIState fields both touch: the steal statistics, work_sent
+ * and the token ring's dirty state.  Without the progress thread these do nothing.
+ */
+static void _lock(MPIState *mpi_state) {
+    if (mpi_state->progress_thread) pthread_mutex_lock(&mpi_state->lock);
+}
+
+static void _unlock(MPIState *mpi_state) {
+    if (mpi_state->progress_thread) pthread_mutex_unlock(&mpi_state->lock);
+}
+
+/**
+ * Idle processes sleep between probes, starting at 1us and doubling up to --idle-backoff, instead
+ * of spinning on MPI_Iprobe.  Reset *delay_us to 0 when something arrives.  --idle-backoff=0 spins.
+ */
+static void _idle_wait(MPIState *mpi_state, int *delay_us) {
+    if (mpi_state->idle_backoff_us <= 0) return;
+    *delay_us = *delay_us <= 0 ? 1 : *delay_us * 2;
+    if (*delay_us > mpi_state->idle_backoff_us) *delay_us = mpi_state->idle_backoff_us;
+
+    struct timespec ts;
+    ts.tv_sec = *delay_us / 1000000;
+    ts.tv_nsec = (long)(*delay_us % 1000000) * 1000;
+    nanosleep(&ts, NULL);
+}
+
+/**
+ * Shuffle the victims in place, keeping the same host victims in front of the remote ones.
+ * _order_victims_by_load then sorts this order by load, so the shuffle only breaks ties.
+ */
+static void _shuffle_victims(MPIState *mpi_state) {
+    int *v = mpi_state->victims;
+    int tmp, j;
+    for (int i = mpi_state->num_local_victims - 1; i > 0; --i) {
+        j = (int)(rng_next(&mpi_state->rng_state) % (unsigned long)(i + 1));
+        tmp = v[i]; v[i] = v[j]; v[j] = tmp;
+    }
+    int remote = mpi_state->num_victims - mpi_state->num_local_victims;
+    for (int i = remote - 1; i > 0; --i) {
+        j = (int)(rng_next(&mpi_state->rng_state) % (unsigned long)(i + 1));
+        tmp = v[mpi_state->num_local_victims + i]; v[mpi_state->num_local_victims + i] = v[mpi_state->num_local_victims + j]; v[mpi_state->num_local_victims + j] = tmp;
+    }
+}
+
+/**
+ * Folds one steal outcome into the failure rate moving average.  Both sides of a steal
+ * report here, the thief when it gets work or a reject, and the victim when it donates or rejects.
+ */
+static void _record_steal_outcome(MPIState *mpi_state, boolean failed) {
+    mpi_state->steal_failure_rate += MPI_CONST_STEAL_RATE_DECAY * ((failed ? 1.0 : 0.0) - mpi_state->steal_failure_rate);
+}
+
+/**
+ * Returns how many nodes to donate from the bottom of a stack of size stack_sz, 0 means reject.
+ *
+ * The fixed policy sends half the work below the cutoff depth, limited to max_work_size_to_send.
+ * The adaptive policy sends between a quarter and three quarters of it, and raises the limit up to
+ * 4x, the more steals are failing.  When steals fail work is scarce, so bigger donations mean
+ * fewer trips back for more.
+ */
+static int _donation_size(MPIState *mpi_state, int stack_sz) {
+    int donatable = stack_sz - mpi_state->send_work_cutoff_depth;
+    if (donatable <= 0) return 0;
+
+    int send_sz, limit;
+    if (mpi_state->adaptive_donation) {
+        double share = 0.25 + 0.5 * mpi_state->steal_failure_rate;
+        send_sz = (int)(donatable * share + 0.5);
+        limit = (int)(mpi_state->max_work_size_to_send * (1.0 + 3.0 * mpi_state->steal_failure_rate));
+    } else {
+        send_sz = (donatable + 1) / 2;  /* for lack of better plan, send half the work between cutoff depth and bottom of stack. rounded up (hence the +1)*/
+        limit = mpi_state->max_work_size_to_send;
+    }
+    if (send_sz < 1) send_sz = 1;
+    if (send_sz > limit) send_sz = limit;  /* limit amount of work to send in one chunk */
+    return send_sz;
+}
+
+
+/**
+ * Score used to order victims, higher is asked first.  A process we haven't heard from is
+ * scored as if it could just share, and same host processes count double so they still win
+ * between processes with similar loads.
+ */
+static int _victim_score(MPIState *mpi_state, int v) {
+    int load = mpi_state->load_table[mpi_state->victims[v]];
+    if (load == MPI_LOAD_UNKNOWN) load = mpi_state->send_work_cutoff_depth + 1;
+    return v < mpi_state->num_local_victims ? 2 * load : load;
+}
+
+/**
+ * Stable insertion sort of the (already shuffled) victims, most loaded first.
+ */
+static void _order_victims_by_load(MPIState *mpi_state) {
+    int *v = mpi_state->victims;
+    int *score = (int*)malloc(sizeof(int)*(mpi_state->num_victims+1));
+    if (score == NULL) alloc_error("_order_victims_by_load");
+    for (int i = 0; i < mpi_state->num_victims; ++i) score[i] = _victim_score(mpi_state, i);
+
+    for (int i = 1; i < mpi_state->num_victims; ++i) {
+        int rank = v[i], sc = score[i], j = i - 1;
+        while (j >= 0 && score[j] < sc) {
+            v[j+1] = v[j];
+            score[j+1] = score[j];
+            --j;
+        }
+        v[j+1] = rank;
+        score[j+1] = sc;
+    }
+    free(score);
+}
+
+/**
+ * Counting work end detection (--termination=counting), Mattern's four counter method.
+ *
+ * Every process joins a wave when it is idle, contributing how many donations it has sent and
+ * received so far.  A wave is one MPI_Iallreduce, so it completes in log P steps once everyone
+ * has joined, and every process sees the same sums.  If two waves in a row both balance, and
+ * saw the same counts, nothing was in flight and nobody had work in between, so work has ended.
+ *
+ * Only idle processes start waves (start = TRUE), a process that got work after joining just
+ * checks on its wave the next time it is idle.
+ */
+static void _termination_wave(MPIState *mpi_state, boolean start) {
+    int done;
+
+    if (!mpi_state->wave_active) {
+        if (!start) return;
+        _lock(mpi_state);   /* the progress thread counts donations too */
+        mpi_state->wave_counts[0] = mpi_state->work_sent;
+        _unlock(mpi_state);
+        mpi_state->wave_counts[1] = mpi_state->work_received;
+        MPI_Iallreduce(mpi_state->wave_counts, mpi_state->wave_result, 2, MPI_LONG, MPI_SUM, mpi_state->term_comm, &mpi_state->wave_request);
+        mpi_state->wave_active = TRUE;
+    }
+
+    MPI_Test(&mpi_state->wave_request, &done, MPI_STATUS_IGNORE);
+    if (!done) return;
+    mpi_state->wave_active = FALSE;
+
+    if (__DEBUG_MPI__) printf("MPI: Process %d: wave done, sent %ld received %ld, last wave %ld %ld\n", mpi_state->my_rank, mpi_state->wave_result[0], mpi_state->wave_result[1], mpi_state->last_wave_result[0], mpi_state->last_wave_result[1]);
+
+    if (mpi_state->wave_result[0] == mpi_state->wave_result[1] &&
+            mpi_state->last_wave_result[0] == mpi_state->wave_result[0] &&
+            mpi_state->last_wave_result[1] == mpi_state->wave_result[1]) {
+        mpi_state->state = MPI_STATE_WORK_END;  /* every process sees the same sums, so everyone stops on this wave */
+        return;
+    }
+    mpi_state->last_wave_result[0] = mpi_state->wave_result[0];
+    mpi_state->last_wave_result[1] = mpi_state->wave_result[1];
+}
+
+/* number of words _pack_node needs for node */
+static int _node_words(PathNode *node) {
+    return 2 + node->path->sz + (node->pi->sz) * 2;    /* 1 for each of the size variables, the path, 2 x the partition size (once for each array) */
+}
+
+/* serializes node into msg, returns the number of words written */
+static int _pack_node(int *msg, PathNode *node) {
+    int m = 0;
+
+    /** Add the PathNode's path to the message */
+    msg[m++] = node->path->sz;                      /* set first word of current node to the size of the path */
+    /* loop through the path and put the path words into the message */
+    for (int j = 0; j < node->path->sz; ++j) {
+        msg[m++] = node->path->data[j];             
+    }
+    /** */
+
+    /** Add the PathNode's parition (pi) to the message */
+    msg[m++] = node->pi->sz;                        /* set the next word to the size of the partion pi */
+    /* loop through the partition and put the lab words into the message */
+    for (int j = 0; j < node->pi->sz; ++j) {
+        msg[m++] = node->pi->lab[j];
+    }
+    /* loop through the partition and put the ptn words into the message */
+    for (int j = 0; j < node->pi->sz; ++j) {
+        msg[m++] = node->pi->ptn[j];
+    }
+    /** */
+    return m;
+}
+
+/* builds a new PathNode from msg, the caller owns it, returns the number of words read */
+static int _unpack_node(int *msg, PathNode **node) {
+    int m = 0;
+    PathNode *curr;                                                     /* current PathNode we are building */
+    DYNALLOCPATHNODE(curr, "PathNode_MPI_Take_Work");                   /* Allocate space for PathNode */
+    DYNALLOCPATH(curr->path, msg[m], "PathNode->Path_MPI_Take_Work")    /* Allocate space for path */
+    ++m;    /* need to pull this out ofhte DYNALLOCPATH statement, as it would increment more than once */
+
+    /* extract path from message */
+    for (int j = 0; j < curr->path->sz; ++j) {
+        curr->path->data[j] = msg[m++];
+    }
+
+    DYNALLOCPART(curr->pi, msg[m], "PathNode->pi_MPI_Take_Work")        /* Allocat space for pi */
+    ++m;    /* need to pull this out ofhte DYNALLOCPART statement, as it would increment more than once */
+
+    /* extract partition lab form message */
+    for (int j = 0; j < curr->pi->sz; ++j) {
+        curr->pi->lab[j] = msg[m++];
+    }
+    /* extract partition ptn form message */
+    for (int j = 0; j < curr->pi->sz; ++j) {
+        curr->pi->ptn[j] = msg[m++];
+    }
+    *node = curr;
+    return m;
+}
+
+/* pushes a donated node, unless our theta says it's in a non minimal orbit */
+static void _push_donated_node(BadStack *stack, Status *status, PathNode *node) {
+    /* the donor checked it against its theta, ours may know more orbits */
+    if (node_in_mcr(status, node)) {
+        stack_lock(stack);
+        stack_push(stack, node);    /* push current node to stack, stack now owns it, we don't free it here */
+        stack_unlock(stack);
+    } else {
+        FREEPATHNODE(node);
+    }
+}
+
+/* InvarKeys travel in MPI_INT messages, low half of each 64 bit word first */
+static int _pack_key(int *msg, InvarKey *key) {
+    int m = 0;
+    for (int i = 0; i < INVAR_KEY_WORDS; ++i) {
+        msg[m++] = (int)(key->lead[i] & 0xFFFFFFFFUL);
+        msg[m++] = (int)(key->lead[i] >> 32);
+    }
+    msg[m++] = (int)(key->hash & 0xFFFFFFFFUL);
+    msg[m++] = (int)(key->hash >> 32);
+    return m;
+}
+
+static int _unpack_key(int *msg, InvarKey *key) {
+    int m = 0;
+    for (int i = 0; i < INVAR_KEY_WORDS; ++i, m += 2) {
+        key->lead[i] = (unsigned long)(unsigned int)msg[m] | ((unsigned long)(unsigned int)msg[m+1] << 32);
+    }
+    key->hash = (unsigned long)(unsigned int)msg[m] | ((unsigned long)(unsigned int)msg[m+1] << 32);
+    return m + 2;
+}
+
+/**
+ * Broadcasts (new CL, new automorphism) go down a binomial tree rooted at the process that
+ * found them, instead of the root sending to every process.  Every message starts with the
+ * root's rank, so whoever receives it can work out its own children and forward it, and ends
+ * with the sender's stack size, which each forwarder overwrites with its own.
+ *
+ * Sends come out of a fixed pool of slots.  A slot is free again once all its sends complete,
+ * when the pool is full we wait on the oldest slot, so the memory held by in flight broadcasts
+ * is bounded by the pool size.
+ */
+
+/* checks every busy slot, and frees the ones whose sends have all completed */
+static void _bcast_progress(MPIState *mpi_state) {
+    int done;
+    for (int i = 0; i < mpi_state->num_bcast_slots; ++i) {
+        BcastSlot *slot = &mpi_state->bcast_slots[i];
+        if (slot->num_requests == 0) continue;
+        MPI_Testall(slot->num_requests, slot->requests, &done, MPI_STATUSES_IGNORE);
+        if (done) slot->num_requests = 0;
+    }
+}
+
+/* returns a free slot with room for msg_sz words, waiting on the oldest busy slot if none are free */
+static BcastSlot *_bcast_acquire(MPIState *mpi_state, int msg_sz) {
+    _bcast_progress(mpi_state);
+
+    BcastSlot *slot = NULL;
+    for (int i = 0; i < mpi_state->num_bcast_slots && slot == NULL; ++i) {
+        int s = (mpi_state->bcast_next + i) % mpi_state->num_bcast_slots;
+        if (mpi_state->bcast_slots[s].num_requests == 0) slot = &mpi_state->bcast_slots[s];
+    }
+    if (slot == NULL) {
+        /* pool is full, the messages are small so these sends are normally already on their way */
+        slot = &mpi_state->bcast_slots[mpi_state->bcast_next];
+        MPI_Waitall(slot->num_requests, slot->requests, MPI_STATUSES_IGNORE);
+        slot->num_requests = 0;
+    }
+    mpi_state->bcast_next = (int)(slot - mpi_state->bcast_slots + 1) % mpi_state->num_bcast_slots;
+
+    if (slot->capacity < msg_sz) {
+        int *buf = (int*)realloc(slot->buf, sizeof(int)*msg_sz);
+        if (buf == NULL) alloc_error("_bcast_acquire");
+        slot->buf = buf;
+        slot->capacity = msg_sz;
+    }
+    return slot;
+}
+
+/* sends the slot's message to our children in root's binomial tree, biggest subtree first */
+static void _bcast_post(MPIState *mpi_state, BcastSlot *slot, int msg_sz, int tag) {
+    int p = mpi_state->num_processes;
+    int root = slot->buf[0];
+    int rel = (mpi_state->my_rank - root + p) % p;     /* our rank in the tree, root is 0 */
+
+    /* our children are rel + 2^k for every 2^k below our lowest set bit (all of them for the root) */
+    int mask = 1;
+    while (mask < p && !(rel & mask)) mask <<= 1;
+    for (mask >>= 1; mask > 0; mask >>= 1) {
+        if (rel + mask >= p) continue;
+        MPI_Isend(slot->buf, msg_sz, MPI_INT, (rel + mask + root) % p, tag, MPI_COMM_WORLD, &slot->requests[slot->num_requests++]);
+        ++mpi_state->bcast_sent;
+    }
+}
+
+/* passes a received broadcast on to our subtree */
+static void _bcast_forward(MPIState *mpi_state, BadStack *stack, int *msg, int msg_sz, int tag) {
+    BcastSlot *slot = _bcast_acquire(mpi_state, msg_sz);
+    memcpy(slot->buf, msg, sizeof(int)*msg_sz);
+    slot->buf[msg_sz-1] = stack_size(stack);   /* the receivers learn our load, not the root's */
+    _bcast_post(mpi_state, slot, msg_sz, tag);
+}
+
+/**
+ * Answers a MPI_MSG_NEED_WORK from thief, with a donation from the bottom of our stack or a reject.
+ * Called from mpi_poll_for_messages, or from the progress thread when it's running.
+ */
+static void _answer_need_work(MPIState *mpi_state, BadStack *stack, int thief) {
+    int nomsg;          /* single word messages, these carry the sender's stack size */
+    MPI_Recv(&nomsg, 1, MPI_INT, thief, MPI_MSG_NEED_WORK, mpi_state->steal_comm, MPI_STATUS_IGNORE);
+    if (!mpi_state->progress_running) mpi_state->load_table[thief] = nomsg;  /* the thief advertises its (empty) stack, the load table is the main thread's */
+
+    int *msg = NULL;
+    int buff_sz = 2;  /* start with 1 for the record count, and 1 for our stack size at the end */
+
+    _lock(mpi_state);
+    int send_sz = _donation_size(mpi_state, stack_size(stack));
+    _record_steal_outcome(mpi_state, send_sz == 0);
+
+    if (send_sz > 0) { 
+        /* we have enough work to send */
+        for (int i = 0; i < send_sz; ++i) {
+            buff_sz += _node_words(stack_peek_at(stack, i));
+        }
+
+        msg = (int*)malloc(sizeof(int)*buff_sz);   /* allocate message buffer */
+        if (msg == NULL) alloc_error("_answer_need_work");
+
+        /* fill the message buffer */
+        msg[0] = send_sz;                                   /* first word of the message is the number of nodes sent */
+        int m = 1;                                          /* variable to be used as the message index */
+        
+        /* loop through nodes we're going to send */
+        for (int i = 0; i < send_sz; ++i) {
+            m += _pack_node(msg + m, stack_peek_at(stack, i));
+        }
+        delete_from_bottom_of_stack(stack, send_sz);    /* once we make the message to send, we delete the entries from the stack */
+        msg[m++] = stack_size(stack);                   /* last word is what we have left, so the thief knows if it can come back */
+        ++mpi_state->work_sent;     /* counted for the counting work end detection */
+
+        /**
+         * this check is for the Dijkstra's modified token algorithm
+         * 
+         * if we send to a lower number process, we need to mark our state dirty, so work end checks don't get
+         * goobered up.
+         */
+        if (thief < mpi_state->my_rank) {
+            mpi_state->workstop_detection_state = MPI_TOKEN_STATE_DIRTY;
+        }
+    } else {
+        nomsg = stack_size(stack);  /* the reject carries our stack size */
+    }
+    _unlock(mpi_state);
+
+    if (send_sz > 0) {
+        if (__DEBUG_MPI__) printf("MPI: Process %d: about to send %d nodes (%d words) to %d in NEED_WORK\n",mpi_state->my_rank, send_sz, buff_sz, thief);
+        MPI_Send( msg, buff_sz, MPI_INT, thief, MPI_MSG_TAKE_WORK, mpi_state->steal_comm);
+
+        /* free message buffer */
+        free(msg);
+    } else {
+        /* we are here because we were asked for work, but don't have enough to give */
+        /** send reject message for more work */
+        MPI_Send (&nomsg, 1, MPI_INT, thief, MPI_MSG_REJECT_NEED_WORK, mpi_state->steal_comm);
+        if (__DEBUG_MPI__) printf("MPI: Process %d: sent work reject to %d\n",mpi_state->my_rank, thief);
+        /** */
+    }
+}
+
+/**
+ * The progress thread (--progress-thread) answers steal requests, so thieves get an answer even
+ * while the main thread is deep in a long refinement.  It only ever receives MPI_MSG_NEED_WORK
+ * on steal_comm, everything else is still handled by the main thread.
+ */
+static void *_progress_loop(void *arg) {
+    MPIState *mpi_state = (MPIState*)arg;
+    MPI_Status recv_status;
+    int flag;
+    struct timespec ts = {0, MPI_CONST_PROGRESS_POLL_NS};
+
+    while (!__atomic_load_n(&mpi_state->progress_stop, __ATOMIC_ACQUIRE)) {
+        MPI_Iprobe(MPI_ANY_SOURCE, MPI_MSG_NEED_WORK, mpi_state->steal_comm, &flag, &recv_status);
+        if (flag) {
+            _answer_need_work(mpi_state, mpi_state->progress_stack, recv_status.MPI_SOURCE);
+        } else {
+            nanosleep(&ts, NULL);   /* don't steal the core from the main thread */
+        }
+    }
+    return NULL;
+}
+
+void mpi_start_progress_thread(MPIState *mpi_state, BadStack *stack) {
+    if (!mpi_state->progress_thread) return;
+    mpi_state->progress_stack = stack;
+    mpi_state->progress_stop = 0;
+    stack->lock = &mpi_state->lock;     /* from here on the main thread locks the stack when it changes it */
+    mpi_state->progress_running = TRUE;
+    if (pthread_create(&mpi_state->progress_tid, NULL, _progress_loop, mpi_state) != 0) runtime_error("mpi_start_progress_thread: pthread_create failed");
+}
+
+void mpi_stop_progress_thread(MPIState *mpi_state) {
+    if (!mpi_state->progress_running) return;
+    __atomic_store_n(&mpi_state->progress_stop, 1, __ATOMIC_RELEASE);
+    pthread_join(mpi_state->progress_tid, NULL);
+    mpi_state->progress_stack->lock = NULL;
+    mpi_state->progress_running = FALSE;
+}
+
+/**
+ * --rma-state keeps the orbits and the best key in an MPI window on rank 0, instead of
+ * broadcasting automorphisms and labels to everyone.
+ *
+ * The orbits are a union find forest with parent[v] <= v, so every root is the smallest vertex
+ * of its orbit.  A union only ever points a root at a smaller root, with MPI_Compare_and_swap,
+ * so it needs no lock, and a lost race just means following the new parent and trying again.
+ * The key is several words compared together, so it's guarded by a spin lock word, also taken
+ * with MPI_Compare_and_swap.  Every successful union bumps a generation word, processes read
+ * that word when they poll and only read the forest when it has moved.  The labels are only
+ * collected at the end (mpi_rma_collect), from the processes whose key could be the best.
+ *
+ * The whole run is one passive target epoch (MPI_Win_lock_all), every operation is flushed.
+ */
+void mpi_rma_initialize(MPIState *mpi_state, int n) {
+    if (!mpi_state->rma_state) return;
+
+    mpi_state->rma_n = n;
+    mpi_state->rma_generation = 0;
+    MPI_Aint win_sz = mpi_state->my_rank == 0 ? (MPI_Aint)sizeof(long) * (MPI_RMA_PARENT + n) : 0;
+    MPI_Win_allocate(win_sz, sizeof(long), MPI_INFO_NULL, MPI_COMM_WORLD, &mpi_state->rma_base, &mpi_state->rma_win);
+    MPI_Win_lock_all(0, mpi_state->rma_win);
+
+    if (mpi_state->my_rank == 0) {
+        long *base = mpi_state->rma_base;
+        base[MPI_RMA_LOCK] = 0;
+        base[MPI_RMA_OWNER] = -1;
+        for (int i = 0; i <= INVAR_KEY_WORDS; ++i) base[MPI_RMA_KEY + i] = 0;
+        base[MPI_RMA_GENERATION] = 0;
+        for (int v = 0; v < n; ++v) base[MPI_RMA_PARENT + v] = v;     /* every vertex in its own orbit */
+        MPI_Win_sync(mpi_state->rma_win);
+    }
+    MPI_Barrier(MPI_COMM_WORLD);    /* nobody touches the window before rank 0 has set it up */
+
+    mpi_state->rma_parents = (long*)malloc(sizeof(long)*n);
+    mpi_state->rma_scratch = (int*)malloc(sizeof(int)*n);
+    if (mpi_state->rma_parents == NULL || mpi_state->rma_scratch == NULL) alloc_error("mpi_rma_initialize");
+}
+
+/* copies the orbit forest into rma_parents, each word read atomically */
+static void _rma_read_orbits(MPIState *mpi_state) {
+    MPI_Get_accumulate(NULL, 0, MPI_LONG, mpi_state->rma_parents, mpi_state->rma_n, MPI_LONG,
+                       0, MPI_RMA_PARENT, mpi_state->rma_n, MPI_LONG, MPI_NO_OP, mpi_state->rma_win);
+    MPI_Win_flush(0, mpi_state->rma_win);
+}
+
+/* the window's generation word, read atomically */
+static long _rma_read_generation(MPIState *mpi_state) {
+    long generation;
+    MPI_Fetch_and_op(NULL, &generation, MPI_LONG, 0, MPI_RMA_GENERATION, MPI_NO_OP, mpi_state->rma_win);
+    MPI_Win_flush(0, mpi_state->rma_win);
+    return generation;
+}
+
+static long _rma_root(long *parent, long v) {
+    while (parent[v] != v) v = parent[v];
+    return v;
+}
+
+/* joins the orbits of a and b in the window, rma_parents is our (possibly stale) copy of the forest */
+static void _rma_union(MPIState *mpi_state, long a, long b) {
+    long *parent = mpi_state->rma_parents;
+    long result, tmp;
+
+    while (1) {
+        a = _rma_root(parent, a);
+        b = _rma_root(parent, b);
+        if (a == b) return;
+        if (a > b) {tmp = a; a = b; b = tmp;}
+
+        /* point root b at a, if b is still a root */
+        MPI_Compare_and_swap(&a, &b, &result, MPI_LONG, 0, MPI_RMA_PARENT + b, mpi_state->rma_win);
+        MPI_Win_flush(0, mpi_state->rma_win);
+        if (result == b) {
+            parent[b] = a;
+            long one = 1;   /* after the link is flushed, so a poller that sees the new generation sees the link */
+            MPI_Accumulate(&one, 1, MPI_LONG, 0, MPI_RMA_GENERATION, 1, MPI_LONG, MPI_SUM, mpi_state->rma_win);
+            MPI_Win_flush(0, mpi_state->rma_win);
+            return;
+        }
+        parent[b] = result;     /* someone else linked b first, follow them and try again */
+    }
+}
+
+/* joins every orbit of theta in the window */
+void mpi_rma_publish_orbits(MPIState *mpi_state, partition *theta) {
+    _rma_read_orbits(mpi_state);
+    int cell = 0;
+    for (int i = 0; i < theta->sz; ++i) {
+        if (theta->ptn[i] != 0) continue;
+        for (int j = cell + 1; j <= i; ++j) _rma_union(mpi_state, theta->lab[cell], theta->lab[j]);
+        cell = i + 1;
+    }
+}
+
+/* takes the key lock, the window's key and owner words are ours until _rma_key_unlock */
+static void _rma_key_lock(MPIState *mpi_state) {
+    long me = mpi_state->my_rank + 1, free_word = 0, result;
+    do {
+        MPI_Compare_and_swap(&me, &free_word, &result, MPI_LONG, 0, MPI_RMA_LOCK, mpi_state->rma_win);
+        MPI_Win_flush(0, mpi_state->rma_win);
+    } while (result != 0);
+}
+
+static void _rma_key_unlock(MPIState *mpi_state) {
+    long free_word = 0;
+    MPI_Accumulate(&free_word, 1, MPI_LONG, 0, MPI_RMA_LOCK, 1, MPI_LONG, MPI_REPLACE, mpi_state->rma_win);
+    MPI_Win_flush(0, mpi_state->rma_win);
+}
+
+/* reads the owner and key words, returns the owner, -1 if no one has published a key yet */
+static int _rma_read_key(MPIState *mpi_state, InvarKey *key) {
+    long words[INVAR_KEY_WORDS + 2];
+    MPI_Get_accumulate(NULL, 0, MPI_LONG, words, INVAR_KEY_WORDS + 2, MPI_LONG,
+                       0, MPI_RMA_OWNER, INVAR_KEY_WORDS + 2, MPI_LONG, MPI_NO_OP, mpi_state->rma_win);
+    MPI_Win_flush(0, mpi_state->rma_win);
+    for (int i = 0; i < INVAR_KEY_WORDS; ++i) key->lead[i] = (unsigned long)words[1 + i];
+    key->hash = (unsigned long)words[1 + INVAR_KEY_WORDS];
+    return (int)words[0];
+}
+
+/**
+ * Puts our new best key in the window if it beats the one there.  A tie on the leading words
+ * leaves the window alone, mpi_rma_collect compares the full labels of everyone tied.
+ */
+void mpi_rma_publish_key(MPIState *mpi_state, InvarKey *key) {
+    InvarKey best;
+    long words[INVAR_KEY_WORDS + 2];
+
+    _rma_key_lock(mpi_state);
+    int owner = _rma_read_key(mpi_state, &best);
+    if (owner < 0 || compare_invariant_keys(&best, key) < 0) {
+        words[0] = mpi_state->my_rank;
+        for (int i = 0; i < INVAR_KEY_WORDS; ++i) words[1 + i] = (long)key->lead[i];
+        words[1 + INVAR_KEY_WORDS] = (long)key->hash;
+        MPI_Accumulate(words, INVAR_KEY_WORDS + 2, MPI_LONG, 0, MPI_RMA_OWNER, INVAR_KEY_WORDS + 2, MPI_LONG, MPI_REPLACE, mpi_state->rma_win);
+        MPI_Win_flush(0, mpi_state->rma_win);
+        if (__DEBUG_MPI__) printf("MPI: Process %d: published a new best key\n", mpi_state->my_rank);
+    }
+    _rma_key_unlock(mpi_state);
+}
+
+/**
+ * Brings theta up to date with the window's orbits, and prunes the stack if that joined any.
+ * Our own theta goes into the local copy of the forest too, it may have orbits we haven't
+ * published, since we only publish when an automorphism shrinks the mcr.  Nothing is done, past
+ * reading one word, unless some process has joined orbits since we last looked.
+ */
+static void _rma_refresh_orbits(MPIState *mpi_state, BadStack *stack, Status *status) {
+    long *parent = mpi_state->rma_parents;
+    int *count = mpi_state->rma_scratch;
+    int n = mpi_state->rma_n;
+    partition *theta = status->theta;
+
+    /* generation first, a union counted in it is already in the forest we read after it */
+    long generation = _rma_read_generation(mpi_state);
+    if (generation == mpi_state->rma_generation) return;
+    mpi_state->rma_generation = generation;
+    _rma_read_orbits(mpi_state);
+
+    /* fold theta into the copy, smaller root wins, same as the window */
+    int cell = 0;
+    for (int i = 0; i < theta->sz; ++i) {
+        if (theta->ptn[i] != 0) continue;
+        for (int j = cell + 1; j <= i; ++j) {
+            long a = _rma_root(parent, theta->lab[cell]), b = _rma_root(parent, theta->lab[j]);
+            if (a < b) parent[b] = a; else parent[a] = b;
+        }
+        cell = i + 1;
+    }
+
+    /* the forest has at least theta's orbits, so the same number of roots means nothing new */
+    int roots = 0;
+    for (int v = 0; v < n; ++v) {
+        parent[v] = _rma_root(parent, v);   /* flatten, parent is the root from here on */
+        if (parent[v] == v) ++roots;
+    }
+    if (roots == status->mcr_sz) return;
+
+    /* rebuild theta, one cell per root, in root order (counting sort) */
+    for (int v = 0; v < n; ++v) count[v] = 0;
+    for (int v = 0; v < n; ++v) ++count[parent[v]];
+    int pos = 0;
+    for (int v = 0; v < n; ++v) {
+        int c = count[v];
+        count[v] = pos;     /* now the start of v's cell, if v is a root */
+        pos += c;
+    }
+    for (int v = 0; v < n; ++v) {
+        theta->lab[count[parent[v]]] = v;
+        theta->ptn[count[parent[v]]++] = 1;
+    }
+    for (int v = 0; v < n; ++v) {
+        if (parent[v] == v) theta->ptn[count[v] - 1] = 0;   /* count[v] is now one past the end of the cell */
+    }
+
+    if (__DEBUG_MPI__) printf("MPI: Process %d: window orbits took theta from %d to %d orbits\n", mpi_state->my_rank, status->mcr_sz, roots);
+    automorphisms_calculate_mcr(theta, status->mcr, &status->mcr_sz);
+    prune_stack(stack, status);
+}
+
 /**
  * This function polls for general messages coming from other processes
  * 
@@ -33,7 +776,14 @@
 void mpi_poll_for_messages (MPIState *mpi_state, BadStack *stack, Status *status) {
     MPI_Status recv_status;  /* MPI_Recv status variable */
     int flag = 0;           /* flag used for MPI_Iprobe to report if there are messages */
-    int nomsg;          /* dummy variable used when we don't care about the incoming message */
+    int nomsg;          /* single word messages, these carry the sender's stack size */
+
+    if (mpi_state->rma_state) _rma_refresh_orbits(mpi_state, stack, status);
+
+    /* automorphisms that have waited long enough go out now, even if the batch isn't full */
+    if (mpi_state->auto_batch_sz > 0 && MPI_Wtime() - mpi_state->auto_batch_started >= mpi_state->auto_batch_delay) {
+        mpi_flush_automorphisms(mpi_state, stack);
+    }
 
     MPI_Iprobe( MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD , &flag , &recv_status);
     // if (__DEBUG_MPI__ && flag) printf("MPI: Process %d: Probed for communications, flag: %d,  remote: %d  tag: %d\n",mpi_state->my_rank, flag, recv_status.MPI_SOURCE, recv_status.MPI_TAG);
@@ -42,106 +792,43 @@ void mpi_poll_for_messages (MPIState *mpi_state, BadStack *stack, Status *status
     while (flag) { /* we have a message waiting */
         switch (recv_status.MPI_TAG) /* what we do depends on what type of message this is, and our state */
         {
-        case MPI_MSG_NEED_WORK: {
-                MPI_Recv(&nomsg, 1, MPI_INT, recv_status.MPI_SOURCE, recv_status.MPI_TAG, MPI_COMM_WORLD, &recv_status);
-
-                if (stack_size(stack) > MPI_CONST_SEND_WORK_CUTOFF_DEPTH) { 
-
-                    /* we have enough work to send */
-                    int send_sz = (stack_size(stack) - MPI_CONST_SEND_WORK_CUTOFF_DEPTH + 1) / 2;  /* for lack of better plan, send half 
-                                                        the work between cutoff depth and bottom of stack. rounded up (hence the +1)*/
-
-                    if (send_sz > MPI_CONST_MAX_WORK_SIZE_TO_SEND) send_sz = MPI_CONST_MAX_WORK_SIZE_TO_SEND;  /* limit amount of work to send in one chunk */
-                    PathNode *curr;
-                    int buff_sz = 1;  /* start with 1 for the record count */
-                    for (int i = 0; i < send_sz; ++i) {
-                        buff_sz += 2;                                   /* add 1 for each of the size variables */
-                        curr = stack_peek_at(stack, i);                 /* get pointer to stack location i */
-                        buff_sz += curr->path->sz;        /* add the path size */
-                        buff_sz += (curr->pi->sz) * 2;    /* add 2 x the partition size (once for each array )*/
-                    }
-
-                    int *msg = (int*)malloc(sizeof(int)*buff_sz);   /* allocate message buffer */
-
-                    /* fill the message buffer */
-                    msg[0] = send_sz;                                   /* first word of the message is the number of nodes sent */
-                    int m = 1;                                          /* variable to be used as the message index */
-                    
-                    /* loop through nodes we're going to send */
-                    for (int i = 0; i < send_sz; ++i) {
-                        curr = stack_peek_at(stack, i);                 /* get pointer to stack location i */
-                        
-                        /** Add the current PathNode's path to the message */
-                        msg[m++] = curr->path->sz;                      /* set first word of current node to the size of the path */
-                        /* loop through the path and put the path words into the message */
-                        for (int j = 0; j < curr->path->sz; ++j) {
-                            msg[m++] = curr->path->data[j];             
-                        }
-                        /** */
-
-                        /** Add the current PathNode's parition (pi) to the message */
-                        msg[m++] = curr->pi->sz;                        /* set the next word to the size of the partion pi */
-                        /* loop through the partition and put the lab words into the message */
-                        for (int j = 0; j < curr->pi->sz; ++j) {
-                            msg[m++] = curr->pi->lab[j];
-                        }
-                        /* loop through the partition and put the ptn words into the message */
-                        for (int j = 0; j < curr->pi->sz; ++j) {
-                            msg[m++] = curr->pi->ptn[j];
-                        }
-                        /** */
-                    }
-                    delete_from_bottom_of_stack(stack, send_sz);    /* once we make the message to send, we delete the entries from the stack */
-
-                    if (__DEBUG_MPI__) printf("MPI: Process %d: about to send %d nodes (%d words) to %d in NEED_WORK\n",mpi_state->my_rank, send_sz, buff_sz, recv_status.MPI_SOURCE);
-                    MPI_Send( msg, buff_sz, MPI_INT, recv_status.MPI_SOURCE, MPI_MSG_TAKE_WORK, MPI_COMM_WORLD);
-
-                    /**
-                     * this check is for the Dijkstra's modified token algorithm
-                     * 
-                     * if we send to a lower number process, we need to mark our state dirty, so work end checks don't get
-                     * goobered up.
-                     */
-                    if (recv_status.MPI_SOURCE < mpi_state->my_rank) {
-                        mpi_state->workstop_detection_state = MPI_TOKEN_STATE_DIRTY;
-                    }
-
-                    /* free message buffer */
-                    free(msg);
-
+        case MPI_MSG_NEED_WORK:
+            _answer_need_work(mpi_state, stack, recv_status.MPI_SOURCE);
+            break;
 
-                } else {
-                    /* we are here because we were asked for work, but don't have enough to give */
-                    /** send reject message for more work */
-                    nomsg = MPI_MSG_REJECT_NEED_WORK;
-                    MPI_Send (&nomsg, 1, MPI_INT, recv_status.MPI_SOURCE, MPI_MSG_REJECT_NEED_WORK, MPI_COMM_WORLD);
-                    if (__DEBUG_MPI__) printf("MPI: Process %d: sent work reject to %d\n",mpi_state->my_rank, recv_status.MPI_SOURCE);
-                    /** */
-                }
-                break;
-            }
         case MPI_MSG_WORK_STOP_TOKEN:{
             /* we received a work stop token, but we are not mot int the query work end state */
             
-            /* token is a two word token, the first word is the initiating process rank, the second is the token state */
-            int token[2];
-            MPI_Recv(&token, 2, MPI_INT, recv_status.MPI_SOURCE, MPI_MSG_WORK_STOP_TOKEN, MPI_COMM_WORLD, &recv_status);
+            /* token is MPI_TOKEN_SZ words, the initiating process rank, the token state, the most loaded rank
+                seen on this lap and its stack size, and the sender's stack size */
+            int token[MPI_TOKEN_SZ];
+            MPI_Recv(&token, MPI_TOKEN_SZ, MPI_INT, recv_status.MPI_SOURCE, MPI_MSG_WORK_STOP_TOKEN, MPI_COMM_WORLD, &recv_status);
+            mpi_state->load_table[recv_status.MPI_SOURCE] = token[4];
             
             /* first deal with our clean/dirt state */
+            _lock(mpi_state);
             if (mpi_state->workstop_detection_state == MPI_TOKEN_STATE_DIRTY) {
                 mpi_state->workstop_detection_state = MPI_TOKEN_STATE_CLEAN; /* reset our state to clean */
                 if (token[1] == MPI_TOKEN_STATE_CLEAN) token[1] = MPI_TOKEN_STATE_DIRTY; /* if token was clean set it to dirty */
             }
             
-            if (stack_size(stack) > MPI_CONST_SEND_WORK_CUTOFF_DEPTH) {
+            if (stack_size(stack) > mpi_state->send_work_cutoff_depth) {
                 token[1] = MPI_TOKEN_STATE_NOT_IDLE_CAN_SHARE;
             } else if (stack_size(stack) > 0) {
                 token[1] = MPI_TOKEN_STATE_NOT_IDLE;
             }
+            _unlock(mpi_state);
+
+            /* advertise our load on the token, so the initiator learns who is worth asking */
+            if (stack_size(stack) > token[3]) {
+                token[2] = mpi_state->my_rank;
+                token[3] = stack_size(stack);
+            }
+            token[4] = stack_size(stack);
 
             /* send token to process with next highest rank */
             int send_to_rank = (mpi_state->my_rank + 1) % mpi_state->num_processes;
-            MPI_Send (&token, 2, MPI_INT, send_to_rank, MPI_MSG_WORK_STOP_TOKEN, MPI_COMM_WORLD);
+            MPI_Send (&token, MPI_TOKEN_SZ, MPI_INT, send_to_rank, MPI_MSG_WORK_STOP_TOKEN, MPI_COMM_WORLD);
             break;
             }
 
@@ -154,8 +841,14 @@ void mpi_poll_for_messages (MPIState *mpi_state, BadStack *stack, Status *status
 
             MPI_Recv(msg, msg_sz, MPI_INT, recv_status.MPI_SOURCE, recv_status.MPI_TAG, MPI_COMM_WORLD, &recv_status);
             if (__DEBUG_MPI__) printf("MPI: Process %d: received %d words from %d in MPI_MSG_NEW_CL \n",mpi_state->my_rank, msg_sz, recv_status.MPI_SOURCE);
+            mpi_state->load_table[recv_status.MPI_SOURCE] = msg[msg_sz-1];  /* last word is the sender's stack size */
+            ++mpi_state->bcast_received;
+            _bcast_forward(mpi_state, stack, msg, msg_sz, MPI_MSG_NEW_CL);
+
+            int m = 1; /* variable used to walk through the message, msg[0] is the broadcast root */
 
-            int m = 0; /* variable used to walk through the message */
+            InvarKey key;
+            m += _unpack_key(msg + m, &key);
 
             Path *path;
             DYNALLOCPATH(path, msg[m], "Path MPI_MSG_NEW_CL")    /* Allocate space for path */
@@ -178,7 +871,7 @@ void mpi_poll_for_messages (MPIState *mpi_state, BadStack *stack, Status *status
             for (int j = 0; j < pi->sz; ++j) {
                 pi->ptn[j] = msg[m++];
             }
-            mpi_handle_new_best_cononical_label(status, path, pi);
+            mpi_handle_new_best_cononical_label(status, &key, path, pi);
             
             /* free memory */
             FREEPATH(path);
@@ -189,7 +882,7 @@ void mpi_poll_for_messages (MPIState *mpi_state, BadStack *stack, Status *status
             }
 
         case MPI_MSG_NEW_AUTO: {
-            /* we receieved a new automorphism */
+            /* we receieved a batch of new automorphisms */
 
             int msg_sz;
             MPI_Get_count(&recv_status, MPI_INT, &msg_sz);
@@ -197,24 +890,32 @@ void mpi_poll_for_messages (MPIState *mpi_state, BadStack *stack, Status *status
 
             MPI_Recv(msg, msg_sz, MPI_INT, recv_status.MPI_SOURCE, recv_status.MPI_TAG, MPI_COMM_WORLD, &recv_status);
             if (__DEBUG_MPI__) printf("MPI: Process %d: received %d words from %d in MPI_MSG_NEW_AUTO \n",mpi_state->my_rank, msg_sz, recv_status.MPI_SOURCE);
+            mpi_state->load_table[recv_status.MPI_SOURCE] = msg[msg_sz-1];  /* last word is the sender's stack size */
+            ++mpi_state->bcast_received;
+            _bcast_forward(mpi_state, stack, msg, msg_sz, MPI_MSG_NEW_AUTO);
 
-            int m = 0; /* variable used to walk through the message */
+            int m = 2; /* variable used to walk through the message, msg[0] is the broadcast root, msg[1] the count */
 
-            partition *pi;
-            DYNALLOCPART(pi, msg[m], "pi MPI_MSG_NEW_AUTO")        /* Allocat space for pi */
-            ++m;    /* need to pull this out ofhte DYNALLOCPART statement, as it would increment more than once */
+            int old_mcr_sz = status->mcr_sz;
+            for (int i = 0; i < msg[1]; ++i) {
+                partition *pi;
+                DYNALLOCPART(pi, msg[m], "pi MPI_MSG_NEW_AUTO")        /* Allocat space for pi */
+                ++m;    /* need to pull this out ofhte DYNALLOCPART statement, as it would increment more than once */
 
-            /* extract partition lab form message */
-            for (int j = 0; j < pi->sz; ++j) {
-                pi->lab[j] = msg[m++];
-            }
-            /* extract partition ptn form message */
-            for (int j = 0; j < pi->sz; ++j) {
-                pi->ptn[j] = msg[m++];
-            }
+                /* extract partition lab form message */
+                for (int j = 0; j < pi->sz; ++j) {
+                    pi->lab[j] = msg[m++];
+                }
+                /* extract partition ptn form message */
+                for (int j = 0; j < pi->sz; ++j) {
+                    pi->ptn[j] = msg[m++];
+                }
 
-            /* pass ownership of pi (the automorphism) to the main function, don't free it here! */
-            mpi_handle_new_automorphism(status, pi);
+                /* pass ownership of pi (the automorphism) to the main function, don't free it here! */
+                mpi_handle_new_automorphism(status, pi);
+            }
+            automorphisms_calculate_mcr(status->theta, status->mcr, &status->mcr_sz);  /* once for the whole batch */
+            if (status->mcr_sz < old_mcr_sz) prune_stack(stack, status);                /* queued nodes may be in non minimal orbits now */
             
             /* free memory */
             free(msg);
@@ -233,6 +934,11 @@ void mpi_poll_for_messages (MPIState *mpi_state, BadStack *stack, Status *status
             if (mpi_state->state == MPI_STATE_ASKING_FOR_WORK && (recv_status.MPI_TAG == MPI_MSG_REJECT_NEED_WORK || recv_status.MPI_TAG ==MPI_MSG_TAKE_WORK)) {
                 return;
             }
+            if (mpi_state->state == MPI_STATE_WORK_END && recv_status.MPI_TAG == MPI_MSG_REJECT_NEED_WORK) {
+                /* with counting detection, we can stop before the victim answers, just clear it */
+                MPI_Recv(&nomsg, 1, MPI_INT, recv_status.MPI_SOURCE, recv_status.MPI_TAG, MPI_COMM_WORLD, &recv_status);
+                break;
+            }
             /* if we get an unknown message type, print a message an quit */
             printf("Unkown message type received.  My Rank: %d   Sender Rank: %d    Tag: %d\n", mpi_state->my_rank, recv_status.MPI_SOURCE, recv_status.MPI_TAG);
             exit(1);
@@ -249,36 +955,52 @@ void mpi_poll_for_messages (MPIState *mpi_state, BadStack *stack, Status *status
 
 void mpi_ask_for_work(MPIState *mpi_state, BadStack *stack, Status *status) {
     /** In Ask for Work state */
-    mpi_state->partner_rank = rand() % mpi_state->num_processes;      /* pick a random partner */
-    if (mpi_state->partner_rank == mpi_state->my_rank) mpi_state->partner_rank = (mpi_state->partner_rank + 1) % mpi_state->num_processes;  
+    mpi_flush_automorphisms(mpi_state, stack);  /* we're out of work, nothing else is going to join the batch */
+    _shuffle_victims(mpi_state);        /* random order, but same host processes first */
+    _order_victims_by_load(mpi_state);  /* then most loaded first, by what they last advertised */
 
     MPI_Status recv_status;  /* MPI status used for probe and receive functions */
     MPI_Request request;
 
 
-    int tries = 1;
     /* we will try each partner process once */
-    while (tries++ < mpi_state->num_processes) {
+    for (int v = 0; v < mpi_state->num_victims; ++v) {
+        mpi_state->partner_rank = mpi_state->victims[v];
+
+        /**
+         * Skip processes that told us they can't share.  Forget what they told us, so they get
+         * asked next round, their stack might have grown since.
+         */
+        if (mpi_state->load_table[mpi_state->partner_rank] != MPI_LOAD_UNKNOWN &&
+                mpi_state->load_table[mpi_state->partner_rank] <= mpi_state->send_work_cutoff_depth) {
+            mpi_state->load_table[mpi_state->partner_rank] = MPI_LOAD_UNKNOWN;
+            continue;
+        }
+
         mpi_state->state = MPI_STATE_ASKING_FOR_WORK;   /* set our state machine to asking for work */
         
-        int nomsg = MPI_MSG_NEED_WORK;
+        int nomsg = stack_size(stack);  /* the request carries our stack size, which is empty */
         if (__DEBUG_MPI__) printf("MPI: Process %d: Asking process %d for more work\n",mpi_state->my_rank, mpi_state->partner_rank);
-        MPI_Isend(&nomsg, 1, MPI_INT, mpi_state->partner_rank, MPI_MSG_NEED_WORK, MPI_COMM_WORLD, &request); /* send request for work */
+        MPI_Isend(&nomsg, 1, MPI_INT, mpi_state->partner_rank, MPI_MSG_NEED_WORK, mpi_state->steal_comm, &request); /* send request for work */
         
         int flag;
+        int delay_us = 0;   /* idle backoff */
 
         /* this while loop allows us to keep probing for status to our work request, even if we get another message while waiting */
         while(mpi_state->state == MPI_STATE_ASKING_FOR_WORK) {
             /** wait for a response */
-            MPI_Iprobe(mpi_state->partner_rank, MPI_ANY_TAG, MPI_COMM_WORLD, &flag, &recv_status);
+            MPI_Iprobe(mpi_state->partner_rank, MPI_ANY_TAG, mpi_state->steal_comm, &flag, &recv_status);
             if (flag) {
+                delay_us = 0;
 
                 /* depending on the tag received take action */
                 switch (recv_status.MPI_TAG)
                 {
                 case MPI_MSG_REJECT_NEED_WORK:
                     /* we got a reject, need to clear the message, and try again */
-                    MPI_Recv(&nomsg, 1, MPI_INT, mpi_state->partner_rank, recv_status.MPI_TAG, MPI_COMM_WORLD, &recv_status);
+                    MPI_Recv(&nomsg, 1, MPI_INT, mpi_state->partner_rank, recv_status.MPI_TAG, mpi_state->steal_comm, &recv_status);
+                    mpi_state->load_table[mpi_state->partner_rank] = nomsg;    /* reject carries the victim's stack size */
+                    _lock(mpi_state); _record_steal_outcome(mpi_state, TRUE); _unlock(mpi_state);
                     mpi_state->state = MPI_STATE_REJECTED;
                     break;
                     
@@ -286,40 +1008,24 @@ void mpi_ask_for_work(MPIState *mpi_state, BadStack *stack, Status *status) {
                     /* we got some work */
 
                     mpi_state->state = MPI_STATE_WORK_RECEIVED; /* set state to work received */
+                    _lock(mpi_state); _record_steal_outcome(mpi_state, FALSE); _unlock(mpi_state);
+                    ++mpi_state->work_received;     /* counted for the counting work end detection */
 
                     int msg_sz;
                     MPI_Get_count(&recv_status, MPI_INT, &msg_sz);
                     int *msg = (int*)malloc(sizeof(int)*msg_sz);    /* allocate space for message buffer */
 
-                    MPI_Recv(msg, msg_sz, MPI_INT, recv_status.MPI_SOURCE, recv_status.MPI_TAG, MPI_COMM_WORLD, &recv_status);
+                    MPI_Recv(msg, msg_sz, MPI_INT, recv_status.MPI_SOURCE, recv_status.MPI_TAG, mpi_state->steal_comm, &recv_status);
                     if (__DEBUG_MPI__) printf("MPI: Process %d: received %d nodes (%d words) from %d in TAKE_WORK\n",mpi_state->my_rank, msg[0], msg_sz, recv_status.MPI_SOURCE);
+                    mpi_state->load_table[recv_status.MPI_SOURCE] = msg[msg_sz-1];  /* last word is what the victim has left */
 
                     int m = 1; /* preset m to 1, as msg[0] is the number of records the first record starts at msg[1] */
                     
                     /* deserialize messages and push to stack */
                     for(int i = 0; i < msg[0]; ++i) {
-                        PathNode *curr;                                                     /* current PathNode we are building */
-                        DYNALLOCPATHNODE(curr, "PathNode_MPI_Take_Work");                   /* Allocate space for PathNode */
-                        DYNALLOCPATH(curr->path, msg[m], "PathNode->Path_MPI_Take_Work")    /* Allocate space for path */
-                        ++m;    /* need to pull this out ofhte DYNALLOCPATH statement, as it would increment more than once */
-
-                        /* extract path from message */
-                        for (int j = 0; j < curr->path->sz; ++j) {
-                            curr->path->data[j] = msg[m++];
-                        }
-
-                        DYNALLOCPART(curr->pi, msg[m], "PathNode->pi_MPI_Take_Work")        /* Allocat space for pi */
-                        ++m;    /* need to pull this out ofhte DYNALLOCPART statement, as it would increment more than once */
-
-                        /* extract partition lab form message */
-                        for (int j = 0; j < curr->pi->sz; ++j) {
-                            curr->pi->lab[j] = msg[m++];
-                        }
-                        /* extract partition ptn form message */
-                        for (int j = 0; j < curr->pi->sz; ++j) {
-                            curr->pi->ptn[j] = msg[m++];
-                        }
-                        stack_push(stack, curr);    /* push current node to stack, stack now owns it, we don't free it here */
+                        PathNode *curr;                 /* current PathNode we are building */
+                        m += _unpack_node(msg + m, &curr);
+                        _push_donated_node(stack, status, curr);
                     }
 
                     /* free message buffer */
@@ -337,11 +1043,15 @@ void mpi_ask_for_work(MPIState *mpi_state, BadStack *stack, Status *status) {
                 } /* switch (recv_status.MPI_TAG) */
             } else {
                 mpi_poll_for_messages(mpi_state, stack, status);
+
+                /* with counting detection, our partner may have stopped already, and will never answer */
+                if (mpi_state->termination == TERMINATION_COUNTING) _termination_wave(mpi_state, FALSE);
                     
                 /* if we return form poll messages in a work end state, then we should return out of this funciton */
                 if (mpi_state->state == MPI_STATE_WORK_END) {
                     return;
                 }
+                _idle_wait(mpi_state, &delay_us);
             }
         }
 
@@ -351,10 +1061,7 @@ void mpi_ask_for_work(MPIState *mpi_state, BadStack *stack, Status *status) {
             return;
         }
 
-        /* otherwise, increase partner rank and try again */
-        mpi_state->partner_rank = (mpi_state->partner_rank + 1) % mpi_state->num_processes;
-        if (mpi_state->partner_rank == mpi_state->my_rank) mpi_state->partner_rank = (mpi_state->partner_rank + 1) % mpi_state->num_processes; 
-    
+        /* otherwise, move on to the next victim and try again */
     }
     /* if we get here, then we have tried asking each partner process for work, and been rejected or timedout */
     mpi_state->state = MPI_STATE_QUERY_WORK_END;    /* If process 0, set state to MPI_STATE_QUERY_WORK_END */
@@ -374,10 +1081,21 @@ void mpi_query_work_end(MPIState *mpi_state, BadStack *stack, Status *status) {
         exit(1);
     }
 
+    if (mpi_state->termination == TERMINATION_COUNTING) {
+        /* join (or check on) a wave, but don't wait for it, go back to asking for work in the meantime */
+        _termination_wave(mpi_state, TRUE);
+        if (mpi_state->state == MPI_STATE_WORK_END) return;
+
+        mpi_poll_for_messages(mpi_state, stack, status);
+        if (mpi_state->state == MPI_STATE_QUERY_WORK_END) mpi_state->state = MPI_STATE_ASKING_FOR_WORK;
+        return;
+    }
+
     MPI_Status recv_status;  /* variable for probe/receive status messages */
 
-    /* msg is a two word token, the first word is the initiating process rank, the second is the token state */
-    int msg[2];
+    /* msg is a MPI_TOKEN_SZ word token, the initiating process rank, the token state, the most loaded rank seen
+        on this lap and its stack size, and the sender's stack size */
+    int msg[MPI_TOKEN_SZ];
 
     int bcast; /* only used to broadcast a work commplete message to all processes */
 
@@ -395,15 +1113,27 @@ void mpi_query_work_end(MPIState *mpi_state, BadStack *stack, Status *status) {
         /* set up new token */    
         msg[0] = mpi_state->my_rank;    /* set initiating process to my rank */
         msg[1] = MPI_TOKEN_STATE_CLEAN; /* set token value to CLEAN */
+        msg[2] = mpi_state->my_rank;    /* nobody loaded seen yet */
+        msg[3] = 0;
+        msg[4] = 0;                     /* we are idle */
 
         /* send token */
         if (__DEBUG_MPI__) printf("MPI: Process %d: sending work stop token to %d\n",mpi_state->my_rank, send_to_rank);
-        MPI_Send(&msg, 2, MPI_INT, send_to_rank, MPI_MSG_WORK_STOP_TOKEN, MPI_COMM_WORLD);
+        MPI_Send(&msg, MPI_TOKEN_SZ, MPI_INT, send_to_rank, MPI_MSG_WORK_STOP_TOKEN, MPI_COMM_WORLD);
     
         /* need this loop to keep checking for messages until we get our probe back */
         while (1) {
-            /* wait for a message to come in */
-            MPI_Probe(MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &recv_status);
+            /* wait for a message to come in, sleeping between probes if we back off rather than spin */
+            if (mpi_state->idle_backoff_us > 0) {
+                int flag, delay_us = 0;
+                MPI_Iprobe(MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &flag, &recv_status);
+                while (!flag) {
+                    _idle_wait(mpi_state, &delay_us);
+                    MPI_Iprobe(MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &flag, &recv_status);
+                }
+            } else {
+                MPI_Probe(MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &recv_status);
+            }
 
             /* if we get any sort of message that isn't an MPI_MSG_WORK_STOP_TOKEN, 
                 then let the standard polling function handle it. We still need to track any work status messages, 
@@ -421,16 +1151,18 @@ void mpi_query_work_end(MPIState *mpi_state, BadStack *stack, Status *status) {
                     exit(1);
                 }
                 /* once we have a message waiting that matches our token, receive it and exit the inner loop */
-                MPI_Recv(&msg, 2, MPI_INT, recv_from_rank, MPI_MSG_WORK_STOP_TOKEN, MPI_COMM_WORLD, &recv_status);
+                MPI_Recv(&msg, MPI_TOKEN_SZ, MPI_INT, recv_from_rank, MPI_MSG_WORK_STOP_TOKEN, MPI_COMM_WORLD, &recv_status);
+                mpi_state->load_table[recv_from_rank] = msg[4];
                 
                 /* at this point, weve received a work stop token, if it's ours, we can stop, if not, we need to pass it along */
                 if (msg[0] == mpi_state->my_rank) {
                     /* this token is the one we sent, we can break out of the recieve loop */
                     break;  /* while (1) */
                 } else {
-                    /* in here, this is not our token, pass it along unchanged */
+                    /* in here, this is not our token, pass it along unchanged, apart from our (empty) load */
                     if (__DEBUG_MPI__) printf("MPI: Process %d: relaying %d's work stop token to %d\n",mpi_state->my_rank, msg[0], send_to_rank);
-                    MPI_Send(&msg, 2, MPI_INT, send_to_rank, MPI_MSG_WORK_STOP_TOKEN, MPI_COMM_WORLD);
+                    msg[4] = 0;
+                    MPI_Send(&msg, MPI_TOKEN_SZ, MPI_INT, send_to_rank, MPI_MSG_WORK_STOP_TOKEN, MPI_COMM_WORLD);
                 } 
             }
         }
@@ -465,6 +1197,7 @@ void mpi_query_work_end(MPIState *mpi_state, BadStack *stack, Status *status) {
 
         case MPI_TOKEN_STATE_NOT_IDLE_CAN_SHARE:
             /* here, a process has reported it has work, and has enough work to share, we need to go back to the ask for work state */
+            mpi_state->load_table[msg[2]] = msg[3];    /* the token tells us who was most loaded, they get asked first */
             mpi_state->state = MPI_STATE_ASKING_FOR_WORK;
             break;
 
@@ -474,16 +1207,19 @@ void mpi_query_work_end(MPIState *mpi_state, BadStack *stack, Status *status) {
     }
 }
 
-void mpi_send_new_best_cl(MPIState *mpi_state, Status *status) {
+void mpi_send_new_best_cl(MPIState *mpi_state, BadStack *stack, Status *status) {
 
-    int msg_sz = 2;  /* start with 2 for the path and partition sizes */
+    int msg_sz = 4 + MPI_KEY_SZ;  /* start with 1 for the root, the key, 2 for the path and partition sizes, and 1 for our stack size at the end */
 
     msg_sz += status->best_invar_path->sz; /* add the path size */
     msg_sz += (status->cl_pi->sz) * 2;     /* add 2 x the partition size (once for each array )*/
 
-    int *msg = (int*)malloc(sizeof(int)*msg_sz);   /* allocate message buffer */
+    BcastSlot *slot = _bcast_acquire(mpi_state, msg_sz);   /* message buffer comes from the broadcast pool */
+    int *msg = slot->buf;
 
     int m = 0;  /* variable to be used as the message index */
+    msg[m++] = mpi_state->my_rank;  /* we are the root of this broadcast */
+    m += _pack_key(msg + m, &status->best_key);    /* receivers can usually decide from the key alone */
     
     /** Add the path to the message */
     msg[m++] = status->best_invar_path->sz;                      /* set first word of current node to the size of the path */
@@ -504,47 +1240,307 @@ void mpi_send_new_best_cl(MPIState *mpi_state, Status *status) {
         msg[m++] = status->cl_pi->ptn[j];
     }
     /** */
+    msg[m++] = stack_size(stack);   /* piggyback our load */
 
-    MPI_Request request;
     if (__DEBUG_MPI__) {printf("MPI: Process: %d Broadcast New Best CL in %d words  ", mpi_state->my_rank, msg_sz); visualize_path(DEBUGFILE, status->best_invar_path); printf("  "); visualize_partition(DEBUGFILE, status->cl_pi); printf("  "); visualize_partition(DEBUGFILE, status->cl); ENDL();}
     
-    /* we don't have a broadcast function that uses tags, so I'm brute forcing it. */
-    for (int i = 0; i < mpi_state->num_processes; ++i) {
-        if (i != mpi_state->my_rank) {
-            MPI_Isend(msg, msg_sz, MPI_INT, i, MPI_MSG_NEW_CL, MPI_COMM_WORLD, &request);
-        }
-    }
+    _bcast_post(mpi_state, slot, msg_sz, MPI_MSG_NEW_CL);
 }
 
-void mpi_send_new_automorphism(MPIState *mpi_state, Status *status, partition *aut) {
+/**
+ * Automorphisms tend to be found in bursts, so rather than broadcasting each one, they wait
+ * here and go out together, once auto_batch_max are waiting, or the oldest has waited
+ * auto_batch_delay (checked when we poll), or we run out of work.
+ */
+void mpi_queue_new_automorphism(MPIState *mpi_state, BadStack *stack, partition *aut) {
+    if (mpi_state->auto_batch_sz == 0) mpi_state->auto_batch_started = MPI_Wtime();
+    mpi_state->auto_batch[mpi_state->auto_batch_sz++] = aut;
+    if (mpi_state->auto_batch_sz == mpi_state->auto_batch_max) mpi_flush_automorphisms(mpi_state, stack);
+}
 
-    int msg_sz = 1;  /* start with 2 for the partition size variable */
+void mpi_flush_automorphisms(MPIState *mpi_state, BadStack *stack) {
+    if (mpi_state->auto_batch_sz == 0) return;
 
-    msg_sz += (aut->sz) * 2;     /* add 2 x the partition size (once for each array )*/
+    int msg_sz = 3;  /* start with 1 for the root, 1 for the count, and 1 for our stack size at the end */
+
+    for (int i = 0; i < mpi_state->auto_batch_sz; ++i) {
+        msg_sz += 1 + (mpi_state->auto_batch[i]->sz) * 2;     /* add the size variable, and 2 x the partition size (once for each array )*/
+    }
 
-    int *msg = (int*)malloc(sizeof(int)*msg_sz);   /* allocate message buffer */
+    BcastSlot *slot = _bcast_acquire(mpi_state, msg_sz);   /* message buffer comes from the broadcast pool */
+    int *msg = slot->buf;
 
     int m = 0;  /* variable to be used as the message index */
+    msg[m++] = mpi_state->my_rank;  /* we are the root of this broadcast */
+    msg[m++] = mpi_state->auto_batch_sz;
     
-    /** Add the parition (aut) to the message */
-    msg[m++] = aut->sz;                        /* set the next word to the size of the partion pi */
-    /* loop through the partition and put the lab words into the message */
-    for (int j = 0; j < aut->sz; ++j) {
-        msg[m++] = aut->lab[j];
-    }
-    /* loop through the partition and put the ptn words into the message */
-    for (int j = 0; j < aut->sz; ++j) {
-        msg[m++] = aut->ptn[j];
+    for (int i = 0; i < mpi_state->auto_batch_sz; ++i) {
+        partition *aut = mpi_state->auto_batch[i];
+
+        /** Add the parition (aut) to the message */
+        msg[m++] = aut->sz;                        /* set the next word to the size of the partion pi */
+        /* loop through the partition and put the lab words into the message */
+        for (int j = 0; j < aut->sz; ++j) {
+            msg[m++] = aut->lab[j];
+        }
+        /* loop through the partition and put the ptn words into the message */
+        for (int j = 0; j < aut->sz; ++j) {
+            msg[m++] = aut->ptn[j];
+        }
+        /** */
     }
-    /** */
+    msg[m++] = stack_size(stack);   /* piggyback our load */
 
-    MPI_Request request;
-    if (__DEBUG_MPI__) {printf("MPI: Process %d: Broadcast New Automorphism in %d words  ", mpi_state->my_rank, msg_sz); visualize_partition(DEBUGFILE, aut); ENDL();}
+    if (__DEBUG_MPI__) printf("MPI: Process %d: Broadcast %d New Automorphisms in %d words\n", mpi_state->my_rank, mpi_state->auto_batch_sz, msg_sz);
     
-    /* we don't have a broadcast function that uses tags, so I'm brute forcing it. */
-    for (int i = 0; i < mpi_state->num_processes; ++i) {
-        if (i != mpi_state->my_rank) {
-            MPI_Isend(msg, msg_sz, MPI_INT, i, MPI_MSG_NEW_AUTO, MPI_COMM_WORLD, &request);
+    mpi_state->auto_batch_sz = 0;
+    _bcast_post(mpi_state, slot, msg_sz, MPI_MSG_NEW_AUTO);
+}
+
+/**
+ * Called once work has ended, before the results are collected.  Broadcasts can still be
+ * working their way down their trees, and a process that stopped listening would cut off its
+ * whole subtree, so everyone keeps receiving and forwarding until the broadcast counts balance.
+ *
+ * Same four counter idea as the counting work end detection, the sums of broadcast sends and
+ * receives have to balance, and match, on two waves in a row.  Nobody starts new broadcasts
+ * now, so this always settles.
+ */
+void mpi_finish_broadcasts(MPIState *mpi_state, BadStack *stack, Status *status) {
+    long counts[2], result[2], last[2] = {-1, -1};
+    MPI_Request request;
+    int done;
+
+    while (1) {
+        counts[0] = mpi_state->bcast_sent;
+        counts[1] = mpi_state->bcast_received;
+        MPI_Iallreduce(counts, result, 2, MPI_LONG, MPI_SUM, mpi_state->term_comm, &request);
+        do {
+            mpi_poll_for_messages(mpi_state, stack, status);
+            _bcast_progress(mpi_state);
+            MPI_Test(&request, &done, MPI_STATUS_IGNORE);
+        } while (!done);
+
+        if (result[0] == result[1] && last[0] == result[0] && last[1] == result[1]) break;
+        last[0] = result[0];
+        last[1] = result[1];
+    }
+    if (__DEBUG_MPI__) printf("MPI: Process %d: broadcasts settled, %ld sent\n", mpi_state->my_rank, result[0]);
+}
+
+/**
+ * Collective, every process calls this once, right after rank 0 has expanded the top of the tree
+ * (_expand_frontier).  Rank 0 deals its stack out round robin, so everyone gets a mix of depths,
+ * keeps its own share, and sends the rest in one MPI_Scatterv.  The message for each process is
+ * the node count then the nodes, same layout as MPI_MSG_TAKE_WORK without the stack size.
+ */
+void mpi_scatter_frontier(MPIState *mpi_state, BadStack *stack, Status *status) {
+    int p = mpi_state->num_processes;
+    int *counts = NULL, *displs = NULL, *sendbuf = NULL;
+    int recv_sz;
+
+    if (mpi_state->my_rank == 0) {
+        int total = stack_size(stack);
+        PathNode **nodes = (PathNode**)malloc(sizeof(PathNode*)*(total+1));
+        counts = (int*)calloc(p, sizeof(int));
+        displs = (int*)malloc(sizeof(int)*p);
+        if (nodes == NULL || counts == NULL || displs == NULL) alloc_error("mpi_scatter_frontier");
+        for (int i = total - 1; i >= 0; --i) nodes[i] = stack_pop(stack);
+
+        /* node i goes to rank i % p */
+        for (int r = 1; r < p; ++r) counts[r] = 1;     /* node count */
+        for (int i = 0; i < total; ++i) {
+            if (i % p != 0) counts[i % p] += _node_words(nodes[i]);
         }
+        int buff_sz = 0;
+        for (int r = 0; r < p; ++r) {
+            displs[r] = buff_sz;
+            buff_sz += counts[r];
+        }
+        sendbuf = (int*)malloc(sizeof(int)*(buff_sz+1));
+        if (sendbuf == NULL) alloc_error("mpi_scatter_frontier");
+
+        for (int r = 1; r < p; ++r) {
+            int m = displs[r];
+            sendbuf[m++] = total > r ? (total - r - 1) / p + 1 : 0;
+            for (int i = r; i < total; i += p) m += _pack_node(sendbuf + m, nodes[i]);
+        }
+
+        /* keep our share, in the same order, the rest has been copied into sendbuf */
+        for (int i = 0; i < total; ++i) {
+            if (i % p == 0) {
+                stack_push(stack, nodes[i]);
+            } else {
+                FREEPATHNODE(nodes[i]);
+            }
+        }
+        free(nodes);
+        if (__DEBUG_MPI__) printf("MPI: Process %d: scattering %d frontier nodes in %d words\n", mpi_state->my_rank, total, buff_sz);
+    }
+
+    MPI_Scatter(counts, 1, MPI_INT, &recv_sz, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    int *msg = (int*)malloc(sizeof(int)*(recv_sz+1));
+    if (msg == NULL) alloc_error("mpi_scatter_frontier");
+    MPI_Scatterv(sendbuf, counts, displs, MPI_INT, msg, recv_sz, MPI_INT, 0, MPI_COMM_WORLD);
+
+    if (mpi_state->my_rank != 0) {
+        int m = 1;
+        for (int i = 0; i < msg[0]; ++i) {
+            PathNode *curr;
+            m += _unpack_node(msg + m, &curr);
+            _push_donated_node(stack, status, curr);
+        }
+    }
+
+    free(msg);
+    if (sendbuf) free(sendbuf);
+    if (counts) free(counts);
+    if (displs) free(displs);
+}
+
+/**
+ * Collective, with --rma-state, called once work has ended.  The labels never went out during the
+ * run, so every process whose best key ties the window's on the leading words sends its label to
+ * rank 0, which compares them in full.  Everyone sends rank 0 their automorphisms too, so it can
+ * report them.  The message is [has label, (key, path and partition, same as a node)?, count,
+ * (size, lab, ptn) for each automorphism].
+ */
+void mpi_rma_collect(MPIState *mpi_state, Status *status) {
+    if (!mpi_state->rma_state) return;
+
+    InvarKey best;
+    int owner = _rma_read_key(mpi_state, &best);    /* nobody writes it any more */
+    boolean candidate = owner >= 0 && status->best_invar != NULL && compare_invariant_keys(&status->best_key, &best) == 0;
+    AutomorphismGroup *autogrp = status->autogrp;
+
+    int msg_sz = 0, *msg = NULL;
+    PathNode best_node;
+    if (mpi_state->my_rank != 0) {
+        best_node.path = status->best_invar_path;
+        best_node.pi = status->cl_pi;
+        msg_sz = 2 + (candidate ? MPI_KEY_SZ + _node_words(&best_node) : 0);
+        for (int i = 0; i < autogrp->sz; ++i) msg_sz += 1 + autogrp->automorphisms[i]->sz * 2;
+
+        msg = (int*)malloc(sizeof(int)*msg_sz);
+        if (msg == NULL) alloc_error("mpi_rma_collect");
+        int m = 0;
+        msg[m++] = candidate;
+        if (candidate) {
+            m += _pack_key(msg + m, &status->best_key);
+            m += _pack_node(msg + m, &best_node);
+        }
+        msg[m++] = autogrp->sz;
+        for (int i = 0; i < autogrp->sz; ++i) {
+            partition *aut = autogrp->automorphisms[i];
+            msg[m++] = aut->sz;
+            for (int j = 0; j < aut->sz; ++j) msg[m++] = aut->lab[j];
+            for (int j = 0; j < aut->sz; ++j) msg[m++] = aut->ptn[j];
+        }
+    }
+
+    int *counts = NULL, *displs = NULL, *recvbuf = NULL, total = 0;
+    if (mpi_state->my_rank == 0) {
+        counts = (int*)malloc(sizeof(int)*mpi_state->num_processes);
+        displs = (int*)malloc(sizeof(int)*mpi_state->num_processes);
+        if (counts == NULL || displs == NULL) alloc_error("mpi_rma_collect");
+    }
+    MPI_Gather(&msg_sz, 1, MPI_INT, counts, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    if (mpi_state->my_rank == 0) {
+        for (int r = 0; r < mpi_state->num_processes; ++r) {
+            displs[r] = total;
+            total += counts[r];
+        }
+        recvbuf = (int*)malloc(sizeof(int)*(total+1));
+        if (recvbuf == NULL) alloc_error("mpi_rma_collect");
     }
-}
\ No newline at end of file
+    MPI_Gatherv(msg, msg_sz, MPI_INT, recvbuf, counts, displs, MPI_INT, 0, MPI_COMM_WORLD);
+
+    if (mpi_state->my_rank == 0) {
+        for (int r = 1; r < mpi_state->num_processes; ++r) {
+            int m = displs[r];
+            if (recvbuf[m++]) {
+                InvarKey key;
+                PathNode *node;
+                m += _unpack_key(recvbuf + m, &key);
+                m += _unpack_node(recvbuf + m, &node);
+                mpi_handle_new_best_cononical_label(status, &key, node->path, node->pi);
+                FREEPATHNODE(node);
+            }
+            int num_auts = recvbuf[m++];
+            for (int i = 0; i < num_auts; ++i) {
+                partition *aut;
+                DYNALLOCPART(aut, recvbuf[m], "mpi_rma_collect");
+                ++m;
+                for (int j = 0; j < aut->sz; ++j) aut->lab[j] = recvbuf[m++];
+                for (int j = 0; j < aut->sz; ++j) aut->ptn[j] = recvbuf[m++];
+                /* just for the report, the window already has their orbits */
+                if (!is_automorphism_in_group(autogrp, aut)) {
+                    automorphisms_append(autogrp, aut);
+                } else {
+                    FREEPART(aut);
+                }
+            }
+        }
+        if (__DEBUG_MPI__) printf("MPI: Process %d: collected %d words of labels and automorphisms\n", mpi_state->my_rank, total);
+    }
+
+    if (msg) free(msg);
+    if (recvbuf) free(recvbuf);
+    if (counts) free(counts);
+    if (displs) free(displs);
+}
+
+/**
+ * Collective, called from main before run.  Only rank 0 reads the graph file, it passes its g
+ * in (everyone else passes NULL) and the graph goes out from there, so a shared filesystem sees
+ * one reader instead of P.  Each host keeps a single copy, in an MPI_Win_allocate_shared window
+ * owned by its first process, which gets it from rank 0 with one MPI_Bcast among the hosts.
+ *
+ * Returns the shared copy, which is read only from here on.  Rank 0 still owns its g, which it
+ * can free (or unmap) straight away.  Free the window (*win) once nothing uses the graph.
+ */
+graph *mpi_share_graph(graph *g, int *m, int *n, boolean *digraph, MPI_Win *win) {
+    int my_rank, node_rank, dims[3];
+    MPI_Comm node_comm, leader_comm;
+
+    MPI_Comm_rank(MPI_COMM_WORLD, &my_rank);
+    if (my_rank == 0) {
+        dims[0] = *m;
+        dims[1] = *n;
+        dims[2] = *digraph;
+    }
+    MPI_Bcast(dims, 3, MPI_INT, 0, MPI_COMM_WORLD);
+    *m = dims[0];
+    *n = dims[1];
+    *digraph = dims[2];
+    size_t graph_bytes = sizeof(setword) * (size_t)*m * (size_t)*n;
+
+    /* the first process on each host holds the copy, world rank 0 is always first on its host */
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &node_comm);
+    MPI_Comm_rank(node_comm, &node_rank);
+    MPI_Comm_split(MPI_COMM_WORLD, node_rank == 0 ? 0 : MPI_UNDEFINED, my_rank, &leader_comm);
+
+    graph *shared;
+    MPI_Aint win_sz = node_rank == 0 ? (MPI_Aint)graph_bytes : 0;
+    MPI_Win_allocate_shared(win_sz, sizeof(setword), MPI_INFO_NULL, node_comm, &shared, win);
+    if (node_rank != 0) {
+        MPI_Aint sz;
+        int disp_unit;
+        MPI_Win_shared_query(*win, 0, &sz, &disp_unit, &shared);
+    }
+
+    MPI_Win_fence(0, *win);
+    if (node_rank == 0) {
+        if (my_rank == 0) memcpy(shared, g, graph_bytes);
+        for (size_t done = 0; done < graph_bytes; done += MPI_CONST_BCAST_PIECE_BYTES) {
+            size_t piece = graph_bytes - done < MPI_CONST_BCAST_PIECE_BYTES ? graph_bytes - done : MPI_CONST_BCAST_PIECE_BYTES;
+            MPI_Bcast((char*)shared + done, (int)piece, MPI_BYTE, 0, leader_comm);
+        }
+        MPI_Comm_free(&leader_comm);
+    }
+    MPI_Win_fence(0, *win);     /* the copy is complete on every host */
+
+    MPI_Comm_free(&node_comm);
+    if (__DEBUG_MPI__) printf("MPI: Process %d: sharing a %zu byte graph, host rank %d\n", my_rank, graph_bytes, node_rank);
+    return shared;
+}
@@ -20,13 +20,24 @@
 #include "pcanon.h"
 #include "proto.h"
 #include "mpi.h"
+#include <pthread.h>
 
 #define __DEBUG_MPI__ FALSE
 
 
-#define MPI_CONST_SEND_WORK_CUTOFF_DEPTH 3
-#define MPI_CONST_MAX_WORK_SIZE_TO_SEND 10
 #define MPI_CONST_IDLE_WAIT_TIME_IN_SECONDS 1.0
+#define MPI_CONST_STEAL_RATE_DECAY 0.125        /* weight of the newest steal outcome in the failure rate moving average */
+#define MPI_CONST_PROGRESS_POLL_NS 20000        /* progress thread sleep between probes for steal requests */
+#define MPI_CONST_BCAST_PIECE_BYTES (1 << 30)  /* mpi_share_graph broadcasts in pieces, MPI counts are ints */
+
+#define MPI_BCAST_MAX_CHILDREN 32   /* a binomial tree node has at most log2(P) children */
+
+/** --rma-state window layout on rank 0, in longs */
+#define MPI_RMA_LOCK 0                                          /* spin lock for the owner and key, 0 free, else holder's rank + 1 */
+#define MPI_RMA_OWNER 1                                         /* rank that published the best key, -1 if none yet */
+#define MPI_RMA_KEY 2                                           /* best key, INVAR_KEY_WORDS leading words then the hash */
+#define MPI_RMA_GENERATION (MPI_RMA_KEY + INVAR_KEY_WORDS + 1)  /* bumped by every union, the forest is only read when it moves */
+#define MPI_RMA_PARENT (MPI_RMA_GENERATION + 1)                 /* orbit forest, n words, parent[v] <= v */
 
 #define MPI_STATE_WORK_END -1
 #define MPI_STATE_WORKING 0
@@ -36,12 +47,75 @@
 #define MPI_STATE_REJECTED 101
 #define MPI_STATE_TIMEOUT 102
 
+/**
+ * One in flight broadcast message, the buffer is reused once every send out of it completes.
+ */
+typedef struct {
+    int *buf;                                   /* message buffer, grown as needed, never shrunk */
+    int capacity;                               /* allocated words in buf */
+    int num_requests;                           /* sends still outstanding, 0 means the slot is free */
+    MPI_Request requests[MPI_BCAST_MAX_CHILDREN];
+} BcastSlot;
+
 typedef struct {
     int my_rank;                    /* my MPI rank */
     int num_processes;              /* number of processes running */
     int state;                      /* current state machine state */
     int partner_rank;               /* partner_rank, if needed, else leave -1 */
     int workstop_detection_state;   /* used for Dijkstra's modified detection algorithm, use MPI_TOKEN_STATE_CLEAN/DIRTY */
+
+    int send_work_cutoff_depth;     /* don't share work unless the stack is deeper than this */
+    int max_work_size_to_send;      /* max nodes in one donation (scaled up by the failure rate when adaptive) */
+    int nodes_between_comm_polls;   /* How many nodes should we process between polling for new messages? */
+    boolean adaptive_donation;      /* size donations from stack depth and steal_failure_rate */
+    double steal_failure_rate;      /* moving average of steal outcomes seen here, 0 all succeed, 1 all rejected */
+
+    MPI_Comm node_comm;             /* processes sharing this host, from MPI_Comm_split_type(MPI_COMM_TYPE_SHARED) */
+    int *victims;                   /* ranks to ask for work, same host ranks first, then remote ones */
+    int num_victims;                /* number of ranks in victims, num_processes - 1 */
+    int num_local_victims;          /* the first num_local_victims of victims are on this host */
+    unsigned long rng_state;        /* random state for shuffling victims, seeded from --seed and our rank */
+
+    int *load_table;                /* last stack size each process advertised, MPI_LOAD_UNKNOWN if we haven't heard */
+
+    int termination;                /* TERMINATION_RING or TERMINATION_COUNTING */
+    MPI_Comm term_comm;             /* duplicate of MPI_COMM_WORLD for the counting waves, so they never match our other traffic */
+    long work_sent;                 /* number of MPI_MSG_TAKE_WORK messages we sent */
+    long work_received;             /* number of MPI_MSG_TAKE_WORK messages we received */
+    boolean wave_active;            /* we have contributed to a counting wave that hasn't completed yet */
+    MPI_Request wave_request;       /* request for the active wave's MPI_Iallreduce */
+    long wave_counts[2];            /* our work_sent, work_received when we joined the active wave */
+    long wave_result[2];            /* global sum of wave_counts, valid once the wave completes */
+    long last_wave_result[2];       /* wave_result of the previous completed wave, -1 if none yet */
+
+    BcastSlot *bcast_slots;         /* pool of buffers for NEW_CL / NEW_AUTO sends, bounds memory held by in flight broadcasts */
+    int num_bcast_slots;            /* --bcast-slots=N */
+    int bcast_next;                 /* oldest slot, the one we wait on when the pool is full */
+    long bcast_sent;                /* broadcast sends we posted, including forwards */
+    long bcast_received;            /* broadcast messages we received */
+
+    partition **auto_batch;         /* automorphisms found here and not sent yet, owned by status->autogrp */
+    int auto_batch_sz;              /* number waiting in auto_batch */
+    int auto_batch_max;             /* --auto-batch=N, send as soon as this many are waiting */
+    double auto_batch_delay;        /* --auto-batch-delay in seconds, send once the oldest has waited this long */
+    double auto_batch_started;      /* MPI_Wtime when the oldest waiting automorphism was found */
+
+    boolean progress_thread;        /* --progress-thread, steal requests are answered by a second thread */
+    boolean progress_running;       /* the progress thread has been started and not yet stopped */
+    int progress_stop;              /* set (atomically) to tell the progress thread to finish */
+    pthread_t progress_tid;
+    BadStack *progress_stack;       /* the stack the progress thread donates from */
+    pthread_mutex_t lock;           /* stack and shared steal state, see _lock in mpi_routines.c */
+    MPI_Comm steal_comm;            /* NEED_WORK / TAKE_WORK / REJECT traffic, a duplicate with the progress thread, else MPI_COMM_WORLD */
+    int idle_backoff_us;            /* --idle-backoff=US, longest sleep between probes when idle, 0 spins */
+
+    boolean rma_state;              /* --rma-state, orbits and best key live in rma_win instead of being broadcast */
+    MPI_Win rma_win;                /* window on rank 0, see MPI_RMA_LOCK for the layout */
+    long *rma_base;                 /* our part of the window, only rank 0's has anything in it */
+    long *rma_parents;              /* local copy of the window's orbit forest */
+    long rma_generation;            /* the window's generation when we last read the forest for theta */
+    int *rma_scratch;               /* n words, for rebuilding theta from the forest */
+    int rma_n;                      /* number of vertices */
 } MPIState;
 
 
@@ -54,19 +128,35 @@ typedef struct {
 #define MPI_MSG_WORK_STOP_TOKEN 5000
 #define MPI_MSG_BCAST_WORK_STOP 6000
 
+#define MPI_KEY_SZ (2 * (INVAR_KEY_WORDS + 1))  /* an InvarKey in MPI_INT words, 64 bit words go as two halves */
+
+#define MPI_TOKEN_SZ 5  /* initiator rank, token state, most loaded rank seen, its stack size, sender's stack size */
+
+#define MPI_LOAD_UNKNOWN -1
+
 #define MPI_TOKEN_STATE_CLEAN 0
 #define MPI_TOKEN_STATE_DIRTY 1
 #define MPI_TOKEN_STATE_NOT_IDLE 2
 #define MPI_TOKEN_STATE_NOT_IDLE_CAN_SHARE 3
 
-#define MPI_NODES_BETWEEN_COMM_POLLS 10    /* How many nodes should we process between polling for new messages? */
-
 
+void mpi_state_initialize(MPIState *mpi_state, Options *opts);
+void mpi_state_free(MPIState *mpi_state);
 void mpi_poll_for_messages (MPIState *mpi_state, BadStack *stack, Status *status);
 void mpi_ask_for_work(MPIState *mpi_state, BadStack *stack, Status *status);
 void mpi_query_work_end(MPIState *mpi_state, BadStack *stack, Status *status);
 void mpi_idle(MPIState *mpi_state, BadStack *stack, Status *status);
-void mpi_send_new_best_cl(MPIState *mpi_state, Status *status);
-void mpi_send_new_automorphism(MPIState *mpi_state, Status *status, partition *aut);
+void mpi_send_new_best_cl(MPIState *mpi_state, BadStack *stack, Status *status);
+void mpi_queue_new_automorphism(MPIState *mpi_state, BadStack *stack, partition *aut);
+void mpi_flush_automorphisms(MPIState *mpi_state, BadStack *stack);
+void mpi_finish_broadcasts(MPIState *mpi_state, BadStack *stack, Status *status);
+void mpi_scatter_frontier(MPIState *mpi_state, BadStack *stack, Status *status);
+void mpi_start_progress_thread(MPIState *mpi_state, BadStack *stack);
+void mpi_stop_progress_thread(MPIState *mpi_state);
+void mpi_rma_initialize(MPIState *mpi_state, int n);
+void mpi_rma_publish_orbits(MPIState *mpi_state, partition *theta);
+void mpi_rma_publish_key(MPIState *mpi_state, InvarKey *key);
+void mpi_rma_collect(MPIState *mpi_state, Status *status);
+graph *mpi_share_graph(graph *g, int *m, int *n, boolean *digraph, MPI_Win *win);
 
 #endif /* _MPI_ROUTINES_H_ */
\ No newline at end of file
@@ -0,0 +1,166 @@
+/**
+ * Copyright 2025 Jim Haslett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "options.h"
+
+
+/**
+ * If arg is "--name=value", parse value as a non negative integer into *value and return TRUE.
+ * Bad values print a message and exit, same as any other bad command line.
+ */
+static boolean _int_option(char *arg, const char *name, int *value) {
+    size_t len = strlen(name);
+    if (strncmp(arg, name, len) != 0 || arg[len] != '=') return FALSE;
+
+    char *end;
+    long v = strtol(arg + len + 1, &end, 10);
+    if (*end != '\0' || end == arg + len + 1 || v < 0) {
+        printf("Invalid value for %s: %s\n", name, arg + len + 1);
+        exit(1);
+    }
+    *value = (int)v;
+    return TRUE;
+}
+
+
+void options_usage(FILE *f, char *progname) {
+    fprintf(f, "Usage: %s [options] graphfile\n", progname);
+    fprintf(f, "  --input-format=FMT     nauty (graph6, sparse6, digraph6), edges (u v lines), dimacs or binary (default auto, from the file name)\n");
+    fprintf(f, "  --to-binary=FILE       write the graph to FILE as a binary graph (.pcg) with its degrees, and don't search it\n");
+    fprintf(f, "  --binary-csr           --to-binary also writes CSR adjacency lists\n");
+    fprintf(f, "  --cutoff-depth=N       don't share work unless the stack is deeper than N (default %d)\n", DEFAULT_SEND_WORK_CUTOFF_DEPTH);
+    fprintf(f, "  --max-donation=N       max nodes to send in one work donation (default %d)\n", DEFAULT_MAX_WORK_SIZE_TO_SEND);
+    fprintf(f, "  --poll-interval=N      nodes processed between message polls (default %d)\n", DEFAULT_NODES_BETWEEN_COMM_POLLS);
+    fprintf(f, "  --adaptive-donation    size donations from stack depth and steal success rate\n");
+    fprintf(f, "  --seed=N               seed for picking work stealing victims, repeatable runs (default clock)\n");
+    fprintf(f, "  --termination=MODE     work end detection, ring (token ring, default) or counting (non blocking waves)\n");
+    fprintf(f, "  --bcast-slots=N        new label / automorphism broadcasts in flight before we wait on the oldest (default %d)\n", DEFAULT_BCAST_SLOTS);
+    fprintf(f, "  --auto-batch=N         send new automorphisms N at a time (default %d)\n", DEFAULT_AUTO_BATCH);
+    fprintf(f, "  --auto-batch-delay=MS  or once the oldest has waited MS milliseconds (default %d)\n", DEFAULT_AUTO_BATCH_DELAY_MS);
+    fprintf(f, "  --initial-frontier=K   start by handing every process K nodes from the top of the tree (default off)\n");
+    fprintf(f, "  --progress-thread      answer work requests from a second thread, even in the middle of a refinement\n");
+    fprintf(f, "  --idle-backoff=US      idle processes sleep between probes, backing off up to US microseconds (default 0, spin)\n");
+    fprintf(f, "  --rma-state            keep orbits and the best label key in a one sided window instead of broadcasting them\n");
+    fprintf(f, "  --batch                canonicalize every graph in the file, writing the canonical graph of each\n");
+    fprintf(f, "  --output=FILE          write the canonical graph(s) to FILE, --batch defaults to stdout, the mpi build writes FILE.<rank> per process\n");
+    fprintf(f, "  --output-format=FMT    canonical graphs as graph6 (default), sparse6 or binary (header and adjacency matrix)\n");
+    fprintf(f, "  --dedup                --batch writes only the first graph of each isomorphism class, like shortg\n");
+    fprintf(f, "  --counts=FILE          --dedup writes a line per class to FILE, its first graph's position and its size\n");
+    fprintf(f, "  --dedup-memory=MB      --dedup out of core, sorted runs of MB megabytes on disk merged at the end, classes in hash order\n");
+    fprintf(f, "  --tmp-dir=DIR          where --dedup-memory puts its runs (default $TMPDIR or /tmp)\n");
+    fprintf(f, "  --compress-runs        delta and varint code the --dedup-memory runs, about half the size\n");
+    fprintf(f, "  --cache=FILE           look graphs up in a canonical form cache shared between runs, add the ones that aren't there\n");
+    fprintf(f, "  --serve=PATH           serial build, no graph file: answer graph6 lines on a UNIX socket at PATH, or on stdin and stdout for -\n");
+    fprintf(f, "  --threads=N            --batch canonicalizes N graphs at a time, output stays in input order, --serve answers N connections at a time (default 1)\n");
+    fprintf(f, "  --chunk-bytes=N        mpi --batch, processes take the file N bytes at a time (default %d)\n", DEFAULT_CHUNK_BYTES);
+    fprintf(f, "  --merge                mpi --batch, join the per process outputs into FILE in input order\n");
+}
+
+
+void parse_options(Options *opts, int argc, char **argv) {
+    int seed;
+
+    opts->infilename = NULL;
+    opts->input_format = INPUT_AUTO;
+    opts->binaryfilename = NULL;
+    opts->binary_csr = FALSE;
+    opts->send_work_cutoff_depth = DEFAULT_SEND_WORK_CUTOFF_DEPTH;
+    opts->max_work_size_to_send = DEFAULT_MAX_WORK_SIZE_TO_SEND;
+    opts->nodes_between_comm_polls = DEFAULT_NODES_BETWEEN_COMM_POLLS;
+    opts->adaptive_donation = FALSE;
+    opts->seed = 0;
+    opts->termination = TERMINATION_RING;
+    opts->bcast_slots = DEFAULT_BCAST_SLOTS;
+    opts->auto_batch = DEFAULT_AUTO_BATCH;
+    opts->auto_batch_delay_ms = DEFAULT_AUTO_BATCH_DELAY_MS;
+    opts->initial_frontier = 0;
+    opts->progress_thread = FALSE;
+    opts->idle_backoff_us = 0;
+    opts->rma_state = FALSE;
+    opts->batch = FALSE;
+    opts->outfilename = NULL;
+    opts->output_format = OUTPUT_GRAPH6;
+    opts->dedup = FALSE;
+    opts->countsfilename = NULL;
+    opts->dedup_memory_mb = 0;
+    opts->tmpdir = NULL;
+    opts->compress_runs = FALSE;
+    opts->cachefilename = NULL;
+    opts->serve_path = NULL;
+    opts->threads = 1;
+    opts->chunk_bytes = DEFAULT_CHUNK_BYTES;
+    opts->merge = FALSE;
+
+    for (int i = 1; i < argc; ++i) {
+        char *arg = argv[i];
+        if (arg[0] != '-' || arg[1] != '-') {
+            if (opts->infilename == NULL) {
+                opts->infilename = arg;
+                continue;
+            }
+            printf("Only one graph file can be passed, got %s and %s\n", opts->infilename, arg);
+            exit(1);
+        }
+
+        if (strcmp(arg, "--input-format=auto") == 0) {opts->input_format = INPUT_AUTO; continue;}
+        if (strcmp(arg, "--input-format=nauty") == 0) {opts->input_format = INPUT_NAUTY; continue;}
+        if (strcmp(arg, "--input-format=edges") == 0) {opts->input_format = INPUT_EDGES; continue;}
+        if (strcmp(arg, "--input-format=dimacs") == 0) {opts->input_format = INPUT_DIMACS; continue;}
+        if (strcmp(arg, "--input-format=binary") == 0) {opts->input_format = INPUT_BINARY; continue;}
+        if (strncmp(arg, "--to-binary=", 12) == 0 && arg[12] != '\0') {opts->binaryfilename = arg + 12; continue;}
+        if (strcmp(arg, "--binary-csr") == 0) {opts->binary_csr = TRUE; continue;}
+        if (_int_option(arg, "--cutoff-depth", &opts->send_work_cutoff_depth)) continue;
+        if (_int_option(arg, "--max-donation", &opts->max_work_size_to_send)) continue;
+        if (_int_option(arg, "--poll-interval", &opts->nodes_between_comm_polls)) continue;
+        if (strcmp(arg, "--adaptive-donation") == 0) {opts->adaptive_donation = TRUE; continue;}
+        if (_int_option(arg, "--seed", &seed)) {opts->seed = (unsigned long)seed; continue;}
+        if (strcmp(arg, "--termination=ring") == 0) {opts->termination = TERMINATION_RING; continue;}
+        if (strcmp(arg, "--termination=counting") == 0) {opts->termination = TERMINATION_COUNTING; continue;}
+        if (_int_option(arg, "--bcast-slots", &opts->bcast_slots)) continue;
+        if (_int_option(arg, "--auto-batch", &opts->auto_batch)) continue;
+        if (_int_option(arg, "--auto-batch-delay", &opts->auto_batch_delay_ms)) continue;
+        if (_int_option(arg, "--initial-frontier", &opts->initial_frontier)) continue;
+        if (strcmp(arg, "--progress-thread") == 0) {opts->progress_thread = TRUE; continue;}
+        if (_int_option(arg, "--idle-backoff", &opts->idle_backoff_us)) continue;
+        if (strcmp(arg, "--rma-state") == 0) {opts->rma_state = TRUE; continue;}
+        if (strcmp(arg, "--batch") == 0) {opts->batch = TRUE; continue;}
+        if (strncmp(arg, "--output=", 9) == 0 && arg[9] != '\0') {opts->outfilename = arg + 9; continue;}
+        if (strcmp(arg, "--output-format=graph6") == 0) {opts->output_format = OUTPUT_GRAPH6; continue;}
+        if (strcmp(arg, "--output-format=sparse6") == 0) {opts->output_format = OUTPUT_SPARSE6; continue;}
+        if (strcmp(arg, "--output-format=binary") == 0) {opts->output_format = OUTPUT_BINARY; continue;}
+        if (strcmp(arg, "--dedup") == 0) {opts->dedup = TRUE; continue;}
+        if (strncmp(arg, "--counts=", 9) == 0 && arg[9] != '\0') {opts->countsfilename = arg + 9; continue;}
+        if (_int_option(arg, "--dedup-memory", &opts->dedup_memory_mb)) continue;
+        if (strncmp(arg, "--tmp-dir=", 10) == 0 && arg[10] != '\0') {opts->tmpdir = arg + 10; continue;}
+        if (strcmp(arg, "--compress-runs") == 0) {opts->compress_runs = TRUE; continue;}
+        if (strncmp(arg, "--cache=", 8) == 0 && arg[8] != '\0') {opts->cachefilename = arg + 8; continue;}
+        if (strncmp(arg, "--serve=", 8) == 0 && arg[8] != '\0') {opts->serve_path = arg + 8; continue;}
+        if (_int_option(arg, "--threads", &opts->threads)) continue;
+        if (_int_option(arg, "--chunk-bytes", &opts->chunk_bytes)) continue;
+        if (strcmp(arg, "--merge") == 0) {opts->merge = TRUE; continue;}
+
+        printf("Unknown option %s\n", arg);
+        options_usage(stdout, argv[0]);
+        exit(1);
+    }
+
+    if (opts->max_work_size_to_send < 1) opts->max_work_size_to_send = 1;   /* a donation of zero nodes is just a reject */
+    if (opts->nodes_between_comm_polls < 1) opts->nodes_between_comm_polls = 1;
+    if (opts->bcast_slots < 1) opts->bcast_slots = 1;
+    if (opts->auto_batch < 1) opts->auto_batch = 1;
+    if (opts->threads < 1) opts->threads = 1;
+    if (opts->chunk_bytes < 1) opts->chunk_bytes = 1;
+}
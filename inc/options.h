@@ -0,0 +1,90 @@
+/**
+ * Copyright 2025 Jim Haslett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _OPTIONS_H_
+#define _OPTIONS_H_
+
+#include "proto.h"
+
+/** Defaults for the runtime options, these used to be compile time constants */
+#define DEFAULT_SEND_WORK_CUTOFF_DEPTH 3        /* don't give away work unless the stack is deeper than this */
+#define DEFAULT_MAX_WORK_SIZE_TO_SEND 10        /* max number of nodes to donate in one chunk */
+#define DEFAULT_NODES_BETWEEN_COMM_POLLS 10     /* How many nodes should we process between polling for new messages? */
+#define DEFAULT_BCAST_SLOTS 16                  /* broadcasts (new CL / automorphism) that can be in flight at once */
+#define DEFAULT_AUTO_BATCH 8                    /* automorphisms gathered before they are sent as one message */
+#define DEFAULT_AUTO_BATCH_DELAY_MS 10          /* longest an automorphism waits in the batch */
+#define DEFAULT_CHUNK_BYTES (1 << 20)           /* bytes of the graph file a process takes at a time in collection mode */
+
+/** Work end (termination) detectors, --termination= */
+#define TERMINATION_RING 0          /* Dijkstra's token ring, at least P message hops */
+#define TERMINATION_COUNTING 1      /* four counter waves over MPI_Iallreduce, log P latency */
+
+/** Graph file formats, --input-format= */
+#define INPUT_AUTO 0                /* from the file name */
+#define INPUT_NAUTY 1               /* graph6, sparse6 or digraph6 */
+#define INPUT_EDGES 2               /* "u v" lines, vertices from 0 */
+#define INPUT_DIMACS 3              /* DIMACS .col edges or .gr arcs, vertices from 1 */
+#define INPUT_BINARY 4              /* a .pcg binary graph, mapped as it is, see binarygraph.h */
+
+/** Canonical graph formats, --output-format= */
+#define OUTPUT_GRAPH6 0             /* graph6 lines, digraph6 for digraphs */
+#define OUTPUT_SPARSE6 1            /* sparse6 lines, digraph6 for digraphs */
+#define OUTPUT_BINARY 2             /* GraphRecordHeader then the adjacency matrix, see graphwriter.h */
+
+
+/**
+ * Command line options.  Everything starting with "--" is an option, the first
+ * thing that doesn't is the graph file name.
+ */
+typedef struct {
+    char *infilename;                   /* graph file to read */
+    int input_format;                   /* --input-format=auto|nauty|edges|dimacs|binary, one of INPUT_* */
+    char *binaryfilename;               /* --to-binary=FILE, write the graph as a binary graph and stop, NULL searches it */
+    boolean binary_csr;                 /* --binary-csr, --to-binary adds the CSR adjacency lists */
+
+    int send_work_cutoff_depth;         /* --cutoff-depth=N */
+    int max_work_size_to_send;          /* --max-donation=N */
+    int nodes_between_comm_polls;       /* --poll-interval=N */
+    boolean adaptive_donation;          /* --adaptive-donation, size donations from stack depth and steal success rate */
+    unsigned long seed;                 /* --seed=N, random seed for picking victims, 0 means seed from the clock */
+    int termination;                    /* --termination=ring|counting, TERMINATION_RING or TERMINATION_COUNTING */
+    int bcast_slots;                    /* --bcast-slots=N */
+    int auto_batch;                     /* --auto-batch=N */
+    int auto_batch_delay_ms;            /* --auto-batch-delay=MS */
+    int initial_frontier;               /* --initial-frontier=K, rank 0 expands K nodes per process and scatters them, 0 is off */
+    boolean progress_thread;            /* --progress-thread, answer steal requests from a second thread */
+    int idle_backoff_us;                /* --idle-backoff=US, idle processes sleep up to US between probes, 0 spins */
+    boolean rma_state;                  /* --rma-state, share orbits and the best key through an MPI window on rank 0 */
+    boolean batch;                      /* --batch, canonicalize every graph in the file, not just the first */
+    char *outfilename;                  /* --output=FILE, where the canonical graphs go, NULL is stdout for --batch and nowhere otherwise */
+    int output_format;                  /* --output-format=graph6|sparse6|binary, one of OUTPUT_* */
+    boolean dedup;                      /* --dedup, --batch writes only the first graph of each isomorphism class */
+    char *countsfilename;               /* --counts=FILE, --dedup writes each class's representative and size here */
+    int dedup_memory_mb;                /* --dedup-memory=MB, --dedup out of core in sorted runs of MB megabytes, 0 keeps the classes in memory */
+    char *tmpdir;                       /* --tmp-dir=DIR, where the runs go, NULL is $TMPDIR or /tmp */
+    boolean compress_runs;              /* --compress-runs, delta and varint code the runs */
+    char *cachefilename;                /* --cache=FILE, canonical forms kept across runs, NULL is no cache */
+    char *serve_path;                   /* --serve=PATH, answer requests on a UNIX socket at PATH, or on stdin and stdout for -, NULL is off */
+    int threads;                        /* --threads=N, --batch workers, 1 searches in the main thread */
+    int chunk_bytes;                    /* --chunk-bytes=N, mpi --batch hands the file out N bytes at a time */
+    boolean merge;                      /* --merge, mpi --batch joins the per process shards into --output, in input order */
+} Options;
+
+
+void parse_options(Options *opts, int argc, char **argv);
+void options_usage(FILE *f, char *progname);
+
+#endif /* _OPTIONS_H_ */
@@ -243,7 +243,11 @@ opengraphfile(char *filename, int *codetype, int assumefixed, long position)
         }
     }
 
-    if (position <= 1) return f;
+    if (position <= 1)
+    {
+        FUNLOCKFILE(f);
+        return f;
+    }
 
     if (*codetype&PLANARCODEANY)
     {
@@ -337,16 +341,44 @@ readgg(FILE *f, graph *g, int reqm, int *pm, int *pn, boolean *digraph)
  * Put the code type into readg_code
 */
 {
-    char *s,*p;
+    char *s;
+    int m,n;
+
+    if ((s = gtools_getline(f)) == NULL) return NULL;
+    check_graph_line(s,reqm,&m,&n,digraph);
+
+    if (g == NULL)
+    {
+        if ((g = (graph*)ALLOCS(n,m*sizeof(graph))) == NULL)
+            gt_abort(">E readgg: malloc failed\n");
+    }
+
+    *pn = n;
+    *pm = m;
+
+    stringtograph(s,g,m);
+    return g;
+}
+
+/***********************************************************************/
+
+void                   /* check a graph line read by gtools_getline */
+check_graph_line(char *s, int reqm, int *pm, int *pn, boolean *digraph)
+/* graph6, digraph6 and sparse6 formats are supported 
+   s = the line, including the \n 
+   reqm = the requested value of m (0 => compute from n) 
+   *pm = the value of m to use 
+   *pn = the value of n 
+   *digraph = whether the input is a digraph
+   Bad lines abort, same as readgg.
+*/
+{
+    char *p;
     int m,n;
 
     //TODO:  These were globals for some reason
     int readg_code;
-    char *readg_line;
 
-    if ((readg_line = gtools_getline(f)) == NULL) return NULL;
-
-    s = readg_line;
     if (s[0] == ':')
     {
         readg_code = SPARSE6;
@@ -386,17 +418,8 @@ readgg(FILE *f, graph *g, int reqm, int *pm, int *pn, boolean *digraph)
     else
         m = (n + WORDSIZE - 1) / WORDSIZE;
 
-    if (g == NULL)
-    {
-        if ((g = (graph*)ALLOCS(n,m*sizeof(graph))) == NULL)
-            gt_abort(">E readgg: malloc failed\n");
-    }
-
     *pn = n;
     *pm = m;
-
-    stringtograph(s,g,m);
-    return g;
 }
 
 /***********************************************************************/
@@ -424,6 +447,169 @@ readg(FILE *f, graph *g, int reqm, int *pm, int *pn)
     return gg;
 }
 
+/***********************************************************************/
+
+graph*                 /* read graph into a reusable buffer */
+readg_reuse(FILE *f, graph **g, size_t *g_sz, int *pm, int *pn, boolean *digraph) 
+/* like readgg, for reading a file of graphs one after another 
+   *g = buffer for the answer, *g_sz words, grown as needed (NULL, 0 to start) 
+   Returns *g, or NULL at end of file.
+*/
+{
+    char *s;
+    int m,n;
+
+    if ((s = gtools_getline(f)) == NULL) return NULL;
+    check_graph_line(s,0,&m,&n,digraph);
+
+    DYNALLOC2(graph,*g,*g_sz,n,m,"readg_reuse");
+    *pn = n;
+    *pm = m;
+
+    stringtograph(s,*g,m);
+    FREES(s);
+    return *g;
+}
+
+/***********************************************************************/
+
+void                   /* write graph6 line */
+writeg6(FILE *f, graph *g, int m, int n)
+/* writes g as one graph6 line, the same layout stringtograph reads */
+{
+    char *s;
+
+    if ((s = (char*)ALLOCS(G6LEN(n)+2,sizeof(char))) == NULL)
+        gt_abort(">E writeg6: malloc failed\n");
+    ntog6(g,m,n,s);
+    fputs(s,f);
+    FREES(s);
+}
+
+/***********************************************************************/
+
+size_t                 /* convert graph to graph6 line */
+ntog6(graph *g, int m, int n, char *s)
+/* s = room for at least G6LEN(n)+2 characters, gets the line with its \n and \0 
+   Returns the length, not counting the \0.
+*/
+{
+    char *p;
+    int i,j,k,x;
+
+    p = s;
+
+    if (n <= SMALLN)
+        *p++ = (char)(BIAS6 + n);
+    else if (n <= SMALLISHN)
+    {
+        *p++ = MAXBYTE;
+        *p++ = (char)(BIAS6 + (n >> 12));
+        *p++ = (char)(BIAS6 + ((n >> 6) & C6MASK));
+        *p++ = (char)(BIAS6 + (n & C6MASK));
+    }
+    else
+    {
+        *p++ = MAXBYTE;
+        *p++ = MAXBYTE;
+        for (k = 30; k >= 0; k -= 6)
+            *p++ = (char)(BIAS6 + ((n >> k) & C6MASK));
+    }
+
+    /* upper triangle, column by column, six bits to a character */
+    k = 6;
+    x = 0;
+    for (j = 1; j < n; ++j)
+    {
+        for (i = 0; i < j; ++i)
+        {
+            x <<= 1;
+            if (ISELEMENT(GRAPHROW(g,i,m),j)) x |= 1;
+            if (--k == 0)
+            {
+                *p++ = (char)(BIAS6 + x);
+                k = 6;
+                x = 0;
+            }
+        }
+    }
+    if (k != 6) *p++ = (char)(BIAS6 + (x << k));
+
+    *p++ = '\n';
+    *p = '\0';
+    return (size_t)(p - s);
+}
+
+/***********************************************************************/
+
+void                   /* write digraph6 line */
+writed6(FILE *f, graph *g, int m, int n)
+/* writes g as one digraph6 line, the same layout stringtograph reads */
+{
+    char *s;
+
+    if ((s = (char*)ALLOCS(D6LEN(n)+2,sizeof(char))) == NULL)
+        gt_abort(">E writed6: malloc failed\n");
+    ntod6(g,m,n,s);
+    fputs(s,f);
+    FREES(s);
+}
+
+/***********************************************************************/
+
+size_t                 /* convert digraph to digraph6 line */
+ntod6(graph *g, int m, int n, char *s)
+/* s = room for at least D6LEN(n)+2 characters, gets the line with its \n and \0 
+   Returns the length, not counting the \0.
+*/
+{
+    char *p;
+    int i,j,k,x;
+
+    p = s;
+    *p++ = '&';
+
+    if (n <= SMALLN)
+        *p++ = (char)(BIAS6 + n);
+    else if (n <= SMALLISHN)
+    {
+        *p++ = MAXBYTE;
+        *p++ = (char)(BIAS6 + (n >> 12));
+        *p++ = (char)(BIAS6 + ((n >> 6) & C6MASK));
+        *p++ = (char)(BIAS6 + (n & C6MASK));
+    }
+    else
+    {
+        *p++ = MAXBYTE;
+        *p++ = MAXBYTE;
+        for (k = 30; k >= 0; k -= 6)
+            *p++ = (char)(BIAS6 + ((n >> k) & C6MASK));
+    }
+
+    /* the whole matrix, row by row, six bits to a character */
+    k = 6;
+    x = 0;
+    for (i = 0; i < n; ++i)
+    {
+        for (j = 0; j < n; ++j)
+        {
+            x <<= 1;
+            if (ISELEMENT(GRAPHROW(g,i,m),j)) x |= 1;
+            if (--k == 0)
+            {
+                *p++ = (char)(BIAS6 + x);
+                k = 6;
+                x = 0;
+            }
+        }
+    }
+    if (k != 6) *p++ = (char)(BIAS6 + (x << k));
+
+    *p++ = '\n';
+    *p = '\0';
+    return (size_t)(p - s);
+}
+
 
 
 /***********************************************************************/
@@ -83,6 +83,13 @@
 
 FILE* opengraphfile(char *filename, int *codetype, int assumefixed, long position); /* opens and positions a file for reading graphs. */
 graph* readg(FILE *f, graph *g, int reqm, int *pm, int *pn); /* read undirected graph into nauty format */
+graph* readgg(FILE *f, graph *g, int reqm, int *pm, int *pn, boolean *digraph); /* read graph or digraph into nauty format */
+graph* readg_reuse(FILE *f, graph **g, size_t *g_sz, int *pm, int *pn, boolean *digraph); /* read graph into a reusable buffer */
+void check_graph_line(char *s, int reqm, int *pm, int *pn, boolean *digraph); /* check a graph line read by gtools_getline */
+void writeg6(FILE *f, graph *g, int m, int n); /* write graph6 line */
+size_t ntog6(graph *g, int m, int n, char *s); /* convert graph to graph6 line */
+void writed6(FILE *f, graph *g, int m, int n); /* write digraph6 line */
+size_t ntod6(graph *g, int m, int n, char *s); /* convert digraph to digraph6 line */
 void gt_abort(const char *msg);     /* Write message and halt. */
 char* gtools_getline(FILE *f);     /* read a line with error checking */
 int graphsize(char *s); /* Get size of graph out of graph6, digraph6 or sparse6 string. */
@@ -16,15 +16,20 @@
 
 #include "p_util.h"
 
+_Thread_local jmp_buf *error_trap = NULL;
+
 /*****************************************************************************
 *                                                                            *
 *  alloc_error() writes a message and exits.  Used by DYNALLOC? macros.      *
+*  Both jump to error_trap instead, without a word, when a library caller    *
+*  has set one.                                                              *
 *                                                                            *
 *****************************************************************************/
 
 void NORET_ATTR
 alloc_error(const char *s)
 {
+    if (error_trap) longjmp(*error_trap, ERROR_TRAP_ALLOC);
     fprintf(ERRFILE,"Dynamic allocation failed: %s\n",s);
     exit(2);
 }
@@ -32,6 +37,7 @@ alloc_error(const char *s)
 void NORET_ATTR
 runtime_error(const char *s)
 {
+    if (error_trap) longjmp(*error_trap, ERROR_TRAP_RUNTIME);
     fprintf(ERRFILE,"Runtime Error: %s\n",s);
     exit(2);
 }
@@ -18,6 +18,13 @@
 #define _P_UTIL_H_
 
 #include "proto.h"
+#include <setjmp.h>
+
+#define ERROR_TRAP_ALLOC 1          /* what longjmp gives setjmp, see error_trap */
+#define ERROR_TRAP_RUNTIME 2
+
+/* when set, alloc_error and runtime_error jump here instead of exiting, per thread, see libpcanon.c */
+extern _Thread_local jmp_buf *error_trap;
 
 
 void NORET_ATTR alloc_error(const char *s);
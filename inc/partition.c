@@ -15,6 +15,7 @@
  */
 
 #include "partition.h"
+#include "util.h"
 
 
 
@@ -357,7 +358,7 @@ partition* generate_permutation(partition *src, partition *dst) {
 
 graph* calculate_invariant(graph *g, int m, int n, partition *permutation) {
     graph *invar;
-    if ((invar = (graph*)ALLOCS(n,m*sizeof(graph))) == NULL) runtime_error("calculate_invariant: malloc failed\n");
+    if ((invar = (graph*)ALLOCS(n,m*sizeof(graph))) == NULL) alloc_error("calculate_invariant");
 
     for (int i = 0; i < m*n; ++i) {
         invar[i] = g[i];
@@ -411,4 +412,23 @@ int compare_invariants(graph *A, graph *B, int m, int n) {
         if (A[i] > B[i]) return -1;
     }
     return 0;
+}
+
+void invariant_key(graph *invar, int m, int n, InvarKey *key) {
+    for (int i = 0; i < INVAR_KEY_WORDS; ++i) {
+        key->lead[i] = i < m*n ? invar[i] : 0;
+    }
+    key->hash = hash_words(invar, (size_t)m*n);
+}
+
+/**
+ * Compares the leading words only, same sign as compare_invariants.  0 means the leading
+ * words match, check the hashes to see if the invariants do.
+ */
+int compare_invariant_keys(InvarKey *A, InvarKey *B) {
+    for (int i = 0; i < INVAR_KEY_WORDS; ++i) {
+        if (A->lead[i] < B->lead[i]) return 1;
+        if (A->lead[i] > B->lead[i]) return -1;
+    }
+    return 0;
 }
\ No newline at end of file
@@ -44,7 +44,7 @@ typedef struct {
 
 #define DYNALLOCPART(name,new_sz,msg) \
     /*if (name && (size_t)(new_sz) > name->sz) {printf("WHAT\n");FREEPART(name);}*/ \
-    if ((name= (partition*)malloc(sizeof(partition))) == NULL) {alloc_error(msg);}; \
+    if ((name= (partition*)calloc(1, sizeof(partition))) == NULL) {alloc_error(msg);};  /* zeroed, FREEPART can take it if lab or ptn fails */ \
     if ((name->lab=(int*)ALLOCS(new_sz,sizeof(int))) == NULL) {alloc_error(msg);} \
     if ((name->ptn=(int*)ALLOCS(new_sz,sizeof(int))) == NULL) {alloc_error(msg);} \
     name->sz = new_sz; \
@@ -58,6 +58,19 @@ typedef struct {
         name=NULL; }
 
 
+#define INVAR_KEY_WORDS 4   /* leading invariant words kept exactly in an InvarKey */
+
+/**
+ * Short stand in for an invariant, for telling other processes about a new best one.
+ * Invariants compare lexicographically, so when the leading words differ they decide the
+ * order outright.  When they match, equal hashes mean the same invariant.
+ */
+typedef struct {
+    setword lead[INVAR_KEY_WORDS];  /* first words of the invariant, zero past the end of small graphs */
+    unsigned long hash;             /* hash_words of the whole invariant */
+} InvarKey;
+
+
 
 partition* copy_partition(partition *src);
 boolean partitions_are_equal(partition *a, partition *b);
@@ -77,6 +90,8 @@ void append_cell_to_partition_from_another_partition(partition *src, int src_idx
 partition* generate_permutation(partition *src, partition *dst);
 graph* calculate_invariant(graph *g, int m, int n, partition *permutation);
 int compare_invariants(graph *A, graph *B, int m, int n);
+void invariant_key(graph *invar, int m, int n, InvarKey *key);
+int compare_invariant_keys(InvarKey *A, InvarKey *B);
 
 
 #endif /* _PARTITION_H_ */
\ No newline at end of file
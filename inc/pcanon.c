@@ -15,6 +15,10 @@
  */
 
 #include "pcanon.h"
+#include "p_gtools.h"
+#include "graphwriter.h"
+#include "dedup.h"
+#include "canoncache.h"
 #include <time.h>
 
 #ifdef MPI
@@ -25,7 +29,6 @@
 #define LOGFILE "testlog.csv"
 
 #define __DEBUG_R__ FALSE   /* debug refiner */
-#define __DEBUG_RS__ FALSE   /* debug special refiner */
 
 #define __DEBUG_C__ FALSE  /* debug node comparison events */
 #define __DEBUG_P__ FALSE  /* debug node process events */
@@ -34,33 +37,36 @@
 #define __DEBUG_PROGRESS__ 10000 /* show progress every X nodes processed, set to zero to disable */
 
 
-static void _partition_by_scoped_degree(graph *g, partition *pi, int cell, int cell_sz, partition *alpha, int scope_idx, int scope_sz, int m, int n);
 static int _target_cell(partition *pi);
 static void _first_node(graph *g, int m, int n, BadStack *stack, Status *status);
 static void _process_leaf(Path *path, partition *pi, Status *status, boolean track_autos);
 static void _process_next(graph *g, int m, int n, BadStack *stack, Status *status, boolean track_autos);
-static partition* _refine_special(graph *g, partition *pi, partition *active, int m, int n);
-static void log_output_to_file(char *filename, int refines, int auto_sz, double runtime, int num_procs);
-
-
-#ifdef MPI 
-NORET_ATTR
-void run(graph *g, int m, int n, boolean track_autos, char* infilename, int argc, char** argv)
+#ifdef MPI
+static void _process_and_report(graph *g, int m, int n, BadStack *stack, Status *status, boolean track_autos, MPIState *mpi_state);
+static void _expand_frontier(graph *g, int m, int n, BadStack *stack, Status *status, boolean track_autos, MPIState *mpi_state, int target);
 #else /* if MPI */
-NORET_ATTR
-void run(graph *g, int m, int n, boolean track_autos, char* infilename)
+static void _process_and_report(graph *g, int m, int n, BadStack *stack, Status *status, boolean track_autos);
 #endif /* if MPI */
+static void _write_canonical_graph(Status *status, Options *opts);
+static void _store_in_cache(Status *status, Options *opts);
+
+
+/**
+ * Finds the canonical label of g and reports it.  With MPI, every process calls this, MPI has
+ * already been initialized in main (the graph is loaded through MPI too), and main finalizes it.
+ */
+void run(graph *g, int m, int n, boolean digraph, boolean track_autos, char* infilename, Options *opts)
 {
     #ifdef MPI
     /** Set up MPI */   
     MPIState mpi_state;
-    MPI_Init(&argc, &argv);  /* Initialize MPI */
     MPI_Comm_rank(MPI_COMM_WORLD, &mpi_state.my_rank);  /* Fetch rank */
     MPI_Comm_size(MPI_COMM_WORLD, &mpi_state.num_processes);  /* Fetch number of processes */
 
     if (mpi_state.my_rank == 0) printf("MPI Active with %d processes\n\n", mpi_state.num_processes);
-    
-    srand(time(NULL));  /* seed the random number generator, will be used to pick a processor to ask for work */
+
+    mpi_state_initialize(&mpi_state, opts);  /* copy work sharing options into the MPI state, seed the random victim selection */
+    mpi_rma_initialize(&mpi_state, n);      /* only if --rma-state */
     /** */
 
     double start_time = MPI_Wtime();  /* mark start time */
@@ -74,39 +80,20 @@ void run(graph *g, int m, int n, boolean track_autos, char* infilename)
     stack_initialize(stack, 200); /* Not sure if n is the best answer, but it seems reasonable */
 
     /* Initialize status tracking struct.  in MPI each process tracks its own status */
-    Status *status = (Status*)malloc(sizeof(Status));
-    status->g = g;                      /* The graph we are operating on */
-    status->m = m;                      /* m is width in words for each graph adjacency matrix line */
-    status->n = n;                      /* n is the number of vertices, also the number of rows in the adjacency matrix */
-    status->cl = NULL;                  /* current best canonical label, NULL means we haven't found one yet */
-    status->cl_pi = NULL;               /* The partition that generated the current CL */
-    status->best_invar = NULL;          /* The invariant based on the current CL.  We use this at every leaf node, so we don't want to regenrate every leaf note*/
-    status->best_invar_path = NULL;     /* The tree path the current invariant was generated at */
-
-    /* build theta and mcr */
-    status->theta = generate_unit_partition(n); /* theta is orbit of the automorphism group */
-    for (int i = 0; i < status->theta->sz; ++i) status->theta->ptn[i] = 0; /* theta starts off discrete */
-    status->mcr = (int*)malloc(sizeof(int)*n);  /* mcr is Minimum Cell Representation of theta, this is what is used for pruning */
-    automorphisms_calculate_mcr(status->theta, status->mcr, &status->mcr_sz);  /* calculate initial mcr, which will be all vertices */
-    
-    DYNALLOCAUTOGROUP(status->autogrp, n, n, "run_dyn_autogrp");  /* allocate space for the automorphism group, probably don't need size n here */
-
-    status->flag_new_cl = FALSE;        /* used for return values, will be TRUE after _process_next if a better CL was found */
-    status->flag_new_auto = FALSE;      /* used for return values, will be TRUE after _process_next if a new automorphism was found */
-    
-    DYNALLOCPART(status->base_pi, n, "run_status_malloc");  /* allocate memory for the base graph's discrete parition, used to generate permutation for leaf nodes */
-    for(int i = 0; i < n; ++i) {                            /* initialize the base partition.  Once again, it's used a lot, so make it once and store */
-        status->base_pi->lab[i] = i;
-        status->base_pi->ptn[i] = 0;
-    }
-
-    status->refinement_count = 0;       /* used to track how many refinements have been completed on this process */
+    Status *status = status_new();
+    status_reset(status, g, m, n, digraph);
     
     #ifdef MPI
     if (mpi_state.my_rank == 0) {
         printf("Graph Loaded - M: %d   N: %d\n\n", m, n);
         _first_node(g, m, n, stack, status);    /* run against first node, which will create the node and push to the stack, for MPI, only run this on rank 0 process */
     } 
+
+    /* optionally hand everyone a share of the top of the tree, rather than having them all ask rank 0 for work */
+    if (opts->initial_frontier > 0) {
+        if (mpi_state.my_rank == 0) _expand_frontier(g, m, n, stack, status, track_autos, &mpi_state, opts->initial_frontier * mpi_state.num_processes);
+        mpi_scatter_frontier(&mpi_state, stack, status);
+    }
     #else /* if MPI */
     printf("Graph Loaded - M: %d   N: %d\n\n", m, n);
     _first_node(g, m, n, stack, status);    /* run against first node, which will create the node and push to the stack */
@@ -115,6 +102,7 @@ void run(graph *g, int m, int n, boolean track_autos, char* infilename)
     #ifdef MPI
     int last_comm_check = 0;
     mpi_state.state = MPI_STATE_WORKING;
+    mpi_start_progress_thread(&mpi_state, stack);   /* only if --progress-thread */
     
     /** This is a special loop for MPI, as if the queue goes empty, we aren't done, we need to ask for more work */
     while (mpi_state.state == MPI_STATE_WORKING || mpi_state.state == MPI_STATE_ASKING_FOR_WORK) {
@@ -122,29 +110,10 @@ void run(graph *g, int m, int n, boolean track_autos, char* infilename)
 
     /* main loop.  So long as there's something on the stack, keep on going! */
     while(stack_size(stack) > 0) {
-        status->flag_new_cl = FALSE;    /* reset status flags */
-        status->flag_new_auto = FALSE;  /* reset status flags */
-        _process_next(g, m, n, stack, status, track_autos); /* process the next node on the stack */
-
-        if (status->flag_new_auto) {
-            /* New automorphism found */
-
-            /* process automorphism locally */
-            partition *aut = status->autogrp->automorphisms[status->autogrp->sz-1];
-            automorphisms_merge_perm_into_oribit(aut, status->theta);
-            automorphisms_calculate_mcr(status->theta, status->mcr, &status->mcr_sz);
-
-            #ifdef MPI
-            /* Send message to other processes*/
-            mpi_send_new_automorphism(&mpi_state, status, aut);
-            #endif /* if MPI */
-        } 
         #ifdef MPI
-        /* if we are running MPI, then we are interested in sending new CL messages*/
-        else if (status->flag_new_cl) {
-            /* Send message to other processes*/
-            mpi_send_new_best_cl(&mpi_state, status);
-        }
+        _process_and_report(g, m, n, stack, status, track_autos, &mpi_state); /* process the next node on the stack */
+        #else /* if MPI */
+        _process_and_report(g, m, n, stack, status, track_autos); /* process the next node on the stack */
         #endif /* if MPI */
 
         #ifdef MPI
@@ -157,7 +126,7 @@ void run(graph *g, int m, int n, boolean track_autos, char* infilename)
         #endif /* if MPI */
     
         #ifdef MPI
-        if (status->refinement_count > last_comm_check + MPI_NODES_BETWEEN_COMM_POLLS) {
+        if (status->refinement_count > last_comm_check + mpi_state.nodes_between_comm_polls) {
             last_comm_check = status->refinement_count;
             mpi_poll_for_messages(&mpi_state, stack, status);
         }
@@ -174,6 +143,8 @@ void run(graph *g, int m, int n, boolean track_autos, char* infilename)
         } 
     } /* while (mpi_state.state == MPI_STATE_WORKING || mpi_state.state == MPI_STATE_ASKING_FOR_WORK) */
     
+    mpi_stop_progress_thread(&mpi_state);
+
     /* safety check that we are actually in work end state */
     if (mpi_state.state != MPI_STATE_WORK_END) {
         /* if we are in the wrong state, print error message and exit with a non zero state, so we don't miss the error */
@@ -184,6 +155,9 @@ void run(graph *g, int m, int n, boolean track_autos, char* infilename)
 
     /* cleanup and reporting */
     #ifdef MPI
+    mpi_finish_broadcasts(&mpi_state, stack, status);   /* late labels and automorphisms still need to reach everyone */
+    mpi_rma_collect(&mpi_state, status);                /* or with --rma-state, gather the labels that might be best */
+    accept_pending_cl(status);                          /* report the best label, even if it was never built here */
     
     printf("Process %d refines: %d\n", mpi_state.my_rank, status->refinement_count);
     
@@ -204,6 +178,8 @@ void run(graph *g, int m, int n, boolean track_autos, char* infilename)
         }
 
         log_output_to_file(infilename, total_refines, status->autogrp->sz, runtime, mpi_state.num_processes);
+        _write_canonical_graph(status, opts);
+        _store_in_cache(status, opts);
 
     } else if (__DEBUG_MPI__) {
         /* temporary for testing */
@@ -227,36 +203,313 @@ void run(graph *g, int m, int n, boolean track_autos, char* infilename)
     }
 
     log_output_to_file(infilename, status->refinement_count, status->autogrp->sz, runtime, -1);
+    _write_canonical_graph(status, opts);
+    _store_in_cache(status, opts);
 
 
     #endif /* if MPI */
     /** Free allocated memory */
     free(stack);
-    FREES(status->theta);
-    if (status->mcr) free(status->mcr);
-    FREES(status->base_pi);
-    FREEAUTOGROUP(status->autogrp);
-    if(status->best_invar) free(status->best_invar);
-    FREEPATH(status->best_invar_path);
-    free(status);
+    status_free(status);
     /** */
 
 #ifdef MPI
-    /** Shut down MPI and exit */
+    /** Free the MPI state, main shuts down MPI */
     if (__DEBUG_MPI__) printf("MPI process %d shutting down normally\n", mpi_state.my_rank);
-    MPI_Finalize();
+    mpi_state_free(&mpi_state);
     /** */
 #endif /* if MPI */
+}
+
+
+/* --output=FILE, the canonical graph in --output-format */
+static void _write_canonical_graph(Status *status, Options *opts) {
+    if (opts->outfilename == NULL) return;
+    FILE *outfile = fopen(opts->outfilename, "w");
+    if (outfile == NULL) {
+        printf("Can't open %s for writing\n", opts->outfilename);
+        return;
+    }
+    GraphWriter writer;
+    graphwriter_init(&writer, opts->output_format);
+    graphwriter_encode(&writer, status->best_invar, status->m, status->n, status->digraph);
+    graphwriter_write(&writer, outfile);
+    graphwriter_free(&writer);
+    fclose(outfile);
+}
+
+/* --cache=FILE, adds what the search found, main already looked and didn't find it */
+static void _store_in_cache(Status *status, Options *opts) {
+    if (opts->cachefilename == NULL) return;
+    CanonCache *cache = canoncache_open(opts->cachefilename);
+    canoncache_store(cache, status);
+    canoncache_close(cache);
+}
+
+
+/**
+ * Batch mode (--batch), canonicalizes every graph in map one after another, in this process,
+ * and writes each canonical graph to outfile in --output-format, in input order, or with --dedup
+ * only the first of each isomorphism class.  With --cache, graphs found in the cache aren't
+ * searched, and the rest are added to it.  The stack, the Status, the graph buffer and the
+ * writer's buffer are reused from graph to graph, and the log gets one line for the whole batch.
+ */
+void run_batch(GraphMap *map, char *infilename, FILE *outfile, Options *opts) {
+    double start_time = wtime();  /* mark start time */
+    int m, n, total_refines = 0, total_autos = 0;
+    long graphs;
+    boolean digraph;
+    graph *g = NULL;
+    size_t g_sz = 0;
+
+    BadStack *stack = malloc(sizeof(BadStack));
+    stack_initialize(stack, 200);
+    Status *status = status_new();
+    GraphWriter writer;
+    graphwriter_init(&writer, opts->output_format);
+    DedupTable *classes = opts->dedup ? dedup_new(map->num_graphs) : NULL;
+    CanonCache *cache = opts->cachefilename ? canoncache_open(opts->cachefilename) : NULL;
+    long hits = 0;
+
+    for (graphs = 0; graphmap_graph(map, graphs, &g, &g_sz, &m, &n, &digraph) != NULL; ++graphs) {
+        /* the invariant is the graph relabeled by the CL */
+        graph *canon;
+        CacheRecordHeader *rec = cache ? canoncache_lookup(cache, g, m, n, digraph) : NULL;
+        if (rec) {
+            canon = canoncache_cert(rec);
+            ++hits;
+        } else {
+            canonicalize(status, stack, g, m, n, digraph);
+            canon = status->best_invar;
+            if (cache) canoncache_store(cache, status);
+            total_refines += status->refinement_count;
+            total_autos += status->autogrp->sz;
+        }
+
+        if (classes) {
+            DedupEntry *e = dedup_insert(classes, canon, m, n, digraph, graphs);
+            if (dedup_is_first(e, graphs)) {
+                graphwriter_encode(&writer, canon, m, n, digraph);
+                dedup_add_class(classes, e);
+            }
+        } else {
+            graphwriter_encode(&writer, canon, m, n, digraph);
+        }
+        graphwriter_write(&writer, outfile);
+    }
+
+    double runtime = wtime() - start_time;
+    fprintf(stderr, "Batch: %ld graphs, %d refinements, %f seconds\n", graphs, total_refines, runtime);
+    if (classes) {
+        dedup_report(classes, graphs, opts->countsfilename);
+        dedup_free(classes);
+    }
+    if (cache) {
+        fprintf(stderr, "Cache: %ld hits, %ld searched\n", hits, graphs - hits);
+        canoncache_close(cache);
+    }
+    log_output_to_file(infilename, total_refines, total_autos, runtime, -1);
 
-    exit(0);
+    free(stack);
+    status_free(status);
+    graphwriter_free(&writer);
+    FREES(g);
 }
 
 
+/**
+ * Searches g on its own (no MPI), reusing status and stack from the last call.  The results are
+ * left in status, best_invar is the canonical graph.  Nothing global is touched, so threads can
+ * each run their own.
+ */
+void canonicalize(Status *status, BadStack *stack, graph *g, int m, int n, boolean digraph) {
+    status_reset(status, g, m, n, digraph);
+    _first_node(g, m, n, stack, status);
+    while (stack_size(stack) > 0) {
+        #ifdef MPI
+        _process_and_report(g, m, n, stack, status, TRUE, NULL);    /* nobody to report to */
+        #else /* if MPI */
+        _process_and_report(g, m, n, stack, status, TRUE);
+        #endif /* if MPI */
+    }
+}
+
+
+/* a Status with nothing in it, status_reset sets it up for a graph */
+Status *status_new() {
+    Status *status = (Status*)calloc(1, sizeof(Status));
+    if (status == NULL) alloc_error("status_new");
+    return status;
+}
+
+/**
+ * Sets status up for a new search of g.  The last search's results are freed, the n sized
+ * arrays are kept if n hasn't changed, so a batch of same sized graphs doesn't reallocate them.
+ * A digraph also gets its transpose, refinement splits cells by in and out degree.
+ */
+void status_reset(Status *status, graph *g, int m, int n, boolean digraph) {
+    FREEPART(status->cl);               /* current best canonical label, NULL means we haven't found one yet */
+    FREEPART(status->cl_pi);            /* The partition that generated the current CL */
+    FREES(status->best_invar);          /* The invariant based on the current CL.  We use this at every leaf node, so we don't want to regenrate every leaf note*/
+    status->best_invar = NULL;
+    FREEPATH(status->best_invar_path);  /* The tree path the current invariant was generated at */
+    FREEPART(status->pending_cl_pi);    /* a better CL another process told us about, only built when we need it */
+    FREEPATH(status->pending_cl_path);
+    FREES(status->first_invar);         /* the first leaf's invariant, leaves equal to it give automorphisms too */
+    status->first_invar = NULL;
+    FREEPART(status->first_pi);
+
+    if (status->theta == NULL || status->n != n) {
+        FREEPART(status->theta);
+        FREES(status->mcr);
+        status->mcr = NULL;             /* an allocation below can fail, status_free must still work */
+        FREEAUTOGROUP(status->autogrp);
+        FREEPART(status->base_pi);
+        FREES(status->stab_orbits);
+        status->stab_orbits = NULL;
+
+        status->theta = generate_unit_partition(n); /* theta is orbit of the automorphism group */
+        status->mcr = (int*)malloc(sizeof(int)*n);  /* mcr is Minimum Cell Representation of theta, this is what is used for pruning */
+        if (status->mcr == NULL) alloc_error("status_reset");
+        DYNALLOCAUTOGROUP(status->autogrp, n, n, "run_dyn_autogrp");  /* allocate space for the automorphism group, probably don't need size n here */
+        DYNALLOCPART(status->base_pi, n, "run_status_malloc");  /* allocate memory for the base graph's discrete parition, used to generate permutation for leaf nodes */
+        status->stab_orbits = (int*)malloc(sizeof(int)*n);     /* scratch for _stabilizer_orbits */
+        if (status->stab_orbits == NULL) alloc_error("status_reset");
+    } else {
+        automorphisms_clear(status->autogrp);
+    }
+
+    status->g = g;                      /* The graph we are operating on */
+    status->m = m;                      /* m is width in words for each graph adjacency matrix line */
+    status->n = n;                      /* n is the number of vertices, also the number of rows in the adjacency matrix */
+    status->digraph = digraph;
+    if (digraph) {
+        DYNALLOC2(graph, status->gt, status->gt_sz, n, m, "status_reset");
+        memset(status->gt, 0, sizeof(setword)*m*(size_t)n);
+        for (int v = 0; v < n; ++v) {
+            for (int w = 0; w < n; ++w) {
+                if (ISELEMENT(GRAPHROW(g,v,m), w)) ADDELEMENT(GRAPHROW(status->gt,w,m), v);
+            }
+        }
+    }
+
+    /* theta starts off discrete, so the initial mcr is all vertices */
+    for (int i = 0; i < n; ++i) {
+        status->theta->lab[i] = i;
+        status->theta->ptn[i] = 0;
+    }
+    automorphisms_calculate_mcr(status->theta, status->mcr, &status->mcr_sz);
+
+    for(int i = 0; i < n; ++i) {                            /* initialize the base partition.  Once again, it's used a lot, so make it once and store */
+        status->base_pi->lab[i] = i;
+        status->base_pi->ptn[i] = 0;
+    }
+
+    status->flag_new_cl = FALSE;        /* used for return values, will be TRUE after _process_next if a better CL was found */
+    status->flag_new_auto = FALSE;      /* used for return values, will be TRUE after _process_next if a new automorphism was found */
+    status->refinement_count = 0;       /* used to track how many refinements have been completed on this process */
+}
+
+void status_free(Status *status) {
+    FREEPART(status->cl);
+    FREEPART(status->cl_pi);
+    FREES(status->best_invar);
+    FREEPATH(status->best_invar_path);
+    FREEPART(status->pending_cl_pi);
+    FREEPATH(status->pending_cl_path);
+    FREES(status->first_invar);
+    FREEPART(status->first_pi);
+    FREEPART(status->theta);
+    FREES(status->mcr);
+    FREEPART(status->base_pi);
+    FREEAUTOGROUP(status->autogrp);
+    FREES(status->stab_orbits);
+    FREES(status->gt);
+    free(status);
+}
+
+
+/**
+ * Processes the next node on the stack, and deals with whatever it found, a new automorphism
+ * is merged into theta (and sent to the other processes), a new CL is sent to the other processes.
+ */
+#ifdef MPI
+static void _process_and_report(graph *g, int m, int n, BadStack *stack, Status *status, boolean track_autos, MPIState *mpi_state)
+#else /* if MPI */
+static void _process_and_report(graph *g, int m, int n, BadStack *stack, Status *status, boolean track_autos)
+#endif /* if MPI */
+{
+    status->flag_new_cl = FALSE;    /* reset status flags */
+    status->flag_new_auto = FALSE;  /* reset status flags */
+    _process_next(g, m, n, stack, status, track_autos); /* process the next node on the stack */
+
+    if (status->flag_new_auto) {
+        /* New automorphism found */
+
+        /* process automorphism locally */
+        partition *aut = status->autogrp->automorphisms[status->autogrp->sz-1];
+        int old_mcr_sz = status->mcr_sz;
+        automorphisms_merge_perm_into_oribit(aut, status->theta);
+        automorphisms_calculate_mcr(status->theta, status->mcr, &status->mcr_sz);
+        if (status->mcr_sz < old_mcr_sz) prune_stack(stack, status);    /* queued nodes may be in non minimal orbits now */
+
+        #ifdef MPI
+        if (mpi_state == NULL) return;  /* not a shared search (batch mode) */
+
+        /**
+         * Send it to the other processes, but only if it joined some orbits.  Everything in our theta
+         * was either sent by us or broadcast to everyone, so if theta didn't change, they'll get
+         * nothing out of this one either.
+         */
+        if (status->mcr_sz < old_mcr_sz) {
+            if (mpi_state->rma_state) mpi_rma_publish_orbits(mpi_state, status->theta);
+            else mpi_queue_new_automorphism(mpi_state, stack, aut);
+        }
+        #endif /* if MPI */
+    } 
+    #ifdef MPI
+    /* if we are running MPI, then we are interested in sending new CL messages*/
+    else if (status->flag_new_cl && mpi_state != NULL) {
+        /* Send message to other processes, or with --rma-state, just the key to the window */
+        if (mpi_state->rma_state) mpi_rma_publish_key(mpi_state, &status->best_key);
+        else mpi_send_new_best_cl(mpi_state, stack, status);
+    }
+    #endif /* if MPI */
+}
+
+#ifdef MPI
+/**
+ * Expands the tree breadth first, a level at a time, until there are at least target nodes on
+ * the stack (or the tree runs out), so mpi_scatter_frontier has something to hand out.  Expanding
+ * the shallowest nodes first keeps the subtrees handed out big.  If the target is reached part
+ * way through a level, the rest of the level stays as it is.
+ */
+static void _expand_frontier(graph *g, int m, int n, BadStack *stack, Status *status, boolean track_autos, MPIState *mpi_state, int target) {
+    while (stack_size(stack) > 0 && stack_size(stack) < target) {
+        /* take the current level off the stack, bottom first */
+        int level_sz = stack_size(stack);
+        PathNode **level = (PathNode**)malloc(sizeof(PathNode*)*level_sz);
+        if (level == NULL) alloc_error("_expand_frontier");
+        for (int i = level_sz - 1; i >= 0; --i) level[i] = stack_pop(stack);
+
+        /* push each node back and process it right away, so its children make up the next level */
+        for (int i = 0; i < level_sz; ++i) {
+            stack_push(stack, level[i]);
+            if (stack_size(stack) + (level_sz - i - 1) < target) {
+                _process_and_report(g, m, n, stack, status, track_autos, mpi_state);
+            }
+        }
+        free(level);
+    }
+    if (__DEBUG_MPI__) printf("MPI: Process %d: initial frontier has %d nodes\n", mpi_state->my_rank, stack_size(stack));
+}
+#endif /* if MPI */
+
 static void _first_node(graph *g, int m, int n, BadStack *stack, Status *status) {
 
     partition *pi = generate_unit_partition(n);
     partition *active = generate_unit_partition(n);
-    partition *new_pi = refine(g, pi, active, m, n);
+    partition *new_pi = refine(g, status->digraph ? status->gt : NULL, pi, active, m, n);
     status->refinement_count++; /* increment refinement variable, as we've executed a refinement */
 
     if (!is_partition_discrete(new_pi)) {
@@ -287,8 +540,30 @@ static void _first_node(graph *g, int m, int n, BadStack *stack, Status *status)
  * This function handles the work to update the cl and best_invar after receiving a new best CL from MPI
  * 
  * This function does NOT take ownership of the path or pi variables passed in, they need to be freed by the current owner!
+ *
+ * The key is usually enough to decide, without building the O(n^2) invariant.  If its leading words
+ * are bigger it's worse, throw it away.  If they are smaller it's better, keep it as pending, and only
+ * build it when we next reach a leaf (or the end), a later better announcement just replaces it.
+ * Only when the leading words tie and the hashes differ do we need the full invariants.
  */
-void mpi_handle_new_best_cononical_label(Status *status, Path *path, partition *pi) {
+void mpi_handle_new_best_cononical_label(Status *status, InvarKey *key, Path *path, partition *pi) {
+    InvarKey *best = NULL;
+    if (status->pending_cl_pi) best = &status->pending_key;
+    else if (status->best_invar) best = &status->best_key;
+
+    int key_cmp = best ? compare_invariant_keys(best, key) : -1;
+    if (key_cmp > 0) return;   /* ours is better */
+    if (key_cmp < 0) {
+        FREEPART(status->pending_cl_pi);    status->pending_cl_pi = copy_partition(pi);
+        FREEPATH(status->pending_cl_path);  status->pending_cl_path = copy_path(path);
+        status->pending_key = *key;
+        return;
+    }
+    if (best->hash == key->hash) return;    /* same label we have */
+
+    /* leading words tie, compare the whole thing */
+    accept_pending_cl(status);
+
     int cmp = 0;  /* used to compare new node with best invariant <1 is better (new CL), 0 is equiv (auto if leaf), >1 worse (throw away)*/
 
     partition *perm = generate_permutation(status->base_pi, pi);
@@ -312,6 +587,7 @@ void mpi_handle_new_best_cononical_label(Status *status, Path *path, partition *
         FREEPART(status->cl_pi);            status->cl_pi = copy_partition(pi);
         FREES(status->best_invar);          status->best_invar = invar;                 /* passing ownership of invar to status */
         FREEPATH(status->best_invar_path);  status->best_invar_path = copy_path(path);    
+        status->best_key = *key;
     } else {
         /* if we don't accept this new CL as best, then we need to free the perm and invar we created */
         FREEPART(perm);
@@ -327,13 +603,32 @@ void mpi_handle_new_best_cononical_label(Status *status, Path *path, partition *
 void mpi_handle_new_automorphism(Status *status, partition *aut) {
     if (!is_automorphism_in_group(status->autogrp, aut)) {
         automorphisms_append(status->autogrp, aut);
-        automorphisms_merge_perm_into_oribit(aut, status->theta);
-        automorphisms_calculate_mcr(status->theta, status->mcr, &status->mcr_sz);
+        automorphisms_merge_perm_into_oribit(aut, status->theta);   /* the caller recalculates the mcr, once per batch */
+    } else {
+        FREEPART(aut);  /* we already have it, and own it */
     }
 }
 #endif /* if MPI */
 
+/**
+ * Makes a pending CL (see mpi_handle_new_best_cononical_label) the current one, building its
+ * invariant.  The pending key already beat ours, so there's nothing to compare.
+ */
+void accept_pending_cl(Status *status) {
+    if (status->pending_cl_pi == NULL) return;
+
+    FREEPART(status->cl);               status->cl = generate_permutation(status->base_pi, status->pending_cl_pi);
+    FREES(status->best_invar);          status->best_invar = calculate_invariant(status->g, status->m, status->n, status->cl);
+    FREEPART(status->cl_pi);            status->cl_pi = status->pending_cl_pi;              /* passing ownership to status */
+    FREEPATH(status->best_invar_path);  status->best_invar_path = status->pending_cl_path;  /* passing ownership to status */
+    status->best_key = status->pending_key;
+    status->pending_cl_pi = NULL;
+    status->pending_cl_path = NULL;
+}
+
 static void _process_leaf(Path *path, partition *pi, Status *status, boolean track_autos) {
+    accept_pending_cl(status);  /* we need the real best invariant to compare against */
+
     int cmp = 0;  /* used to compare new node with best invariant <1 is better (new CL), 0 is equiv (auto if leaf), >1 worse (throw away)*/
 
     partition *perm = generate_permutation(status->base_pi, pi);
@@ -347,6 +642,25 @@ static void _process_leaf(Path *path, partition *pi, Status *status, boolean tra
    
     if (__DEBUG_C__) {printf("C "); visualize_path(DEBUGFILE, path); printf("  Partition:  ");  visualize_partition(DEBUGFILE, pi); printf("  cmp: %d\n\n", cmp);}
 
+    /**
+     * The first leaf is kept too.  The best leaf moves around the tree, but leaves equal to the
+     * first one share its path for longer, and their automorphisms fix more of it, which is what
+     * _stabilizer_orbits needs to prune below the first level.
+     */
+    if (track_autos && status->first_invar == NULL) {
+        if ((status->first_invar = (graph*)ALLOCS(status->n, status->m*sizeof(graph))) == NULL) alloc_error("_process_leaf");
+        memcpy(status->first_invar, invar, sizeof(graph)*status->m*status->n);
+        status->first_pi = copy_partition(pi);
+    } else if (cmp != 0 && track_autos && compare_invariants(status->first_invar, invar, status->m, status->n) == 0) {
+        partition *aut = generate_permutation(status->first_pi, pi);
+        if (aut->sz > 0 && !is_automorphism_in_group(status->autogrp, aut)) {
+            status->flag_new_auto = TRUE;
+            automorphisms_append(status->autogrp, aut);
+        } else {
+            FREEPART(aut);
+        }
+    }
+
     if (cmp < 0) {
         /* New best invariant found! */  /* the mpi_handle_new_best_cononical_label function above should mirror this! */
         status->flag_new_cl = TRUE;
@@ -354,6 +668,7 @@ static void _process_leaf(Path *path, partition *pi, Status *status, boolean tra
         FREEPART(status->cl_pi);            status->cl_pi = copy_partition(pi);
         FREES(status->best_invar);          status->best_invar = invar;
         FREEPATH(status->best_invar_path);  status->best_invar_path = copy_path(path);
+        invariant_key(invar, status->m, status->n, &status->best_key);
     } else if (cmp == 0 && track_autos) {
         /* automorphism found */
         partition *aut = generate_permutation(status->cl_pi, pi);
@@ -373,33 +688,137 @@ static void _process_leaf(Path *path, partition *pi, Status *status, boolean tra
     }
 }
 
+/**
+ * TRUE unless the node is on the first level and the vertex it individualized isn't the minimum
+ * of its orbit any more.  Deeper nodes can only be pruned by automorphisms fixing their path,
+ * _process_next checks them against those when it pushes them (see _stabilizer_orbits).
+ */
+boolean node_in_mcr(Status *status, PathNode *node) {
+    if (node->path->sz > 1) return TRUE;
+    int v = node->path->data[node->path->sz-1];
+    for (int m = 0; m < status->mcr_sz; ++m) {
+        if (status->mcr[m] == v) return TRUE;
+    }
+    return FALSE;
+}
+
+static boolean _keep_node(PathNode *node, void *arg) {
+    return node_in_mcr((Status*)arg, node);
+}
+
+/**
+ * First level nodes are pushed before any automorphisms are known, so after theta grows the
+ * stack can hold ones in non minimal orbits.  Call this when theta changes, to throw them out
+ * before their subtrees get expanded.  One pass costs O(stack size * mcr_sz), and since every change
+ * merges orbits, theta can only change n - 1 times.
+ */
+int prune_stack(BadStack *stack, Status *status) {
+    stack_lock(stack);
+    int removed = stack_filter(stack, _keep_node, status);
+    stack_unlock(stack);
+    if (__DEBUG_X__ && removed) {printf("X Pruned %d queued nodes, mcr(%d)\n", removed, status->mcr_sz);}
+    return removed;
+}
+
+/* pi with v moved out of its cell into a cell of its own, just before the rest of the cell */
+static partition* _individualize(partition *pi, int v) {
+    partition *pi_v = copy_partition(pi);
+    int i = 0;
+    while (pi_v->lab[i] != v) ++i;
+    int start = i;
+    while (start > 0 && pi_v->ptn[start - 1] != 0) --start;
+    pi_v->lab[i] = pi_v->lab[start];
+    pi_v->lab[start] = v;
+    pi_v->ptn[start] = 0;
+    return pi_v;
+}
+
+static int _stabilizer_root(int *parent, int v) {
+    while (parent[v] != v) v = parent[v] = parent[parent[v]];
+    return v;
+}
+
+/**
+ * The orbits of the automorphisms found so far that fix the first depth vertices of path, in
+ * stab_orbits as a forest whose roots are the smallest vertex of each orbit.  Such an
+ * automorphism maps the node at that depth to itself and its children onto each other, so only
+ * the smallest child of each orbit needs searching.  theta's orbits only work on the first
+ * level, an automorphism that moves a path vertex maps the node's subtree to some other node's.
+ */
+static void _stabilizer_orbits(Status *status, Path *path, int depth) {
+    int *parent = status->stab_orbits;
+    for (int v = 0; v < status->n; ++v) parent[v] = v;
+    for (int j = 0; j < depth; ++j) parent[path->data[j]] = -1;     /* marks the path while we look */
+
+    for (size_t k = 0; k < status->autogrp->sz; ++k) {
+        partition *aut = status->autogrp->automorphisms[k];     /* cycles of the vertices it moves */
+        boolean fixes_path = TRUE;
+        for (int i = 0; i < aut->sz && fixes_path; ++i) {
+            if (parent[aut->lab[i]] < 0) fixes_path = FALSE;
+        }
+        if (!fixes_path) continue;
+        for (int i = 0; i < aut->sz - 1; ++i) {
+            if (aut->ptn[i] == 0) continue;     /* end of a cycle */
+            int a = _stabilizer_root(parent, aut->lab[i]), b = _stabilizer_root(parent, aut->lab[i + 1]);
+            if (a < b) parent[b] = a; else parent[a] = b;
+        }
+    }
+    for (int j = 0; j < depth; ++j) parent[path->data[j]] = path->data[j];
+}
+
+/**
+ * FALSE if some vertex of path isn't the smallest of its orbit under the automorphisms fixing
+ * the vertices before it, the node's subtree then maps onto one that was searched, children are
+ * searched smallest first.  So the rest of a subtree is thrown out as soon as one of its leaves
+ * turns out to be equivalent to an earlier one.
+ */
+static boolean _path_is_minimal(Status *status, Path *path) {
+    if (status->autogrp->sz == 0) return TRUE;
+    for (int depth = 0; depth < path->sz; ++depth) {
+        _stabilizer_orbits(status, path, depth);
+        if (_stabilizer_root(status->stab_orbits, path->data[depth]) != path->data[depth]) return FALSE;
+    }
+    return TRUE;
+}
+
+static int _compare_vertices(const void *a, const void *b) {
+    return *(const int*)a - *(const int*)b;
+}
+
 static void _process_next(graph *g, int m, int n, BadStack *stack, Status *status, boolean track_autos) {
+    stack_lock(stack);
     PathNode *node = stack_pop(stack);
+    stack_unlock(stack);
+    if (node == NULL) return;   /* the progress thread gave the last of it away */
+    int v = node->path->data[node->path->sz-1];
+
+    /* it was pushed before the automorphisms found since, check again */
+    if (!_path_is_minimal(status, node->path)) {
+        if (__DEBUG_X__) {printf("X "); visualize_path(DEBUGFILE, node->path); printf(" Pruned when popped\n");}
+        FREEPATHNODE(node);
+        return;
+    }
+
     /**
-     * Creating the active set of cells to refine against
+     * Individualize the node's vertex, then refine with its cell as the only splitter
      */
     partition *active;
-    DYNALLOCPART(active, n, "process");  //certainly not right, no need to make it this big for reals!!
-    active->lab[0] = node->path->data[node->path->sz-1];
+    DYNALLOCPART(active, 1, "process");
+    active->lab[0] = v;
     active->ptn[0] = 0;
-    active->sz = 1;
+    partition *pi_v = _individualize(node->pi, v);
 
     /**
      * 
      * Refinement to create new partition is being done here.
      * 
      */
-    partition *new_pi = refine(g, node->pi, active, m, n);
+    partition *new_pi = refine(g, status->digraph ? status->gt : NULL, pi_v, active, m, n);
     status->refinement_count++; /* increment refinement variable, as we've executed a refinement */
+    FREEPART(pi_v);
 
     if (__DEBUG_P__) {printf("P "); visualize_path(DEBUGFILE, node->path);  printf("  pi: ");  visualize_partition(DEBUGFILE, new_pi);  printf("  active: ");  visualize_partition(DEBUGFILE, active); ENDL();}
 
-    if (partitions_are_equal(new_pi, node->pi)) {
-        if (__DEBUG_P__) {printf("P - Refine didn't split partition, running refine_special\n");}
-        FREEPART(new_pi);
-        new_pi = _refine_special(g, node->pi, active, m, n);
-    }
-
 
     /**
      * New partion means new work list, if it is not discrete
@@ -410,15 +829,11 @@ static void _process_next(graph *g, int m, int n, BadStack *stack, Status *statu
         /* if it is not discrete, add the child nodes, in proper order to the stack */
         int cell, cell_sz;
         get_partition_cell_by_index(new_pi, &cell, &cell_sz, _target_cell(new_pi));
+        qsort(new_pi->lab + cell, cell_sz, sizeof(int), _compare_vertices);    /* smallest is searched first */
+        _stabilizer_orbits(status, node->path, node->path->sz);
+        stack_lock(stack);
         for (int i = cell+cell_sz-1; i >= cell; --i) {
-            boolean in_mcrs = FALSE;
-            for (int m = 0; m < status->mcr_sz; ++m) {
-                if (new_pi->lab[i] == status->mcr[m]) {
-                    in_mcrs = TRUE;
-                    break;
-                }
-            }
-            if (in_mcrs) {
+            if (_stabilizer_root(status->stab_orbits, new_pi->lab[i]) == new_pi->lab[i]) {
                 PathNode *next;
                 DYNALLOCPATHNODE(next, "process");
                 DYNALLOCPATH(next->path, node->path->sz+1, "process");
@@ -429,118 +844,145 @@ static void _process_next(graph *g, int m, int n, BadStack *stack, Status *statu
                 next->pi = copy_partition(new_pi);
                 stack_push(stack, next);
             } else {
-                if (__DEBUG_X__) {printf("X "); visualize_path(DEBUGFILE, node->path); printf(" Pruned %d from tree   pi: ", new_pi->lab[i]); visualize_partition(DEBUGFILE, node->pi); printf("  theta: "); visualize_partition(DEBUGFILE, status->theta);
-                    printf("   mcr(%d):", status->mcr_sz); for (int x = 0; x < status->mcr_sz; ++x) printf(" %d", status->mcr[x]); ENDL();}
+                if (__DEBUG_X__) {printf("X "); visualize_path(DEBUGFILE, node->path); printf(" Pruned %d from tree   pi: ", new_pi->lab[i]); visualize_partition(DEBUGFILE, node->pi); ENDL();}
             }
         }
+        stack_unlock(stack);
     }
     FREEPART(new_pi);
     FREEPART(active);
     FREEPATHNODE(node);
 }
 
-partition* refine(graph *g, partition *pi, partition *active, int m, int n){
-    partition *pi_hat = copy_partition(pi);
-    partition *alpha = copy_partition(active);
-    int a = 0;
-
-    if (__DEBUG_R__) {printf("pi: "); visualize_partition(DEBUGFILE, pi_hat); printf(" alpha: "); visualize_partition(DEBUGFILE, alpha); ENDL();}
-    while (a < partition_cell_count(alpha) && !is_partition_discrete(pi_hat)) {
-        int scope_idx, scope_sz;  // refinement scope cell index in alpha, and size of cell
-        get_partition_cell_by_index(alpha, &scope_idx, &scope_sz, a);
-        if (__DEBUG_R__) {printf("\n\n\nStarting Outer Loop:  pi_hat: "); visualize_partition(DEBUGFILE, pi_hat); printf("  alpha "); visualize_partition(DEBUGFILE, alpha); printf(", a %d, refine_cell %d   refine_cell_sz %d\n", a, scope_idx, scope_sz);}
-        int p = 0;
-        while (p < partition_cell_count(pi_hat)){
-
-            int alpha_idx = get_index_of_cell_from_another_partition(alpha, pi_hat, p);  // index in alpha or -1 if not there, of the cell we are partitioning (used lower)
-
-            int cell, cell_sz;  // current cell we are partitioning, was V/V_k in the paper
-            get_partition_cell_by_index(pi_hat, &cell, &cell_sz, p);
-
-            if (__DEBUG_R__) {printf("\n\tPre Partitioning by Scoped Degree\n");}
-            if (__DEBUG_R__) {printf("\tpi_hat: "); visualize_partition(DEBUGFILE, pi_hat); printf("  p: %d  (cell, cell_sz): (%d, %d)\n",p, cell, cell_sz);}
-            if (__DEBUG_R__) {printf("\talpha: "); visualize_partition(DEBUGFILE, alpha); printf("  a: %d,  (scope_idx, scope_sz): (%d, %d)\n", a, scope_idx, scope_sz );}
-            
-            _partition_by_scoped_degree(g, pi_hat, cell, cell_sz, alpha, scope_idx, scope_sz, m, n);
-            
-            if (__DEBUG_R__) {printf("\tPost Partitioning by Scoped Degree\n");}
-            if (__DEBUG_R__) {printf("\tpi_hat: "); visualize_partition(DEBUGFILE, pi_hat); printf("  p: %d  (cell, cell_sz): (%d, %d)\n",p, cell, cell_sz);}
-            
-            int new_cell_size = partial_partition_cell_count(pi_hat, cell, cell_sz);  // new size of cell that was partitioned
-            if (new_cell_size ==1) ++p;
-            else {
-                int t = first_index_of_max_cell_size_of_partition(pi_hat, p, p+new_cell_size);
-                if (__DEBUG_R__) {printf("\tt: %d\n", t);}
-                
-                if (alpha_idx > -1){
-                    if (__DEBUG_R__) printf("\tNeed to copy: \n");
-                    if (__DEBUG_R__) {printf("\t\tSRC: pi_hat: "); visualize_partition(DEBUGFILE, pi_hat); printf("  index t: %d  \n", t);}
-                    if (__DEBUG_R__) {printf("\t\tDST: alpha: "); visualize_partition(DEBUGFILE, alpha); printf("  index alpha_idx: %d\n", alpha_idx );}
-                    overwrite_partion_cell_with_cell_from_another_partition(pi_hat, t, alpha, alpha_idx);
-                    if (__DEBUG_R__) printf("\tPOST copy: \n");
-                    if (__DEBUG_R__) {printf("\t\tSRC: pi_hat: "); visualize_partition(DEBUGFILE, pi_hat); ENDL();}
-                    if (__DEBUG_R__) {printf("\t\tDST: alpha: "); visualize_partition(DEBUGFILE, alpha); ENDL();}
-
-                    for (int i = p; i < p + new_cell_size; ++i){
-                        if (i != t){
-                            if (__DEBUG_R__) printf("\n\tNeed to append: \n");
-                            if (__DEBUG_R__) {printf("\t\tSRC: pi_hat: "); visualize_partition(DEBUGFILE, pi_hat); printf("  index i: %d  \n", i);}
-                            if (__DEBUG_R__) {printf("\t\tDST: alpha: "); visualize_partition(DEBUGFILE, alpha); ENDL();}
-                            append_cell_to_partition_from_another_partition(pi_hat, i, alpha);
-                            if (__DEBUG_R__) printf("\tPOST append: \n");
-                            if (__DEBUG_R__) {printf("\t\tSRC: pi_hat: "); visualize_partition(DEBUGFILE, pi_hat); ENDL();}
-                            if (__DEBUG_R__) {printf("\t\tDST: alpha: "); visualize_partition(DEBUGFILE, alpha); ENDL();}
-
-                        }
-                    }
-                } else {
-                    for (int i = p; i < p + new_cell_size; ++i){
-                            if (__DEBUG_R__) printf("\n\tNeed to append: \n");
-                            if (__DEBUG_R__) {printf("\t\tSRC: pi_hat: "); visualize_partition(DEBUGFILE, pi_hat); printf("  index i: %d  \n", i);}
-                            if (__DEBUG_R__) {printf("\t\tDST: alpha: "); visualize_partition(DEBUGFILE, alpha); ENDL();}
-                            append_cell_to_partition_from_another_partition(pi_hat, i, alpha);
-                            if (__DEBUG_R__) printf("\tPOST append: \n");
-                            if (__DEBUG_R__) {printf("\t\tSRC: pi_hat: "); visualize_partition(DEBUGFILE, pi_hat); ENDL();}
-                            if (__DEBUG_R__) {printf("\t\tDST: alpha: "); visualize_partition(DEBUGFILE, alpha); ENDL();}
-                    }                    
-                }
-            }
-        }
-        ++a;
+/* the number of v's neighbours in scope */
+static int _scoped_degree(graph *g, set *scope, int v, int m){
+    set *gi = GRAPHROW(g, v, m);
+    int degree = 0;
+    for (int i = 0; i < m; ++i) degree += __builtin_popcountl(gi[i] & scope[i]);
+    return degree;
+}
 
-    }
-    if (__DEBUG_R__) {printf("\n\nFinal pi_hat: "); visualize_partition(DEBUGFILE, pi_hat); ENDL();}
-    
-    FREEPART(alpha);
-    return pi_hat;
+
+/**
+ * Needed for the parallel sort (not parallel processing, permutating two arrays based on sorting of the first array)
+ */
+#define SORT_TYPE1 int
+#define SORT_TYPE2 int
+#define SORT_OF_SORT 2
+#define SORT_NAME sortparallel
+#include "mckay_sorttemplates.c"
+/** */
+
+/* the position one past the end of the cell starting at start */
+static int _cell_end(partition *pi, int start) {
+    int i = start;
+    while (pi->ptn[i] != 0) ++i;
+    return i + 1;
 }
 
-static partition* _refine_special(graph *g, partition *pi, partition *active, int m, int n){
+/**
+ * refine's scratch, grown as needed and kept from call to call, one per thread.  It is the same
+ * few arrays at every node, and a search abandoned part way by an error trap doesn't lose them.
+ */
+static _Thread_local int *refine_work;         /* queue, queued and key, sz ints each, then pos, n */
+static _Thread_local size_t refine_work_sz = 0;
+static _Thread_local set *refine_splitter;
+static _Thread_local size_t refine_splitter_sz = 0;
+
+/**
+ * Refines pi until it is equitable, every vertex of a cell has the same number of neighbours in
+ * every other cell.  The splitters start as the cells of pi holding active's cells.  Each cell
+ * is split by the number of neighbours its vertices have in the splitter, pieces in increasing
+ * order, and the pieces go on the queue, all of them if the cell was already waiting there, or
+ * all but the first biggest one if it wasn't.
+ *
+ * Cells are known by where they start, never by their vertex numbers or the order inside them,
+ * so pi_hat only depends on pi as an ordered partition of sets.  Relabelling the graph relabels
+ * every partition in the tree the same way, which is what makes the best leaf canonical.
+ *
+ * gt is the transpose of a digraph g, NULL for an undirected graph, cells are then split by out
+ * degree, then in degree.
+ */
+partition* refine(graph *g, graph *gt, partition *pi, partition *active, int m, int n){
+    int sz = pi->sz;
+    DYNALLOC1(int, refine_work, refine_work_sz, 3 * (size_t)sz + n, "refine");
+    DYNALLOC1(setword, refine_splitter, refine_splitter_sz, m, "refine");
+    int *queue = refine_work;           /* cell starts waiting to split, a ring */
+    boolean *queued = refine_work + sz;
+    int *key = refine_work + 2 * sz;
+    int *pos = refine_work + 3 * sz;
+    set *splitter = refine_splitter;
+    memset(queued, 0, sizeof(boolean)*sz);
     partition *pi_hat = copy_partition(pi);
-    if (active->sz != 1) {
-        if (__DEBUG_RS__) {printf("RS - Unknown state, active is not singular: "); visualize_partition(DEBUGFILE, active); ENDL();}
-        return pi_hat;
-    }
-
-    if (__DEBUG_RS__) {printf("RS pi: "); visualize_partition(DEBUGFILE, pi_hat); printf(" alpha: "); visualize_partition(DEBUGFILE, active); ENDL();}
-    for (int i = 0; i < pi_hat->sz; ++i) {
-        if (pi_hat->lab[i] == active->lab[0]) {
-            if (pi_hat->ptn[i] != 1) {
-                /* if ptn[i] is not 1, then this is the end of the cell ptn[i-1] should be 1 and we can change it to 0*/
-                if(pi_hat->ptn[i-1] == 1) {
-                    pi_hat->ptn[i-1] = 0;
-                    break;
-                } else {
-                    /* error state, this alpha seems to be in a singular cell*/
-                    if (__DEBUG_RS__) {printf("RS - Unknown state, alpha vertex seems to be in singular cell, i: %d\n", i);}
+    int head = 0, count = 0;
+
+    /* the cells of pi_hat holding active's cells */
+    for (int i = 0; i < sz; ++i) pos[pi_hat->lab[i]] = i;
+    for (int i = 0; i < active->sz; ++i) {
+        if (i > 0 && active->ptn[i - 1] != 0) continue;     /* first vertex of each active cell */
+        int start = pos[active->lab[i]];
+        while (start > 0 && pi_hat->ptn[start - 1] != 0) --start;
+        if (!queued[start]) {
+            queued[start] = TRUE;
+            queue[(head + count++) % sz] = start;
+        }
+    }
+
+    if (__DEBUG_R__) {printf("pi: "); visualize_partition(DEBUGFILE, pi_hat); printf(" active: "); visualize_partition(DEBUGFILE, active); ENDL();}
+    while (count > 0 && !is_partition_discrete(pi_hat)) {
+        int w = queue[head];
+        head = (head + 1) % sz;
+        --count;
+        queued[w] = FALSE;
+
+        /* the splitter's vertices as it is now, splitting it below doesn't change them */
+        EMPTYSET(splitter, m);
+        int w_end = _cell_end(pi_hat, w);
+        for (int i = w; i < w_end; ++i) ADDELEMENT(splitter, pi_hat->lab[i]);
+        if (__DEBUG_R__) {printf("R splitter at %d (%d vertices)  pi_hat: ", w, w_end - w); visualize_partition(DEBUGFILE, pi_hat); ENDL();}
+
+        for (int cell = 0; cell < sz; ) {
+            int cell_end = _cell_end(pi_hat, cell);
+            if (cell_end - cell == 1) {
+                cell = cell_end;
+                continue;
+            }
+
+            boolean split = FALSE;
+            for (int i = cell; i < cell_end; ++i) {
+                key[i] = _scoped_degree(g, splitter, pi_hat->lab[i], m);
+                if (gt) key[i] = key[i] * (w_end - w + 1) + _scoped_degree(gt, splitter, pi_hat->lab[i], m);     /* out degree, then in degree */
+                if (key[i] != key[cell]) split = TRUE;
+            }
+            if (!split) {
+                cell = cell_end;
+                continue;
+            }
+
+            sortparallel(key + cell, pi_hat->lab + cell, cell_end - cell);
+            int biggest = cell, biggest_sz = 0;
+            for (int piece = cell; piece < cell_end; ) {
+                int piece_end = piece + 1;
+                while (piece_end < cell_end && key[piece_end] == key[piece]) ++piece_end;
+                for (int i = piece; i < piece_end; ++i) pi_hat->ptn[i] = i < piece_end - 1 ? 1 : 0;
+                if (piece_end - piece > biggest_sz) {
+                    biggest = piece;
+                    biggest_sz = piece_end - piece;
                 }
-            } else {
-                pi_hat->ptn[i] = 0;
-                break;
+                piece = piece_end;
+            }
+
+            /* a queued cell keeps its place, the first piece is still it */
+            boolean was_queued = queued[cell];
+            for (int piece = cell; piece < cell_end; piece = _cell_end(pi_hat, piece)) {
+                if (queued[piece] || (!was_queued && piece == biggest)) continue;
+                queued[piece] = TRUE;
+                queue[(head + count++) % sz] = piece;
             }
+            cell = cell_end;
         }
     }
-    if (__DEBUG_RS__) {printf("RS Refined to: "); visualize_partition(DEBUGFILE, pi_hat); ENDL();}
+    if (__DEBUG_R__) {printf("\n\nFinal pi_hat: "); visualize_partition(DEBUGFILE, pi_hat); ENDL();}
     return pi_hat;
 }
 
@@ -593,73 +1035,7 @@ static int _target_cell(partition *pi){
     return smallest_idx;
  }
 
-/**
- * Returns the degree of vertex v with respect to the verticies in scope
- * parameters:
- *      G       the graph's adjacency matrix
- *      scope   the scope of vertices with which to calculate the degree
- *      v       the vertex on which we are calculating the degree
- *      m       the number of setwords per row in the graphwi
- *      n       the number of vertices
- * 
- * returns an integer value of the degree of v with respect to scope over graph G
- */
-static int _scoped_degree(graph *g, partition *alpha, int scope_idx, int scope_sz, int v, int m, int n){
-    set *gi = (set*)g + (m*v);
-    int degree = 0;
-    for (int i = scope_idx; i < scope_idx+scope_sz; ++i){
-        if (ISELEMENT(gi, alpha->lab[i])) ++degree;
-    }
-    return degree;
-}
-
-
-/**
- * Needed for the parallel sort (not parallel processing, permutating two arrays based on sorting of the first array)
- */
-#define SORT_TYPE1 int
-#define SORT_TYPE2 int
-#define SORT_OF_SORT 2
-#define SORT_NAME sortparallel
-#include "mckay_sorttemplates.c"
-/** */
-
-/**
- * splits (partitions) cell into a smaller cells, grouped by their scoped degree
- * with respect to scope, and numerically sorted by the value of their degree
- * 
- * parameters:
- *      G       the graph's adjacency matrix
- *      scope   the scope of vertices with which to calculate the degree
- *      cell    the cell we are splitting
- * 
- * returns a list containing the new cells
- */
-static void _partition_by_scoped_degree(graph *g, partition *pi, int cell, int cell_sz, partition *alpha, int scope_idx, int scope_sz, int m, int n){
-    partition *cell_sort;
-    DYNALLOCPART(cell_sort, cell_sz, "partition_by_scoped_degre");
-
-    for (int i = 0; i < cell_sz; ++i){
-        cell_sort->lab[i] = pi->lab[cell+i];
-        cell_sort->ptn[i] = _scoped_degree(g, alpha, scope_idx, scope_sz, cell_sort->lab[i], m, n);
-    }
-
-    sortparallel(cell_sort->ptn, cell_sort->lab, cell_sort->sz);
-
-    for (int i = 0; i < cell_sz; ++i){
-        pi->lab[cell+i] = cell_sort->lab[i];
-        if (i < cell_sz-1 && cell_sort->ptn[i] == cell_sort->ptn[i+1]){
-            pi->ptn[cell+i] = 1;
-        } else {
-            pi->ptn[cell+i] = 0;
-        }
-    }
-
-    FREEPART(cell_sort);
-}
-
-
-static void log_output_to_file(char *filename, int refines, int auto_sz, double runtime, int num_procs) {
+void log_output_to_file(char *filename, int refines, int auto_sz, double runtime, int num_procs) {
     struct timespec ts;
     // get_timespec(&ts);
     clock_gettime(CLOCK_REALTIME, &ts);
@@ -24,22 +24,36 @@
 #include "automorphismgroup.h"
 #include "badstack.h"
 #include "path.h"
+#include "options.h"
+#include "graphmap.h"
 
 
 typedef struct {
     graph *g;                   /* the graph */
     int m;                      /* number of setwords per row in graph */
     int n;                      /* number of elements in the graph */
+    boolean digraph;            /* g is directed, the rows are out neighbours */
+    graph *gt;                  /* transpose of g, the in neighbours, only for a digraph */
+    size_t gt_sz;               /* words allocated for gt, kept from graph to graph */
     partition *base_pi;         /* base partition */
     partition *cl;              /* current best canonical label */
     partition *cl_pi;           /* current best canonical label's partition */
     graph *best_invar;          /* current best invariant */
     Path *best_invar_path;      /* current best invariant path */
+    InvarKey best_key;          /* key of best_invar, what we announce to other processes */
+
+    partition *pending_cl_pi;   /* better CL announced by another process, best_invar isn't built from it yet, NULL if none */
+    Path *pending_cl_path;      /* its path */
+    InvarKey pending_key;       /* its key */
+
+    graph *first_invar;         /* invariant of the first leaf this process reached */
+    partition *first_pi;        /* its partition */
 
     AutomorphismGroup *autogrp; /* Automorphism Group */
     partition *theta;           /* Orbits of automorphism Group */
     int *mcr;                   /* Minimum Cell Representation of theta */
     int mcr_sz;                 /* Number of elements in mcr */
+    int *stab_orbits;           /* orbits of the automorphisms fixing the path being expanded, n words */
 
     boolean flag_new_cl;        /* Flag to indicate a new vest invariant found */
     boolean flag_new_auto;      /* Flag to indicate a new automorphism was found */
@@ -49,15 +63,20 @@ typedef struct {
 
 
 
-#ifdef MPI
-void run(graph *g, int m, int n, boolean track_autos, char* infilename, int argc, char** argv);
-#else /* if MPI */
-void run(graph *g, int m, int n, boolean track_autos, char* infilename);
-#endif /* if MPI */
+void run(graph *g, int m, int n, boolean digraph, boolean track_autos, char* infilename, Options *opts);
+void run_batch(GraphMap *map, char *infilename, FILE *outfile, Options *opts);
+void canonicalize(Status *status, BadStack *stack, graph *g, int m, int n, boolean digraph);
+Status *status_new();
+void status_reset(Status *status, graph *g, int m, int n, boolean digraph);
+void status_free(Status *status);
+void log_output_to_file(char *filename, int refines, int auto_sz, double runtime, int num_procs);
 
-partition* refine(graph *G, partition *pi, partition *active, int m, int n);
+partition* refine(graph *G, graph *Gt, partition *pi, partition *active, int m, int n);
+boolean node_in_mcr(Status *status, PathNode *node);
+int prune_stack(BadStack *stack, Status *status);
 
-void mpi_handle_new_best_cononical_label(Status *status, Path *path, partition *pi);
+void mpi_handle_new_best_cononical_label(Status *status, InvarKey *key, Path *path, partition *pi);
+void accept_pending_cl(Status *status);
 void mpi_handle_new_automorphism(Status *status, partition *aut);
 
 #endif /* _PCANNON_H_ */
\ No newline at end of file
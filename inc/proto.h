@@ -113,13 +113,15 @@ static const setword bit[] =
         type *name; size_t name_sz=0
 #define DYNALLOC1(type,name,name_sz,sz,msg) \
  if ((size_t)(sz) > name_sz) \
- { if (name_sz) FREES(name); name_sz = (sz); \
- if ((name=(type*)ALLOCS(sz,sizeof(type))) == NULL) {alloc_error(msg);}}
+ { if (name_sz) FREES(name); name_sz = 0; \
+ if ((name=(type*)ALLOCS(sz,sizeof(type))) == NULL) {alloc_error(msg);} \
+ name_sz = (sz);}
 #define DYNALLOC2(type,name,name_sz,sz1,sz2,msg) \
  if ((size_t)(sz1)*(size_t)(sz2) > name_sz) \
- { if (name_sz) FREES(name); name_sz = (size_t)(sz1)*(size_t)(sz2); \
+ { if (name_sz) FREES(name); name_sz = 0; \
  if ((name=(type*)ALLOCS((sz1),(sz2)*sizeof(type))) == NULL) \
- {alloc_error(msg);}}
+ {alloc_error(msg);} \
+ name_sz = (size_t)(sz1)*(size_t)(sz2);}
 #define DYNREALLOC(type,name,name_sz,sz,msg) \
  {if ((size_t)(sz) > name_sz) \
  { if ((name = (type*)REALLOCS(name,(sz)*sizeof(type))) == NULL) \
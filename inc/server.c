@@ -0,0 +1,253 @@
+/**
+ * Copyright 2025 Jim Haslett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "server.h"
+#include "graphmap.h"
+#include "p_util.h"
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+
+static void _worker_init(ServerWorker *w, Server *server) {
+    memset(w, 0, sizeof(ServerWorker));
+    w->server = server;
+    if ((w->ctx = pcanon_new(64)) == NULL) alloc_error("server _worker_init");
+    graphwriter_init(&w->out, server->output_format);
+    w->allocated_sz = SERVER_READ_BUFFER;
+    if ((w->in = (char*)malloc(w->allocated_sz)) == NULL) alloc_error("server _worker_init");
+}
+
+static void _answer_error(ServerWorker *w, const char *why) {
+    graphwriter_append(&w->out, "!", 1);
+    graphwriter_append(&w->out, why, strlen(why));
+    graphwriter_append(&w->out, "\n", 1);
+}
+
+/* answers the request line, len bytes without its newline, into w->out */
+static void _answer(ServerWorker *w, char *line, size_t len) {
+    int m, n;
+    boolean digraph;
+    char *why;
+
+    if (len > 0 && line[len - 1] == '\r') --len;
+    if (len == 0) return;   /* blank lines get no answer */
+
+    /* a request too big for memory is refused, it doesn't take the server down */
+    jmp_buf trap, *outer = error_trap;
+    if (setjmp(trap) != 0) {
+        error_trap = outer;
+        _answer_error(w, "out of memory");
+        return;
+    }
+    error_trap = &trap;
+    graph *g = graphmap_decode_line(line, len, SERVER_MAX_N, &w->g, &w->g_sz, &m, &n, &digraph, &why);
+    error_trap = outer;
+
+    if (g == NULL) {
+        _answer_error(w, why);
+    } else if (n == 0) {
+        graphwriter_encode(&w->out, g, m, n, digraph);   /* nothing to search */
+    } else {
+        pcanon_options opts = {digraph};
+        int rc = pcanon_canonicalize(w->ctx, g, m, n, &opts, NULL, NULL);
+        if (rc == PCANON_OK) graphwriter_encode(&w->out, pcanon_canonical_graph(w->ctx), m, n, digraph);
+        else _answer_error(w, rc == PCANON_ENOMEM ? "out of memory" : "search failed");
+    }
+}
+
+/* sends everything waiting in w->out, FALSE if the client has gone */
+static boolean _send(ServerWorker *w, int fd) {
+    char *p = w->out.buf;
+    size_t left = w->out.sz;
+    w->out.sz = 0;
+    while (left > 0) {
+        ssize_t k = write(fd, p, left);
+        if (k < 0 && errno == EINTR) continue;
+        if (k <= 0) return FALSE;
+        p += k;
+        left -= (size_t)k;
+    }
+    return TRUE;
+}
+
+/**
+ * Answers requests from in on out until in ends.  Every read is followed by answers to all the
+ * whole lines it completed, in one write, and what is left of a line is kept for the next read.
+ * A line longer than SERVER_MAX_LINE, or one there isn't the memory to hold, is answered with
+ * an error and the connection dropped, there is no telling where the next request starts.
+ */
+static void _serve_connection(ServerWorker *w, int in, int out) {
+    size_t searched = 0;    /* bytes at the start of w->in known to have no newline */
+    boolean ended = FALSE;  /* in ended, rather than the connection being dropped */
+    w->in_sz = 0;
+
+    while (1) {
+        if (w->in_sz == w->allocated_sz) {
+            char *grown = NULL;
+            if (w->allocated_sz <= SERVER_MAX_LINE) grown = (char*)realloc(w->in, w->allocated_sz * 2);
+            if (grown == NULL) {
+                _answer_error(w, w->allocated_sz > SERVER_MAX_LINE ? "line too long" : "out of memory");
+                _send(w, out);
+                break;
+            }
+            w->in = grown;
+            w->allocated_sz *= 2;
+        }
+        ssize_t k = read(in, w->in + w->in_sz, w->allocated_sz - w->in_sz);
+        if (k < 0 && errno == EINTR) continue;
+        if (k <= 0) {
+            ended = TRUE;
+            break;
+        }
+        w->in_sz += (size_t)k;
+
+        char *p = w->in, *from = w->in + searched, *end = w->in + w->in_sz, *nl;
+        while ((nl = memchr(from, '\n', end - from)) != NULL) {
+            _answer(w, p, (size_t)(nl - p));
+            p = from = nl + 1;
+        }
+        w->in_sz = (size_t)(end - p);
+        memmove(w->in, p, w->in_sz);
+        searched = w->in_sz;
+        if (!_send(w, out)) break;
+    }
+    if (ended) {
+        _answer(w, w->in, w->in_sz);    /* the last line may not have a newline */
+        _send(w, out);
+    }
+
+    /* one huge request doesn't keep its buffer for the rest of the worker's life */
+    if (w->allocated_sz > SERVER_READ_BUFFER) {
+        char *shrunk = (char*)realloc(w->in, SERVER_READ_BUFFER);
+        if (shrunk != NULL) {
+            w->in = shrunk;
+            w->allocated_sz = SERVER_READ_BUFFER;
+        }
+    }
+}
+
+/* worker thread, takes connections off the ring and serves each until its client hangs up */
+static void *_worker(void *arg) {
+    ServerWorker *w = (ServerWorker*)arg;
+    Server *server = w->server;
+    while (1) {
+        pthread_mutex_lock(&server->lock);
+        while (server->count == 0) pthread_cond_wait(&server->ready, &server->lock);
+        int fd = server->pending[server->head];
+        server->head = (server->head + 1) % server->allocated_sz;
+        --server->count;
+        pthread_mutex_unlock(&server->lock);
+
+        _serve_connection(w, fd, fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+/* puts an accepted connection on the ring for the next free worker, growing the ring if it's full */
+static void _queue_connection(Server *server, int fd) {
+    pthread_mutex_lock(&server->lock);
+    if (server->count == server->allocated_sz) {
+        int grown_sz = server->allocated_sz ? server->allocated_sz * 2 : 16;
+        int *grown = (int*)malloc(sizeof(int)*grown_sz);
+        if (grown == NULL) alloc_error("server _queue_connection");
+        for (int i = 0; i < server->count; ++i) grown[i] = server->pending[(server->head + i) % server->allocated_sz];
+        FREES(server->pending);
+        server->pending = grown;
+        server->head = 0;
+        server->allocated_sz = grown_sz;
+    }
+    server->pending[(server->head + server->count) % server->allocated_sz] = fd;
+    ++server->count;
+    pthread_cond_signal(&server->ready);
+    pthread_mutex_unlock(&server->lock);
+}
+
+/* a socket listening on path, a socket left there by an earlier server is replaced */
+static int _listen(char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        printf("--serve socket path %s is too long\n", path);
+        exit(1);
+    }
+    strcpy(addr.sun_path, path);
+
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, SERVER_BACKLOG) < 0) {
+        printf("Can't listen on %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    return fd;
+}
+
+
+/**
+ * --serve=PATH, answers requests until it is killed, or with --serve=- until stdin ends.  Never
+ * returns for a socket.
+ */
+void run_server(Options *opts) {
+    if (opts->output_format == OUTPUT_BINARY) {
+        printf("--serve answers in graph6 or sparse6 lines, not binary\n");
+        exit(1);
+    }
+    signal(SIGPIPE, SIG_IGN);   /* a client hanging up is a failed write, not the end of the server */
+
+    Server server;
+    memset(&server, 0, sizeof(server));
+    server.output_format = opts->output_format;
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_cond_init(&server.ready, NULL);
+
+    if (strcmp(opts->serve_path, "-") == 0) {
+        ServerWorker w;
+        _worker_init(&w, &server);
+        _serve_connection(&w, STDIN_FILENO, STDOUT_FILENO);
+        pcanon_free(w.ctx);
+        graphwriter_free(&w.out);
+        FREES(w.g);
+        free(w.in);
+        return;
+    }
+
+    int listen_fd = _listen(opts->serve_path);
+    int num_workers = opts->threads < 1 ? 1 : opts->threads;
+    ServerWorker *workers = (ServerWorker*)malloc(sizeof(ServerWorker)*num_workers);
+    if (workers == NULL) alloc_error("run_server");
+    for (int i = 0; i < num_workers; ++i) {
+        pthread_t tid;
+        _worker_init(&workers[i], &server);
+        if (pthread_create(&tid, NULL, _worker, &workers[i]) != 0) runtime_error("run_server: pthread_create failed");
+        pthread_detach(tid);
+    }
+    fprintf(stderr, "Serving on %s with %d threads\n", opts->serve_path, num_workers);
+
+    while (1) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            runtime_error("run_server: accept failed");
+        }
+        _queue_connection(&server, fd);
+    }
+}
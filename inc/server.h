@@ -0,0 +1,76 @@
+/**
+ * Copyright 2025 Jim Haslett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * --serve=PATH, a long running canonicalization server on a UNIX domain socket, or on stdin and
+ * stdout with --serve=-.  Starting a process and parsing its file costs more than searching a
+ * graph of a few dozen vertices, so the server starts once and keeps --threads=N workers, each
+ * with a warm libpcanon context, decode buffer and output buffer, from request to request.
+ *
+ * The protocol is lines both ways.  A request is a graph6, sparse6 or digraph6 line, and its
+ * response is a line with the canonical graph in --output-format (graph6 or sparse6, digraph6
+ * for digraphs), or a line starting with '!' and saying what was wrong with the request.  Blank
+ * lines are skipped.  Responses come back in request order, one per request.  Requests can be
+ * pipelined: a worker answers every whole line it has read and sends all the answers with one
+ * write, so a batch written at once costs one round trip.  A client sending a big batch has to
+ * read the answers as they come, or both ends can fill their socket buffers and wait forever.
+ *
+ * Each connection is served by one worker from start to end, connections beyond --threads wait
+ * until a worker is free.
+ */
+
+#ifndef _SERVER_H_
+#define _SERVER_H_
+
+#include "proto.h"
+#include "options.h"
+#include "graphwriter.h"
+#include "libpcanon.h"
+#include "p_gtools.h"
+#include <pthread.h>
+
+#define SERVER_MAX_N 65536                  /* bigger requests are refused, not allocated */
+#define SERVER_READ_BUFFER (64 * 1024)      /* starting size, it grows to hold the longest line */
+#define SERVER_MAX_LINE (D6LEN(SERVER_MAX_N) + 1)   /* a digraph6 line and a \r, no request is longer */
+#define SERVER_BACKLOG 64
+
+
+typedef struct {
+    int output_format;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    int *pending;                   /* accepted connections no worker has taken yet, a ring */
+    int head;
+    int count;
+    int allocated_sz;
+} Server;
+
+/* one worker thread, everything it keeps between requests */
+typedef struct {
+    pcanon_ctx *ctx;
+    graph *g;                       /* the request being answered */
+    size_t g_sz;
+    GraphWriter out;                /* answers not sent yet */
+    char *in;                       /* bytes read and not answered yet, the start of a line */
+    size_t in_sz;
+    size_t allocated_sz;
+    Server *server;
+} ServerWorker;
+
+
+void run_server(Options *opts);
+
+#endif /* _SERVER_H_ */
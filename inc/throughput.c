@@ -0,0 +1,169 @@
+/**
+ * Copyright 2025 Jim Haslett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "throughput.h"
+#include "p_gtools.h"
+
+
+/**
+ * Worker thread, with its own Status, stack and graph buffer, reused for every graph it gets.
+ * It takes the next chunk unless the writer is a whole window behind, so memory stays bounded
+ * however big the file is.
+ */
+static void *_worker(void *arg) {
+    Throughput *tp = (Throughput*)arg;
+    BadStack *stack = malloc(sizeof(BadStack));
+    if (stack == NULL) alloc_error("throughput _worker");
+    stack_initialize(stack, 200);
+    Status *status = status_new();
+    graph *g = NULL;
+    size_t g_sz = 0;
+    int m, n;
+    boolean digraph;
+
+    while (1) {
+        pthread_mutex_lock(&tp->lock);
+        while (tp->chunks_taken < tp->num_chunks && tp->chunks_taken - tp->chunks_written >= tp->window) pthread_cond_wait(&tp->window_free, &tp->lock);
+        if (tp->chunks_taken == tp->num_chunks) {
+            pthread_mutex_unlock(&tp->lock);
+            break;  /* every chunk is taken */
+        }
+        long seq = tp->chunks_taken++;
+        pthread_mutex_unlock(&tp->lock);
+
+        ThroughputChunk *chunk = (ThroughputChunk*)calloc(1, sizeof(ThroughputChunk));
+        if (chunk == NULL) alloc_error("throughput _worker");
+        chunk->seq = seq;
+        chunk->first = seq * THROUGHPUT_CHUNK_LINES;
+        chunk->num_lines = tp->map->num_graphs - chunk->first < THROUGHPUT_CHUNK_LINES ? (int)(tp->map->num_graphs - chunk->first) : THROUGHPUT_CHUNK_LINES;
+        graphwriter_init(&chunk->out, tp->output_format);
+
+        for (int i = 0; i < chunk->num_lines; ++i) {
+            graphmap_graph(tp->map, chunk->first + i, &g, &g_sz, &m, &n, &digraph);
+            canonicalize(status, stack, g, m, n, digraph);
+            if (tp->classes) {
+                long index = chunk->first + i;
+                chunk->classes[i] = dedup_insert(tp->classes, status->best_invar, m, n, digraph, index);
+                /* once an earlier graph has the class this one never will, don't encode it */
+                if (dedup_is_first(chunk->classes[i], index)) graphwriter_encode(&chunk->out, status->best_invar, m, n, digraph);
+                chunk->ends[i] = chunk->out.sz;
+            } else {
+                graphwriter_encode(&chunk->out, status->best_invar, m, n, digraph);
+            }
+            chunk->refines += status->refinement_count;
+            chunk->autos += status->autogrp->sz;
+        }
+
+        pthread_mutex_lock(&tp->lock);
+        tp->done[seq % tp->window] = chunk;
+        pthread_cond_broadcast(&tp->chunk_done);
+        pthread_mutex_unlock(&tp->lock);
+    }
+
+    status_free(status);
+    free(stack->_private);
+    free(stack);
+    FREES(g);
+    return NULL;
+}
+
+/**
+ * --dedup, drops the graphs that aren't the first of their class from a finished chunk's output.
+ * Every earlier chunk is done by now, so whether a graph is first is settled.
+ */
+static void _keep_representatives(Throughput *tp, ThroughputChunk *chunk) {
+    size_t start = 0, kept = 0;
+    for (int i = 0; i < chunk->num_lines; ++i) {
+        size_t end = chunk->ends[i];
+        if (dedup_is_first(chunk->classes[i], chunk->first + i)) {
+            memmove(chunk->out.buf + kept, chunk->out.buf + start, end - start);
+            kept += end - start;
+            dedup_add_class(tp->classes, chunk->classes[i]);
+        }
+        start = end;
+    }
+    chunk->out.sz = kept;
+}
+
+/**
+ * --batch --threads=N.  Same output as run_batch, in the same order, the main thread is the
+ * writer, it takes the finished chunks in order and writes each with one fwrite.
+ */
+void run_throughput(GraphMap *map, char *infilename, FILE *outfile, Options *opts) {
+    double start_time = wtime();  /* mark start time */
+    int num_workers = opts->threads;
+    long graphs = 0;
+    int total_refines = 0, total_autos = 0;
+
+    Throughput tp;
+    tp.map = map;
+    tp.num_chunks = (map->num_graphs + THROUGHPUT_CHUNK_LINES - 1) / THROUGHPUT_CHUNK_LINES;
+    tp.output_format = opts->output_format;
+    tp.classes = opts->dedup ? dedup_new(map->num_graphs) : NULL;
+    pthread_mutex_init(&tp.lock, NULL);
+    pthread_cond_init(&tp.chunk_done, NULL);
+    pthread_cond_init(&tp.window_free, NULL);
+    tp.window = num_workers * THROUGHPUT_CHUNKS_PER_THREAD;
+    tp.done = (ThroughputChunk**)calloc(tp.window, sizeof(ThroughputChunk*));
+    if (tp.done == NULL) alloc_error("run_throughput");
+    tp.chunks_taken = 0;
+    tp.chunks_written = 0;
+
+    pthread_t *workers = (pthread_t*)malloc(sizeof(pthread_t)*num_workers);
+    if (workers == NULL) alloc_error("run_throughput");
+    for (int i = 0; i < num_workers; ++i) {
+        if (pthread_create(&workers[i], NULL, _worker, &tp) != 0) runtime_error("run_throughput: pthread_create failed");
+    }
+
+    /* write the chunks out in order, as they finish */
+    for (long seq = 0; seq < tp.num_chunks; ++seq) {
+        int slot = seq % tp.window;
+        pthread_mutex_lock(&tp.lock);
+        while (tp.done[slot] == NULL) pthread_cond_wait(&tp.chunk_done, &tp.lock);
+        ThroughputChunk *chunk = tp.done[slot];
+        tp.done[slot] = NULL;
+        pthread_mutex_unlock(&tp.lock);
+
+        if (tp.classes) _keep_representatives(&tp, chunk);
+        graphwriter_write(&chunk->out, outfile);
+        graphs += chunk->num_lines;
+        total_refines += chunk->refines;
+        total_autos += chunk->autos;
+        graphwriter_free(&chunk->out);
+        free(chunk);
+
+        pthread_mutex_lock(&tp.lock);
+        ++tp.chunks_written;
+        pthread_cond_broadcast(&tp.window_free);
+        pthread_mutex_unlock(&tp.lock);
+    }
+
+    for (int i = 0; i < num_workers; ++i) pthread_join(workers[i], NULL);
+
+    double runtime = wtime() - start_time;
+    fprintf(stderr, "Batch: %ld graphs, %d refinements, %f seconds, %d threads\n", graphs, total_refines, runtime, num_workers);
+    if (tp.classes) {
+        dedup_report(tp.classes, graphs, opts->countsfilename);
+        dedup_free(tp.classes);
+    }
+    log_output_to_file(infilename, total_refines, total_autos, runtime, -1);
+
+    free(workers);
+    free(tp.done);
+    pthread_mutex_destroy(&tp.lock);
+    pthread_cond_destroy(&tp.chunk_done);
+    pthread_cond_destroy(&tp.window_free);
+}
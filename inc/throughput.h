@@ -0,0 +1,70 @@
+/**
+ * Copyright 2025 Jim Haslett
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Throughput mode, --batch with --threads=N.  Small graphs take microseconds each, so rather
+ * than sharing one search tree, threads each search whole graphs.  The file is mapped, N
+ * workers take chunks of graphs from it in order and canonicalize them, and the main thread
+ * writes the results back out in input order.
+ */
+
+#ifndef _THROUGHPUT_H_
+#define _THROUGHPUT_H_
+
+#include "pcanon.h"
+#include "graphmap.h"
+#include "graphwriter.h"
+#include "dedup.h"
+#include <pthread.h>
+
+#define THROUGHPUT_CHUNK_LINES 64       /* graphs handed to a worker at a time */
+#define THROUGHPUT_CHUNKS_PER_THREAD 4  /* chunks in flight per worker, bounds how far the workers get ahead of the writer */
+
+
+/**
+ * A run of consecutive graphs in the file, and their canonical graphs once a worker is done.
+ */
+typedef struct {
+    long seq;               /* chunk number, the writer writes them in this order */
+    long first;             /* first graph in the chunk */
+    int num_lines;
+    GraphWriter out;        /* the canonical graphs, in order */
+    size_t ends[THROUGHPUT_CHUNK_LINES];            /* --dedup, where each graph's encoding ends in out, empty if it can't be a representative */
+    DedupEntry *classes[THROUGHPUT_CHUNK_LINES];    /* --dedup, each graph's class */
+    int refines;            /* refinements for the whole chunk */
+    int autos;              /* automorphisms found for the whole chunk */
+} ThroughputChunk;
+
+typedef struct {
+    GraphMap *map;
+    long num_chunks;
+    int output_format;              /* --output-format, OUTPUT_* */
+    DedupTable *classes;            /* --dedup, shared by the workers, NULL otherwise */
+    pthread_mutex_t lock;           /* everything below */
+    pthread_cond_t chunk_done;      /* a worker finished a chunk */
+    pthread_cond_t window_free;     /* the writer wrote a chunk */
+
+    int window;                     /* chunks taken but not written yet, at most this many */
+    ThroughputChunk **done;         /* finished chunks, by seq % window */
+
+    long chunks_taken;              /* next seq a worker takes */
+    long chunks_written;            /* next seq the writer wants */
+} Throughput;
+
+
+void run_throughput(GraphMap *map, char *infilename, FILE *outfile, Options *opts);
+
+#endif /* _THROUGHPUT_H_ */
@@ -44,4 +44,63 @@ double wtime() {
 
 void get_timespec(struct timespec *tp) {
     clock_gettime(CLOCK_MONOTONIC_RAW, &tp);
-}
\ No newline at end of file
+}
+
+
+/**
+ * Small seedable random number generator, so runs can be repeated.  rand() is one global
+ * stream, this lets every process (stream) have its own, derived from a single seed.
+ *
+ * rng_seed mixes the seed and stream number with splitmix64, rng_next is xorshift64*.
+ */
+unsigned long rng_seed(unsigned long seed, int stream) {
+    unsigned long z = seed + 0x9E3779B97F4A7C15UL * (unsigned long)(stream + 1);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9UL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBUL;
+    z ^= z >> 31;
+    return z ? z : 0x9E3779B97F4A7C15UL;  /* xorshift state can't be zero */
+}
+
+unsigned long rng_next(unsigned long *state) {
+    unsigned long x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DUL;
+}
+
+/**
+ * 64 bit hash of an array of words, each word goes through the splitmix64 finalizer
+ * before it is folded in, so single bit differences spread over the whole hash.
+ */
+unsigned long hash_words(const unsigned long *words, size_t count) {
+    unsigned long h = 0x9E3779B97F4A7C15UL ^ (unsigned long)count;
+    for (size_t i = 0; i < count; ++i) {
+        unsigned long z = words[i] + 0x9E3779B97F4A7C15UL * (i + 1);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9UL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBUL;
+        h = (h ^ z ^ (z >> 31)) * 0x100000001B3UL;
+    }
+    return h;
+}
+
+/**
+ * 128 bit hash of an array of words into h[0], h[1], for telling whole graphs apart where a 64
+ * bit hash would collide too often.  Two lanes with different multipliers over the same mixed
+ * words, crossed at the end.
+ */
+void hash_words128(const unsigned long *words, size_t count, unsigned long seed, unsigned long *h) {
+    unsigned long a = 0x9E3779B97F4A7C15UL ^ (unsigned long)count ^ seed;
+    unsigned long b = 0xC2B2AE3D27D4EB4FUL ^ (unsigned long)count ^ (seed * 0x9E3779B97F4A7C15UL);
+    for (size_t i = 0; i < count; ++i) {
+        unsigned long z = words[i] + 0x9E3779B97F4A7C15UL * (i + 1);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9UL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBUL;
+        z ^= z >> 31;
+        a = (a ^ z) * 0x100000001B3UL;
+        b = ((b ^ z) * 0x87C37B91114253D5UL) ^ (b >> 29);
+    }
+    h[0] = a ^ (b >> 32) ^ (b << 32);
+    h[1] = b ^ (a * 0x4CF5AD432745937FUL);
+}
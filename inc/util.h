@@ -23,5 +23,9 @@
 void deepcopy(int *src, int src_sz, int *dst, int *dst_sz);
 double wtime();
 void get_timespec(struct timespec *tp);
+unsigned long rng_seed(unsigned long seed, int stream);
+unsigned long rng_next(unsigned long *state);
+unsigned long hash_words(const unsigned long *words, size_t count);
+void hash_words128(const unsigned long *words, size_t count, unsigned long seed, unsigned long *h);
 
 #endif /* _UTIL_H_ */
\ No newline at end of file
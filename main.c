@@ -20,36 +20,190 @@
 #include "inc/util.h"
 // #include "inc/partition.h"
 #include "inc/pcanon.h"
+#include "inc/options.h"
+#include "inc/throughput.h"
+#include "inc/edgefile.h"
+#include "inc/extdedup.h"
+#include "inc/canoncache.h"
+#include "inc/binarygraph.h"
+#include "inc/server.h"
 
+#ifdef MPI
+#include "mpi.h"
+#include "inc/mpi_routines.h"
+#include "inc/collection.h"
+#endif /* if MPI */
 
 
 
+/* opens infilename for reading graphs, exits if it isn't graph6, sparse6 or digraph6 */
+static FILE *_open_graph_file(char *infilename) {
+    int codetype;
+    FILE *infile = opengraphfile(infilename,&codetype,FALSE,1);
+    int format = codetype & ~HAS_HEADER;
+    if (format != GRAPH6 && format != SPARSE6 && format != DIGRAPH6){
+        printf("Unsupported graph type %d encoutered.", codetype);
+        exit(-1);
+    }
+    return infile;
+}
+
+/* --cache=FILE, prints g's cached result and returns TRUE if it has one */
+static boolean _report_cached(graph *g, int m, int n, boolean digraph, Options *opts) {
+    CanonCache *cache = canoncache_open(opts->cachefilename);
+    CacheRecordHeader *rec = canoncache_lookup(cache, g, m, n, digraph);
+    if (rec) canoncache_report(rec, opts);
+    canoncache_close(cache);
+    return rec != NULL;
+}
+
+/**
+ * Reads the first graph from infilename, or the only one for an edge list, DIMACS or binary
+ * file.  A binary graph is mapped, not read, and *bg gets it, otherwise *bg is NULL and the
+ * graph is malloced.  _free_graph lets go of either.
+ */
+static graph *_read_graph(char *infilename, int format, int *m, int *n, boolean *digraph, BinaryGraph **bg) {
+    *bg = NULL;
+    if (format == INPUT_EDGES || format == INPUT_DIMACS) return read_edge_file(infilename, format, m, n, digraph);
+    if (format == INPUT_BINARY) {
+        *bg = binarygraph_open(infilename);
+        *m = (*bg)->m;
+        *n = (*bg)->n;
+        *digraph = (*bg)->digraph;
+        return (*bg)->g;
+    }
+
+    FILE *infile = _open_graph_file(infilename);
+    graph *g = readgg(infile, NULL, 0, m, n, digraph);
+    fclose(infile);
+    return g;
+}
+
+static void _free_graph(graph *g, BinaryGraph *bg) {
+    if (bg) binarygraph_close(bg);
+    else FREES(g);
+}
+
 
 int main( int argc, char **argv){
-    FILE *infile;
-    int codetype;
+    Options opts;
 
-    if (argc < 2){
+    parse_options(&opts, argc, argv);
+    if (opts.serve_path) {
+#ifdef MPI
+        printf("--serve is in the serial build, ./a.out\n");
+        exit(1);
+#else /* if MPI */
+        run_server(&opts);
+        return 0;
+#endif /* if MPI */
+    }
+    if (opts.infilename == NULL){
         printf("Need to pass graph file name as CLI parameter!\n");
+        options_usage(stdout, argv[0]);
         exit(1);
     }
-    char * infilename = argv[1];
+    char * infilename = opts.infilename;
+    int m, n;
+    boolean digraph;
+    int format = edgefile_format(infilename, opts.input_format);
+    BinaryGraph *bg;
 
-    infile = opengraphfile(infilename,&codetype,FALSE,1);
-    if (codetype != GRAPH6 && codetype != (GRAPH6+HAS_HEADER)){
-        printf("Unsupported graph type %d encoutered.", codetype);
-        exit(-1);
+    if (opts.binaryfilename) {
+        /* convert, --to-binary=FILE */
+        graph *g = _read_graph(infilename, format, &m, &n, &digraph, &bg);
+        binarygraph_write(opts.binaryfilename, g, m, n, digraph, BINARYGRAPH_DEGREES | (opts.binary_csr ? BINARYGRAPH_CSR : 0));
+        _free_graph(g, bg);
+        return 0;
+    }
+
+    if (opts.batch) {
+        if (format != INPUT_NAUTY) {
+            printf("--batch reads graph6, sparse6 or digraph6 files\n");
+            exit(1);
+        }
+#ifdef MPI
+        if (opts.outfilename == NULL) {
+            printf("--batch in the mpi build needs --output=FILE, each process writes FILE.<rank>\n");
+            exit(1);
+        }
+        if (opts.dedup) {
+            printf("--dedup needs the whole file in one process, use the serial build with --threads=N\n");
+            exit(1);
+        }
+        MPI_Init(&argc, &argv);
+        FILE *infile = _open_graph_file(infilename);
+        run_collection(infile, infilename, &opts);
+        fclose(infile);
+        MPI_Finalize();
+        return 0;
+#else /* if MPI */
+        FILE *outfile = stdout;
+        if (opts.outfilename && (outfile = fopen(opts.outfilename, "w")) == NULL) {
+            printf("Can't open %s for writing\n", opts.outfilename);
+            exit(1);
+        }
+        if (opts.dedup && opts.dedup_memory_mb > 0) {
+            /* streamed, the file may not fit in memory either */
+            FILE *infile = _open_graph_file(infilename);
+            run_external_dedup(infile, infilename, outfile, &opts);
+            fclose(infile);
+        } else {
+            GraphMap *map = graphmap_open(infilename, opts.threads);
+            if (opts.threads > 1 && opts.cachefilename) fprintf(stderr, "--cache looks up and stores from one thread, ignoring --threads\n");
+            if (opts.threads > 1 && opts.cachefilename == NULL) run_throughput(map, infilename, outfile, &opts);
+            else run_batch(map, infilename, outfile, &opts);
+            graphmap_close(map);
+        }
+        if (outfile != stdout) fclose(outfile);
+        return 0;
+#endif /* if MPI */
     }
-    int m, n;
-    graph *g = readg(infile, NULL, 0, &m, &n);
-    fclose(infile);
+
+#ifdef MPI
+    /** Set up MPI */
+    if (opts.progress_thread) {
+        /* both threads call MPI, so we need full thread support */
+        int provided;
+        MPI_Init_thread(&argc, &argv, MPI_THREAD_MULTIPLE, &provided);
+        if (provided < MPI_THREAD_MULTIPLE) {
+            printf("MPI doesn't provide MPI_THREAD_MULTIPLE, running without the progress thread\n");
+            opts.progress_thread = FALSE;
+        }
+    } else {
+        MPI_Init(&argc, &argv);  /* Initialize MPI */
+    }
+    int my_rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &my_rank);
+
+    /* rank 0 reads the file, everyone else gets the graph from it, one copy per host */
+    MPI_Win graph_win;
+    graph *g = my_rank == 0 ? _read_graph(infilename, format, &m, &n, &digraph, &bg) : NULL;
+    graph *shared = mpi_share_graph(g, &m, &n, &digraph, &graph_win);
+    if (my_rank == 0) _free_graph(g, bg);
+    g = shared;
+#else /* if MPI */
+    graph *g = _read_graph(infilename, format, &m, &n, &digraph, &bg);
+#endif /* if MPI */
 
     // putam(stdout, g, 0, TRUE, FALSE, m, n);  /* visualizes graph */
 
 #ifdef MPI
-    run(g, m, n, TRUE, infilename,  argc, argv);
+    /* rank 0 looks in the cache, everyone searches or nobody does */
+    int cached = 0;
+    if (opts.cachefilename && my_rank == 0) cached = _report_cached(g, m, n, digraph, &opts);
+    MPI_Bcast(&cached, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    if (!cached) run(g, m, n, digraph, TRUE, infilename, &opts);
+#else /* if MPI */
+    if (opts.cachefilename == NULL || !_report_cached(g, m, n, digraph, &opts)) run(g, m, n, digraph, TRUE, infilename, &opts);
+#endif /* if MPI */
+
+#ifdef MPI
+    /** Shut down MPI */
+    MPI_Win_free(&graph_win);   /* frees the shared graph */
+    MPI_Finalize();
 #else /* if MPI */
-    run(g, m, n, TRUE, infilename);
+    _free_graph(g, bg);
 #endif /* if MPI */
 
     
@@ -98,4 +252,5 @@ int main( int argc, char **argv){
 
 
     // printf("\n\ncmp: %d\n", compare_invariants(invar, g, m, n));
+    return 0;
 }
\ No newline at end of file
@@ -0,0 +1,20 @@
+#! /bin/bash
+# Canonical graphs of relabelled copies of a graph have to be identical
+
+copies=${1:-4}
+tmp=$(mktemp -d)
+trap 'rm -rf $tmp' EXIT
+
+python3 util/relabel.py $copies 1 samples/r-20*g6 samples/r-100*g6 samples/test/*g6 > $tmp/samples.g6
+python3 util/relabel.py $copies 2 random 300 70 > $tmp/random.g6
+
+failed=0
+for item in $tmp/samples.g6 $tmp/random.g6; do
+    ./a.out $item --batch > $tmp/canon.g6 || failed=1
+    awk -v copies=$copies -v item=$(basename $item) '
+        NR % copies == 1 { first = $0 }
+        $0 != first { print item ": relabelled copy " NR " has a different canonical graph"; bad = 1 }
+        END { exit bad }' $tmp/canon.g6 || failed=1
+    [ $(wc -l < $tmp/canon.g6) -eq $(wc -l < $item) ] || { echo "$item: graphs missing from the output"; failed=1; }
+done
+exit $failed
@@ -0,0 +1,96 @@
+import sys
+import random
+
+##
+#
+#  Writes randomly relabelled copies of graph6 graphs, for checking that isomorphic inputs
+#  get the same canonical graph (see relabeltest.sh).  Needs nothing outside the standard
+#  library, unlike generate.py.
+#
+##
+
+
+def decode_graph6(line):
+    data = [ord(c) - 63 for c in line]
+    if data[0] < 63:
+        n, data = data[0], data[1:]
+    elif data[1] < 63:
+        n, data = (data[1] << 12) | (data[2] << 6) | data[3], data[4:]
+    else:
+        n, data = 0, data[2:]
+        for x in data[:6]:
+            n = (n << 6) | x
+        data = data[6:]
+    bits = []
+    for x in data:
+        bits.extend((x >> (5 - i)) & 1 for i in range(6))
+    edges = []
+    k = 0
+    for j in range(1, n):
+        for i in range(j):
+            if bits[k]:
+                edges.append((i, j))
+            k += 1
+    return n, edges
+
+
+def encode_graph6(n, edges):
+    if n < 63:
+        out = [n]
+    elif n < 258048:
+        out = [63, n >> 12, (n >> 6) & 63, n & 63]
+    else:
+        out = [63, 63] + [(n >> (30 - 6 * i)) & 63 for i in range(6)]
+    adj = set((min(a, b), max(a, b)) for a, b in edges)
+    bits = [1 if (i, j) in adj else 0 for j in range(1, n) for i in range(j)]
+    bits += [0] * (-len(bits) % 6)
+    for k in range(0, len(bits), 6):
+        x = 0
+        for b in bits[k:k + 6]:
+            x = (x << 1) | b
+        out.append(x)
+    return ''.join(chr(x + 63) for x in out)
+
+
+def random_graph(rng, n, p):
+    return n, [(i, j) for j in range(n) for i in range(j) if rng.random() < p]
+
+
+def usage():
+    print('Usage: ')
+    print(f'{sys.argv[0]} copies seed file.g6 ...\n\tWrites each graph6 graph, then copies-1 random relabellings of it')
+    print(f'{sys.argv[0]} copies seed random count max_n\n\tThe same, for count random graphs of 2 to max_n vertices')
+
+
+def main():
+    if len(sys.argv) < 4:
+        usage()
+        exit(0)
+
+    copies = int(sys.argv[1])
+    rng = random.Random(int(sys.argv[2]))
+
+    graphs = []
+    if sys.argv[3] == 'random':
+        for _ in range(int(sys.argv[4])):
+            graphs.append(random_graph(rng, rng.randint(2, int(sys.argv[5])), rng.choice([0.1, 0.3, 0.5, 0.7])))
+    else:
+        for filename in sys.argv[3:]:
+            with open(filename) as f:
+                for line in f:
+                    line = line.strip()
+                    if line.startswith('>>graph6<<'):
+                        line = line[10:]
+                    if line and line[0] not in ':&':    # graph6 only
+                        graphs.append(decode_graph6(line))
+
+    for n, edges in graphs:
+        print(encode_graph6(n, edges))
+        for _ in range(copies - 1):
+            perm = list(range(n))
+            rng.shuffle(perm)
+            print(encode_graph6(n, [(perm[a], perm[b]) for a, b in edges]))
+
+
+if __name__ == '__main__':
+    main()